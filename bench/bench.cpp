@@ -0,0 +1,223 @@
+// Rela, MIT License
+//
+// Copyright (c) 2021 Sean Pringle <sean.pringle@gmail.com> github:seanpringle
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Benchmark harness. Each case is a script in bench/ run N times on a fresh
+// run-time state. Scripts see a core map "bench" with:
+//
+//   bench.size    operation count for the case
+//   bench.start() start the timer (default: start of run)
+//   bench.stop()  stop the timer (default: end of run, including reset)
+//   bench.noop(x) host callback returning its argument
+//   bench.add(...) host callback summing integer arguments
+//
+// Results are reported as JSON on stdout: median and p99 ns/op per case.
+
+#include "../rela.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+static char* slurp(const char* script);
+
+typedef std::chrono::steady_clock clk;
+
+struct bench_case {
+	const char* name;
+	const char* script;
+	int64_t size;
+};
+
+static bench_case cases[] = {
+	{ "arith_int",        "bench/arith_int.rela",     1000000 },
+	{ "arith_float",      "bench/arith_float.rela",   1000000 },
+	{ "call",             "bench/call.rela",          1000000 },
+	{ "map_insert_100",   "bench/map_insert.rela",        100 },
+	{ "map_insert_10k",   "bench/map_insert.rela",      10000 },
+	{ "map_insert_100k",  "bench/map_insert.rela",     100000 },
+	{ "map_lookup_100",   "bench/map_lookup.rela",        100 },
+	{ "map_lookup_10k",   "bench/map_lookup.rela",      10000 },
+	{ "map_lookup_100k",  "bench/map_lookup.rela",     100000 },
+	{ "vector_push",      "bench/vector_push.rela",    100000 },
+	{ "vector_sort",      "bench/vector_sort.rela",    100000 },
+	{ "string_concat",    "bench/string_concat.rela",  100000 },
+	{ "string_interp",    "bench/string_interp.rela",   10000 },
+	{ "str_split",        "bench/str_split.rela",      100000 },
+	{ "json",             "bench/json.rela",            10000 },
+#ifdef PCRE
+	{ "regex",            "bench/regex.rela",          100000 },
+#endif
+	{ "coroutine",        "bench/coroutine.rela",      100000 },
+	{ "meta",             "bench/meta.rela",            10000 },
+	{ "callback",         "bench/callback.rela",      1000000 },
+	{ "callback_args",    "bench/callback_args.rela", 1000000 },
+	{ "gc",               "bench/gc.rela",              50000 },
+	{ "bulk_sum",         "bench/bulk_sum.rela",      1000000 },
+};
+
+class RelaBench : public Rela {
+public:
+	struct {
+		int main = 0;
+	} modules;
+
+	clk::time_point started;
+	clk::time_point stopped;
+	bool timing = false;
+
+	RelaBench(const char* source, int64_t size) : Rela() {
+		oitem bench = make_map();
+		map_set(bench, make_string("size"), make_integer(size));
+		map_set(bench, make_string("start"), make_function(1));
+		map_set(bench, make_string("stop"), make_function(2));
+		map_set(bench, make_string("noop"), make_function(3));
+		map_set(bench, make_string("add"), make_function(4));
+		map_set(map_core(), make_string("bench"), bench);
+		modules.main = module(source);
+	}
+
+	void execute(int id) override {
+		if (id == 1) start();
+		if (id == 2) stop();
+		if (id == 3) noop();
+		if (id == 4) add();
+	}
+
+	void start() {
+		timing = true;
+		started = clk::now();
+	}
+
+	void stop() {
+		stopped = clk::now();
+		timing = false;
+	}
+
+	void noop() {
+		result(stack_pop());
+	}
+
+	void add() {
+		span in = args();
+		int64_t sum = 0;
+		for (int i = 0; i < in.size(); i++) sum += in.to_integer(i);
+		in.ret(1);
+		in.set_integer(0, sum);
+	}
+
+	// nanoseconds for one run, or -1 on error
+	int64_t measure() {
+		timing = false;
+		started = clk::now();
+		stopped = started;
+		if (run()) return -1;
+		if (timing || stopped == started) stop();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(stopped - started).count();
+	}
+};
+
+static double percentile(std::vector<double>& samples, double pct) {
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)ceil(pct / 100.0 * samples.size());
+	return samples[rank > 0 ? rank-1: 0];
+}
+
+int main(int argc, char* argv[]) {
+	int runs = 10;
+	std::vector<const char*> filters;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i+1 < argc) { runs = atoi(argv[++i]); continue; }
+		filters.push_back(argv[i]);
+	}
+
+	if (runs < 1) {
+		fprintf(stderr, "invalid run count: %d\n", runs);
+		exit(1);
+	}
+
+	bool first = true;
+	fprintf(stdout, "{\n\t\"runs\": %d,\n\t\"cases\": [", runs);
+
+	for (auto& bc: cases) {
+		bool selected = filters.empty();
+		for (auto filter: filters) selected = selected || strstr(bc.name, filter);
+		if (!selected) continue;
+
+		char* source = slurp(bc.script);
+
+		if (!source) {
+			fprintf(stderr, "cannot read script file: %s\n", bc.script);
+			exit(1);
+		}
+
+		std::vector<double> samples;
+		bool failed = false;
+		{
+			RelaBench rela(source, bc.size);
+			for (int i = 0; i < runs && !failed; i++) {
+				int64_t ns = rela.measure();
+				failed = ns < 0;
+				samples.push_back((double)ns / bc.size);
+			}
+		}
+		free(source);
+
+		fprintf(stdout, "%s\n\t\t{ \"name\": \"%s\", \"ops\": %ld, ", first ? "": ",", bc.name, bc.size);
+		first = false;
+
+		if (failed) {
+			fprintf(stdout, "\"error\": true }");
+			continue;
+		}
+
+		double median = percentile(samples, 50.0);
+		double p99 = percentile(samples, 99.0);
+		fprintf(stdout, "\"median_ns_per_op\": %.3f, \"p99_ns_per_op\": %.3f }", median, p99);
+		fflush(stdout);
+	}
+
+	fprintf(stdout, "\n\t]\n}\n");
+	return 0;
+}
+
+static char* slurp(const char* script) {
+	char* source = NULL;
+	struct stat st;
+	if (stat(script, &st) == 0) {
+		FILE *file = fopen(script, "r");
+		if (file) {
+			size_t bytes = st.st_size;
+			source = (char*)malloc(bytes + 1);
+			size_t read = fread(source, 1, bytes, file);
+			source[bytes] = 0;
+			if (read != bytes) {
+				free(source);
+				source = NULL;
+			}
+			fclose(file);
+		}
+	}
+	return source;
+}
@@ -23,17 +23,63 @@
 #include "rela.hpp"
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <tuple>
 static char* slurp(const char* script);
 
+// divmod(a, b) => quotient, remainder
+static std::tuple<int64_t,int64_t> divmod(int64_t a, int64_t b) {
+	return {a / b, a % b};
+}
+
+// bump(counter, n) => counter += n
+static int64_t bump(int64_t* counter, int64_t n) {
+	return *counter += n;
+}
+
+static int64_t touches = 0;
+
+// touch() => nothing
+static void touch() {
+	touches++;
+}
+
 class RelaCLI : public Rela {
 public:
 	struct {
 		int main = 0;
 	} modules;
 
-	RelaCLI(const char* source) : Rela() {
+	RelaCLI(const char* source, bool registers, bool perf) : Rela() {
 		map_set(map_core(), make_string("hello"), make_function(1));
+		map_set(map_core(), make_string("spawn"), make_callback(this, &RelaCLI::spawn));
+		map_set(map_core(), make_string("signal"), make_callback(this, &RelaCLI::signal));
+		map_set(map_core(), make_string("fetch"), make_callback(this, &RelaCLI::fetch));
+		map_set(map_core(), make_string("stale"), make_callback(this, &RelaCLI::stale));
+		map_set(map_core(), make_string("sum"), make_callback(this, &RelaCLI::sum));
+		map_set(map_core(), make_string("greet"), make_callback(this, &RelaCLI::greet));
+		map_set(map_core(), make_string("describe"), make_callback(this, &RelaCLI::describe));
+		map_set(map_core(), make_string("parse"), make_callback(this, &RelaCLI::parse));
+		map_set(map_core(), make_string("twice"), make_callback([](int64_t n) { return n*2; }));
+		// adder(n) => function(x) x+n, registered while a callable runs
+		map_set(map_core(), make_string("adder"), make_callback([this]() {
+			int64_t n = to_integer(stack_pop());
+			oitem fn = make_callback([n](int64_t x) { return x+n; });
+			adders++;
+			result(fn);
+		}));
+		bind<&divmod>("divmod");
+		bind<&bump>("bump");
+		bind<&touch>("touch");
+		bind<&RelaCLI::tallied>("tallied", this);
+		bind<&RelaCLI::counter>("counter", this);
+		bind<&RelaCLI::mean>("mean", this);
+		enable_io();
+		if (registers) enable_registers();
+		if (perf) enable_perf_map();
 		modules.main = module(source);
 	}
 
@@ -41,23 +87,166 @@ public:
 		if (id == 1) hello();
 	}
 
+	// fake async storage backend: requests outstanding until deliver()
+	struct request {
+		int64_t token;
+		std::string key;
+	};
+
+	std::vector<request> requests;
+	int64_t delivered = 0;
+
 	void hello() {
 		stack_push(make_string("hello world"));
 	}
+
+	// spawn(func, args...) => task handle
+	void spawn() {
+		oitem args[32];
+		int argc = arguments(32, args);
+		result(make_integer(Rela::spawn(args[0], 0, argc-1, args+1)));
+	}
+
+	// signal(event, values...) => number of tasks woken
+	void signal() {
+		oitem args[32];
+		int argc = arguments(32, args);
+		result(make_integer(Rela::signal(args[0], argc-1, args+1)));
+	}
+
+	int adders = 0;
+
+	int64_t tally = 0;
+
+	// counter() => userdata
+	int64_t* counter() {
+		return &tally;
+	}
+
+	// tallied() => tally
+	int64_t tallied() const {
+		return tally;
+	}
+
+	// mean(f64 array) => number, reading the raw buffer
+	double mean(oitem array) {
+		size_t count = 0;
+		int kind = 0;
+		double* vals = (double*)array_data(array, &count, &kind);
+		if (kind != ARRAY_F64 || !count) return 0.0;
+		double sum = 0;
+		for (size_t i = 0; i < count; i++) sum += vals[i];
+		return sum / count;
+	}
+
+	// greet(name) => "hello name"
+	std::string greet(const char* name) {
+		return std::string("hello ") + name;
+	}
+
+	// describe(value) => value as text
+	void describe() {
+		char tmp[32];
+		result(make_string(to_text(stack_pop(), tmp, sizeof(tmp))));
+	}
+
+	// parse(json) => value, decoded from a buffer reused straight after
+	void parse() {
+		std::string buf = to_string(stack_pop());
+		oitem val = decode_json(buf.data(), buf.size());
+		buf.assign(buf.size(), '#');
+		result(val);
+	}
+
+	// sum(numbers...) => total, count
+	void sum() {
+		span in = args();
+		double total = 0;
+		for (int i = 0; i < in.size(); i++) total += in.to_number(i);
+		int count = in.size();
+		in.ret(2);
+		in.set_number(0, total);
+		in.set_integer(1, count);
+	}
+
+	// fetch(key) => "key!", requests in flight; answered at once when the
+	// caller cannot be suspended
+	void fetch() {
+		const char* key = to_string(stack_pop());
+		if (!deferrable()) {
+			oitem res[2] = {
+				make_string((std::string(key) + "!").c_str()),
+				make_integer(requests.size()),
+			};
+			results(2, res);
+			return;
+		}
+		requests.push_back({pending(), key});
+	}
+
+	// stale() replays the last completed fetch token, which must fail
+	void stale() {
+		complete(delivered);
+	}
+
+	// complete outstanding fetches, newest first
+	int deliver() {
+		int count = requests.size();
+		while (requests.size()) {
+			request& req = requests.back();
+			oitem res[2] = {
+				make_string((req.key + "!").c_str()),
+				make_integer(count),
+			};
+			complete(req.token, 2, res);
+			delivered = req.token;
+			requests.pop_back();
+		}
+		return count;
+	}
 };
 
-int run(const char* source, bool decompile) {
-	RelaCLI rela(source);
+int run(const char* source, bool decompile, bool registers, bool perf, int64_t slice, int64_t nsecs, const char* transpile) {
+	RelaCLI rela(source, registers, perf);
 	if (decompile) rela.decompile();
-	return rela.run();
+
+	// C++ for the compiled script instead of running it
+	if (transpile) {
+		rela.transpile(stdout, transpile);
+		return 0;
+	}
+
+	// optionally time-sliced to exercise pause/resume
+	rela.start();
+	int rc = Rela::RUN_PAUSED;
+	while (rc == Rela::RUN_PAUSED) rc = rela.resume(slice, nsecs);
+
+	// tasks, completing fetches whenever the scheduler goes idle
+	while (rc == Rela::RUN_DONE || rc == Rela::RUN_PAUSED) {
+		rc = rela.schedule(slice, nsecs);
+		if (rc == Rela::RUN_DONE && !rela.deliver()) break;
+	}
+
+	rela.stop();
+	return rc;
 }
 
 int main(int argc, char* argv[]) {
 	bool decompile = false;
+	bool registers = false;
+	bool perf = false;
+	int64_t slice = 0;
+	int64_t nsecs = 0;
+	bool transpile = false;
 	const char* script = NULL;
 
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-d")) { decompile = true; continue; }
+		if (!strcmp(argv[i], "-r")) { registers = true; continue; }
+		if (!strcmp(argv[i], "-p")) { perf = true; continue; }
+		if (!strcmp(argv[i], "-s") && i+1 < argc) { slice = atoll(argv[++i]); continue; }
+		if (!strcmp(argv[i], "-n") && i+1 < argc) { nsecs = atoll(argv[++i]); continue; }
+		if (!strcmp(argv[i], "-t")) { transpile = true; continue; }
 		script = argv[i];
 	}
 
@@ -73,7 +262,12 @@ int main(int argc, char* argv[]) {
 		exit(1);
 	}
 
-	int rc = run(source, decompile);
+	// unit name from the script file name: test/fib.rela => rela_fib
+	std::string name = "rela_";
+	const char* base = strrchr(script, '/');
+	for (const char* c = base ? base+1: script; *c && *c != '.'; c++) name += isalnum(*c) ? *c: '_';
+
+	int rc = run(source, decompile, registers, perf, slice, nsecs, transpile ? name.c_str(): NULL);
 
 	free(source);
 	return rc;
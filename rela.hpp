@@ -28,7 +28,14 @@
 #include <set>
 #include <map>
 #include <new>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <tuple>
+#include <memory>
 #include <algorithm>
+#include <limits>
 #include <cassert>
 
 #include <stdlib.h>
@@ -37,9 +44,15 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <math.h>
 #include <float.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifndef NDEBUG
 #include <signal.h>
@@ -49,12 +62,30 @@
 #include <pcre.h>
 #endif
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// the baseline JIT emits x86-64 SysV code; elsewhere -DJIT is ignored
+#if defined(JIT) && !(defined(__x86_64__) && defined(__linux__))
+#undef JIT
+#endif
+
+#ifdef JIT
+#include <exception>
+#endif
+
 class Rela {
 
 	enum opcode_t {
-		OP_STOP=0, OP_JMP, OP_FOR, OP_ENTER, OP_LIT, OP_MARK, OP_LIMIT, OP_CLEAN, OP_RETURN,
+		OP_STOP=0, OP_JMP, OP_FOR, OP_ENTER, OP_LIT, OP_MARK, OP_LIMIT, OP_CLEAN, OP_RETURN, OP_TAIL, OP_INLINE,
+		OPR_MOVE, OPR_POP, OPR_ADD, OPR_SUB, OPR_MUL, OPR_DIV, OPR_MOD, OPR_EQ, OPR_NE, OPR_LT, OPR_LTE,
+		OPR_GT, OPR_GTE, OPR_TEQ, OPR_TNE, OPR_TLT, OPR_TLTE, OPR_TGT, OPR_TGTE,
 		OP_LGET, OPP_LCALL, OPP_FNAME, OPP_CFUNC, OPP_ASSIGNL, OPP_ASSIGNP,
 		OPP_MUL_LIT, OPP_ADD_LIT, OPP_GNAME, OPP_COPIES, OPP_UPDATE, OPP_MARK2, OPP_LIMIT2,
+		OPP_VTEMP, OPP_MTEMP, OPP_UNTEMP,
+		OPT_IADD, OPT_ISUB, OPT_IMUL, OPT_IADD_LIT, OPT_IEQ, OPT_INE, OPT_ILT, OPT_ILTE, OPT_IGT, OPT_IGTE,
+		OPT_JIEQ, OPT_JINE, OPT_JILT, OPT_JILTE, OPT_JIGT, OPT_JIGTE, OPT_FADD, OPT_FSUB, OPT_FMUL, OPT_FDIV,
 		OP_PRINT, OP_COROUTINE, OP_RESUME, OP_YIELD, OP_CALL, OP_GLOBAL, OP_MAP, OP_VECTOR, OP_VPUSH,
 		OP_META_SET, OP_META_GET, OP_UNMAP, OP_LOOP, OP_UNLOOP, OP_BREAK, OP_CONTINUE, OP_JFALSE,
 		OP_JTRUE, OP_NIL, OP_COPY, OP_SHUNT, OP_SHIFT, OP_TRUE, OP_FALSE, OP_ASSIGN, OP_AND, OP_OR,
@@ -62,12 +93,17 @@ class Rela {
 		OP_MOD, OP_NOT, OP_EQ, OP_NE, OP_LT, OP_GT, OP_LTE, OP_GTE, OP_CONCAT, OP_MATCH, OP_SORT,
 		OP_ASSERT, OP_SIN, OP_COS, OP_TAN, OP_ASIN, OP_ACOS, OP_ATAN, OP_SINH, OP_COSH, OP_TANH,
 		OP_CEIL, OP_FLOOR, OP_SQRT, OP_ABS, OP_ATAN2, OP_LOG, OP_LOG10, OP_POW, OP_MIN, OP_MAX, OP_TYPE,
-		OP_UNPACK, OP_GC,
+		OP_UNPACK, OP_GC, OP_WAIT, OP_ARRAY, OP_SUM, OP_DOT, OP_ARGMIN, OP_ARGMAX, OP_SCALE, OP_VADD,
+		OP_AXPY, OP_CLAMP, OP_PREFIX, OP_BYTES, OP_SLICE, OP_PEEK, OP_POKE,
+		OP_STR_SPLIT, OP_STR_JOIN, OP_STR_FIND, OP_STR_RFIND, OP_STR_REPLACE, OP_STR_STARTS, OP_STR_ENDS,
+		OP_STR_TRIM, OP_STR_UPPER, OP_STR_LOWER, OP_STR_FORMAT, OP_IO_LINES,
+		OP_JSON_DECODE, OP_JSON_ENCODE, OP_JSON_LINES, OP_CSV_ROWS, OP_CSV_COLUMNS,
+		OP_LAST // opcode count, not an instruction
 	};
 
 	enum type_t {
 		NIL = 0, INTEGER, FLOAT, STRING, BOOLEAN, VECTOR, MAP, SUBROUTINE, COROUTINE, OPERATION,
-		EXECUTE, USERDATA, TYPES
+		EXECUTE, USERDATA, ARRAY, BYTES, VIEW, STREAM, TYPES
 	};
 
 	const char* type_names[TYPES] = {
@@ -83,6 +119,10 @@ class Rela {
 		[OPERATION] = "operation",
 		[EXECUTE] = "callback",
 		[USERDATA] = "userdata",
+		[ARRAY] = "array",
+		[BYTES] = "bytes",
+		[VIEW] = "string",
+		[STREAM] = "stream",
 	};
 
 	enum {
@@ -105,9 +145,13 @@ class Rela {
 	struct map_t;
 	struct cor_t;
 	struct data_t;
+	struct arr_t;
+	struct buf_t;
+	struct stream_t;
 
 	struct item_t {
 		enum type_t type = NIL;
+		uint32_t len = 0; // VIEW length, otherwise padding
 		union {
 			bool flag;
 			int sub;
@@ -118,6 +162,9 @@ class Rela {
 			map_t* map;
 			cor_t* cor;
 			data_t* data;
+			arr_t* arr;
+			buf_t* buf;
+			stream_t* stream;
 			enum opcode_t opcode;
 			int function;
 		};
@@ -139,6 +186,43 @@ class Rela {
 		void* ptr = nullptr;
 	}; // userdata
 
+	static const int STREAM_LINES = 0;
+	static const int STREAM_JSON = 1; // decode each non-blank line
+	static const int STREAM_CSV = 2;  // one record at a time
+
+	// read-only file mapping, or a string, consumed a line or record at a
+	// time by op_for
+	struct stream_t {
+		std::shared_ptr<char> map;
+		item_t src; // string being read, nil for a file mapping
+		size_t size = 0;
+		size_t pos = 0;
+		int mode = STREAM_LINES;
+		char delim = ',';
+		bool numbers = false;
+		bool stop[256] = {}; // csv bytes that end an unquoted field
+		item_t header; // csv column names
+	};
+
+	// typed numeric array, unboxed contiguous storage
+	struct arr_t {
+		item_t meta;
+		int kind = 0;
+		std::vector<unsigned char> bytes;
+	};
+
+	// byte buffer storage, shared by all slices of it
+	struct blob_t {
+		std::vector<unsigned char> bytes;
+	};
+
+	// byte buffer: a window of len bytes at off in a blob
+	struct buf_t {
+		blob_t* blob = nullptr;
+		size_t off = 0;
+		size_t len = 0;
+	};
+
 	// powers of 2
 	static const uint8_t STACK = 32u;
 	static const uint8_t LOCALS = 32u;
@@ -219,6 +303,8 @@ class Rela {
 		bool method = false;
 		bool control = false;
 		bool single = false;
+		bool temp = false; // literal consumed in place, see escape()
+		int typed = -1; // operand type proven by infer(), NIL if none
 	}; // AST
 
 	struct keyword_t {
@@ -283,15 +369,18 @@ class Rela {
 		};
 
 		std::deque<cell> cells;
-		std::vector<pair> lookup;
+		std::vector<pair> lookup; // by address, sorted on demand
 		std::vector<int> recycle;
+		bool sorted = true;
 
-		decltype(lookup.begin()) lower_bound(T* ptr) {
-			return std::lower_bound(lookup.begin(), lookup.end(), ptr, [](const pair& a, const T* b) { return a.key < b; });
-		}
-
+		// only gc() needs lookup by address, so alloc() stays O(1) and
+		// the sort happens once per collection
 		int index(T* ptr) {
-			auto it = lower_bound(ptr);
+			if (!sorted) {
+				std::sort(lookup.begin(), lookup.end(), [](const pair& a, const pair& b) { return a.key < b.key; });
+				sorted = true;
+			}
+			auto it = std::lower_bound(lookup.begin(), lookup.end(), ptr, [](const pair& a, const T* b) { return a.key < b; });
 			return it != lookup.end() && it->key == ptr ? it->val: -1;
 		}
 
@@ -306,9 +395,8 @@ class Rela {
 				cells.emplace_back();
 			}
 
-			auto it = lower_bound(&cells[i].data);
-			assert(it == lookup.end() || it->key != &cells[i].data);
-			lookup.insert(it, {.key = &cells[i].data, .val = i});
+			lookup.push_back({.key = &cells[i].data, .val = i});
+			sorted = false;
 
 			cells[i].used = true;
 			return &cells[i].data;
@@ -318,6 +406,7 @@ class Rela {
 			cells.clear();
 			lookup.clear();
 			recycle.clear();
+			sorted = true;
 		}
 
 		void mark(int i) {
@@ -338,16 +427,17 @@ class Rela {
 					recycle.push_back(i);
 				}
 				else {
-					auto it = lower_bound(&cell.data);
-					lookup.insert(it, {.key = &cell.data, .val = i});
+					lookup.push_back({.key = &cell.data, .val = i});
 				}
 			}
+			sorted = false;
 		}
 	};
 
 	struct string_pool {
 		struct cell {
 			char* data = nullptr;
+			size_t size = 0; // bytes including the terminator, for gc() ranges
 			bool mark = false;
 		};
 
@@ -377,7 +467,9 @@ class Rela {
 			auto it = expect(key);
 			if (it != cells.end() && !strcmp(it->data, key)) return it->data;
 			it = cells.emplace(it);
-			it->data = strdup(key);
+			it->size = strlen(key) + 1;
+			it->data = (char*)malloc(it->size);
+			memcpy(it->data, key, it->size);
 			return it->data;
 		}
 
@@ -404,11 +496,68 @@ class Rela {
 				assert(it == cells.end() || strcmp(it->data, cell.data));
 				it = cells.emplace(it);
 				it->data = cell.data;
+				it->size = cell.size;
 			}
 			other.cells.clear();
 		}
 	};
 
+	// Run-time text that is not interned, like concatenation results.
+	// Bump allocated in blocks; a live view keeps its whole block.
+	struct text_pool {
+		struct block {
+			char* data = nullptr;
+			size_t size = 0;
+			size_t used = 0;
+			bool mark = false;
+		};
+
+		static const size_t BLOCK = 1<<16;
+
+		std::vector<block> blocks;
+
+		~text_pool() {
+			clear();
+		}
+
+		void clear() {
+			for (auto& block: blocks) free(block.data);
+			blocks.clear();
+		}
+
+		char* alloc(size_t len) {
+			if (blocks.empty() || blocks.back().size - blocks.back().used < len) {
+				block fresh;
+				fresh.size = len > BLOCK ? len: BLOCK;
+				fresh.data = (char*)malloc(fresh.size);
+				blocks.push_back(fresh);
+			}
+			block& last = blocks.back();
+			char* ptr = last.data + last.used;
+			last.used += len;
+			return ptr;
+		}
+
+		void purge() {
+			for (auto it = blocks.begin(); it != blocks.end(); ) {
+				if (it->mark) {
+					it->mark = false;
+					++it;
+					continue;
+				}
+				free(it->data);
+				it = blocks.erase(it);
+			}
+		}
+	};
+
+	// memory a view may point into, found by address during gc()
+	struct text_range {
+		const char* lo;
+		const char* hi;
+		bool* mark;
+	};
+
 	// routines[0] == main coroutine, always set at run-time
 	// routines[1...n] resume/yield chain
 	vec_t routines;
@@ -422,6 +571,19 @@ class Rela {
 	pool_t<vec_t> vecs;
 	pool_t<cor_t> cors;
 	pool_t<data_t> data;
+	pool_t<arr_t> arrs;
+	pool_t<blob_t> blobs;
+	pool_t<buf_t> bufs;
+	pool_t<stream_t> streams;
+
+	// scratch storage for literals that never escape their expression,
+	// outside the pools so gc() leaves it alone
+	struct {
+		std::deque<vec_t> vecs;
+		std::deque<map_t> maps;
+		std::vector<vec_t*> vecs_free;
+		std::vector<map_t*> maps_free;
+	} temps;
 
 	// compiled "bytecode"
 	std::vector<code_t> code;
@@ -434,6 +596,9 @@ class Rela {
 	string_pool stringsA; // young
 	string_pool stringsB; // old
 
+	text_pool texts;
+	std::vector<text_range> ranges;
+
 	// compile-time scope tree
 	struct {
 		int id = 0;
@@ -444,6 +609,10 @@ class Rela {
 		int id = 0;
 		std::vector<int> up;
 		std::vector<const char*> locals;
+		std::vector<std::pair<int,item_t>> presets; // register constants
+		int names = 0;  // named locals, counted before compiling
+		int hidden = 0; // compiler-owned locals
+		bool tails = false; // frame may be replaced by a tail call
 	};
 
 	std::deque<scope> scopes;
@@ -471,6 +640,76 @@ class Rela {
 	static const int COR_RUNNING = 1;
 	static const int COR_DEAD = 2;
 
+	// ticks between deadline checks when running with a time budget
+	static const int64_t SLICE = 1024;
+
+	// ticks nested execution may run past the host's budget before the
+	// run fails, so small slices do not break valid meta-methods
+	static const int64_t NEST_SPARE = 100000;
+
+	// resumable run state between start() and stop()
+	struct {
+		std::vector<int> mods;
+		int next = 0;
+		bool active = false;
+		bool ticking = false;
+	} session;
+
+	// Budget seen by nested execution. method() and coroutine iterators run
+	// to completion on the C++ stack and cannot pause, so their ticks are
+	// charged to the budget of the tick_loop() in progress once they return,
+	// and any overrun ends the current slice. Nested execution that runs
+	// NEST_SPARE ticks past the host's budget, or past the deadline, fails.
+	struct {
+		int64_t spent = 0;     // nested ticks not yet charged
+		int64_t total = 0;     // nested ticks in this tick_until()
+		int64_t limit = -1;    // cap on total, -1 unlimited
+		int64_t deadline = 0;
+	} nest;
+
+	// host-scheduled coroutine
+	struct task_t {
+		cor_t* cor = nullptr;
+		int priority = 0;
+		int state = 0;
+		int64_t spent = 0; // ticks used in the current turn
+		item_t event;      // parked on
+		std::vector<item_t> inbox; // values delivered on wake
+		std::vector<item_t> chain; // routines chain saved on preemption
+		int64_t token = 0; // outstanding pending() call
+	};
+
+	std::deque<task_t> tasks;
+	std::vector<int> tasks_free;
+	// priority => FIFO of ready task ids
+	std::map<int,std::deque<int>> ready;
+	// event => vector of parked task ids
+	map_t waiting;
+	// task executing in schedule(), or -1
+	int running = -1;
+	// pending() calls issued; never reset so stale tokens stay stale
+	int64_t calls = 0;
+	// method() calls and coroutine iterators in progress on the C++ stack
+	int nesting = 0;
+
+	// registered host callable: a bind<>() trampoline called directly with
+	// its object, or a std::function for everything else
+	struct callable_t {
+		void (*direct)(Rela* rela, void* obj) = nullptr;
+		void* obj = nullptr;
+		std::function<void()> fn;
+		bool temp = false; // registered at run time, collectable
+		bool used = true;
+		bool mark = false;
+	};
+
+	// registered host callables, EXECUTE ids -1, -2, ... A deque, so a
+	// callable that registers another is not moved while it runs.
+	// Callables registered between start() and stop() are collected by
+	// gc() like other run-time values, and their slots reused.
+	std::deque<callable_t> callables;
+	std::vector<int> callables_free;
+
 	void gc_mark_item(item_t item) {
 		if (item.type == STRING) gc_mark_str(item.str);
 		if (item.type == VECTOR) gc_mark_vec(item.vec);
@@ -478,6 +717,11 @@ class Rela {
 		if (item.type == COROUTINE) gc_mark_cor(item.cor);
 		if (item.type == USERDATA && item.data->meta.type != NIL) gc_mark_item(item.data->meta);
 		if (item.type == USERDATA) gc_mark_data(item.data);
+		if (item.type == ARRAY) gc_mark_arr(item.arr);
+		if (item.type == BYTES) gc_mark_buf(item.buf);
+		if (item.type == VIEW) gc_mark_view(item.str);
+		if (item.type == STREAM) gc_mark_stream(item.stream);
+		if (item.type == EXECUTE && item.function < 0) callables[-item.function-1].mark = true;
 	}
 
 	void gc_mark_str(const char* str) {
@@ -528,6 +772,39 @@ class Rela {
 		}
 	}
 
+	void gc_mark_arr(arr_t* arr) {
+		if (!arr) return;
+		gc_mark_item(arr->meta);
+		int index = arrs.index(arr);
+		if (index >= 0) arrs.mark(index);
+	}
+
+	// A view marks the young string or text block containing it. Old
+	// strings are never collected so need no mark.
+	void gc_mark_view(const char* str) {
+		auto it = std::upper_bound(ranges.begin(), ranges.end(), str, [](const char* p, const text_range& r) {
+			return p < r.lo;
+		});
+		if (it == ranges.begin()) return;
+		--it;
+		if (str < it->hi) *it->mark = true;
+	}
+
+	void gc_mark_stream(stream_t* stream) {
+		int index = streams.index(stream);
+		if (index >= 0) streams.mark(index);
+		gc_mark_item(stream->src);
+		gc_mark_item(stream->header);
+	}
+
+	void gc_mark_buf(buf_t* buf) {
+		if (!buf) return;
+		int index = bufs.index(buf);
+		if (index >= 0) bufs.mark(index);
+		index = blobs.index(buf->blob);
+		if (index >= 0) blobs.mark(index);
+	}
+
 	void gc_mark_data(data_t* datum) {
 		if (!datum) return;
 		int index = data.index(datum);
@@ -538,6 +815,14 @@ class Rela {
 	// at run-time. Can be explicitly triggered with "collect()" via
 	// script or with rela_collect() via callback.
 	void gc() {
+		ranges.clear();
+		for (auto& cell: stringsA.cells) ranges.push_back({cell.data, cell.data + cell.size, &cell.mark});
+		for (auto& block: texts.blocks) ranges.push_back({block.data, block.data + block.size, &block.mark});
+		for (auto& cell: streams.cells) {
+			if (cell.used && cell.data.size && cell.data.src.type == NIL) ranges.push_back({cell.data.map.get(), cell.data.map.get() + cell.data.size, &cell.mark});
+		}
+		std::sort(ranges.begin(), ranges.end(), [](const text_range& a, const text_range& b) { return a.lo < b.lo; });
+
 		gc_mark_map(scope_core);
 		gc_mark_map(scope_global);
 
@@ -545,6 +830,15 @@ class Rela {
 			gc_mark_cor(vec_get(&routines, i).cor);
 		}
 
+		for (auto& task: tasks) {
+			gc_mark_cor(task.cor);
+			gc_mark_item(task.event);
+			for (auto& item: task.inbox) gc_mark_item(item);
+			for (auto& item: task.chain) gc_mark_item(item);
+		}
+
+		gc_mark_map(&waiting);
+
 		for (int i = 0, l = code.size(); i < l; i++) {
 			gc_mark_item(code[i].item);
 		}
@@ -557,7 +851,27 @@ class Rela {
 		maps.purge();
 		cors.purge();
 		data.purge();
+		arrs.purge();
+		bufs.purge();
+		blobs.purge();
+		streams.purge();
 		stringsA.purge();
+		texts.purge();
+		ranges.clear();
+		callables_purge(false);
+	}
+
+	// release unmarked run-time callables, or all of them, leaving the
+	// function in place until the slot is reused in case one is running
+	void callables_purge(bool all) {
+		for (int i = 0, l = callables.size(); i < l; i++) {
+			callable_t& c = callables[i];
+			if (c.temp && c.used && (all || !c.mark)) {
+				c.used = false;
+				callables_free.push_back(i);
+			}
+			c.mark = false;
+		}
 	}
 
 	vec_t* vec_allot() {
@@ -572,6 +886,213 @@ class Rela {
 		return data.alloc();
 	}
 
+	arr_t* arr_allot(int kind) {
+		arr_t* arr = arrs.alloc();
+		arr->kind = kind;
+		return arr;
+	}
+
+	size_t arr_width(int kind) {
+		return kind == ARRAY_I32 || kind == ARRAY_F32 ? 4: 8;
+	}
+
+	size_t arr_size(arr_t* arr) {
+		return arr ? arr->bytes.size() / arr_width(arr->kind): 0;
+	}
+
+	void arr_resize(arr_t* arr, size_t count) {
+		arr->bytes.resize(count * arr_width(arr->kind));
+	}
+
+	item_t arr_get(arr_t* arr, int index) {
+		if (index < 0) index = (int)arr_size(arr) + index;
+		must(index >= 0 && index < (int)arr_size(arr), "array index out of bounds");
+		void* p = arr->bytes.data();
+		switch (arr->kind) {
+			case ARRAY_F64: return number(((double*)p)[index]);
+			case ARRAY_I64: return integer(((int64_t*)p)[index]);
+			case ARRAY_I32: return integer(((int32_t*)p)[index]);
+			case ARRAY_F32: return number(((float*)p)[index]);
+		}
+		return nil();
+	}
+
+	// index == size appends
+	void arr_set(arr_t* arr, int index, item_t val) {
+		char tmp[STRTMP];
+		must(val.type == INTEGER || val.type == FLOAT, "array values must be numbers: %s", tmptext(val, tmp, sizeof(tmp)));
+		int size = arr_size(arr);
+		if (index < 0) index = size + index;
+		if (index == size) arr_resize(arr, ++size);
+		must(index >= 0 && index < size, "array index out of bounds");
+		void* p = arr->bytes.data();
+		bool i = val.type == INTEGER;
+		// truncating a NaN, infinite or out of range float is undefined
+		if (!i && arr->kind == ARRAY_I64)
+			must(val.fnum >= -9223372036854775808.0 && val.fnum < 9223372036854775808.0, "array value out of range for i64: %s", tmptext(val, tmp, sizeof(tmp)));
+		if (!i && arr->kind == ARRAY_I32)
+			must(val.fnum > -2147483649.0 && val.fnum < 2147483648.0, "array value out of range for i32: %s", tmptext(val, tmp, sizeof(tmp)));
+		if (i && arr->kind == ARRAY_I32)
+			must(val.inum >= INT32_MIN && val.inum <= INT32_MAX, "array value out of range for i32: %s", tmptext(val, tmp, sizeof(tmp)));
+		switch (arr->kind) {
+			case ARRAY_F64: ((double*)p)[index] = i ? val.inum: val.fnum; break;
+			case ARRAY_I64: ((int64_t*)p)[index] = i ? val.inum: (int64_t)val.fnum; break;
+			case ARRAY_I32: ((int32_t*)p)[index] = i ? val.inum: (int32_t)val.fnum; break;
+			case ARRAY_F32: ((float*)p)[index] = i ? val.inum: val.fnum; break;
+		}
+	}
+
+	int arr_kind(const char* name) {
+		if (!strcmp(name, "f64")) return ARRAY_F64;
+		if (!strcmp(name, "i64")) return ARRAY_I64;
+		if (!strcmp(name, "i32")) return ARRAY_I32;
+		if (!strcmp(name, "f32")) return ARRAY_F32;
+		must(false, "unknown array kind: %s", name);
+		return -1;
+	}
+
+	// call fn with a typed pointer to the elements
+	template <typename F>
+	void arr_visit(arr_t* arr, F fn) {
+		void* p = arr->bytes.data();
+		switch (arr->kind) {
+			case ARRAY_F64: fn((double*)p); break;
+			case ARRAY_I64: fn((int64_t*)p); break;
+			case ARRAY_I32: fn((int32_t*)p); break;
+			case ARRAY_F32: fn((float*)p); break;
+		}
+	}
+
+	buf_t* buf_allot(size_t len) {
+		buf_t* buf = bufs.alloc();
+		buf->blob = blobs.alloc();
+		buf->blob->bytes.resize(len);
+		buf->len = len;
+		return buf;
+	}
+
+	// O(1) view sharing the blob
+	buf_t* buf_slice(buf_t* src, size_t off, size_t len) {
+		must(off <= src->len && len <= src->len - off, "bytes slice out of bounds");
+		buf_t* buf = bufs.alloc();
+		buf->blob = src->blob;
+		buf->off = src->off + off;
+		buf->len = len;
+		return buf;
+	}
+
+	unsigned char* buf_data(buf_t* buf) {
+		return buf->blob->bytes.data() + buf->off;
+	}
+
+	// bounds checked pointer to width bytes at off
+	unsigned char* buf_window(buf_t* buf, int64_t off, size_t width) {
+		must(off >= 0 && (size_t)off <= buf->len && width <= buf->len - off, "bytes offset out of bounds");
+		return buf_data(buf) + off;
+	}
+
+	item_t buf_get(buf_t* buf, int index) {
+		if (index < 0) index = (int)buf->len + index;
+		return integer(*buf_window(buf, index, 1));
+	}
+
+	// index == len appends, if the view ends at the end of its blob
+	void buf_set(buf_t* buf, int index, item_t val) {
+		char tmp[STRTMP];
+		must(val.type == INTEGER, "bytes values must be integers: %s", tmptext(val, tmp, sizeof(tmp)));
+		must(val.inum >= 0 && val.inum <= 255, "bytes values must be 0-255: %lld", (long long)val.inum);
+		if (index < 0) index = (int)buf->len + index;
+		if (index == (int)buf->len) {
+			must(buf->off + buf->len == buf->blob->bytes.size(), "cannot append to a bytes slice");
+			buf->blob->bytes.push_back(0);
+			buf->len++;
+		}
+		*buf_window(buf, index, 1) = val.inum;
+	}
+
+	// peek/poke layout: u8 i8 u16le i16be ... u64le i64be f32le f64be
+	struct buf_fmt_t {
+		char kind;
+		size_t width;
+		bool big;
+	};
+
+	buf_fmt_t buf_format(const char* fmt) {
+		must(fmt[0], "unknown bytes format: %s", fmt);
+		buf_fmt_t f = {fmt[0], 0, false};
+		char* end = nullptr;
+		long bits = strtol(fmt+1, &end, 10);
+		f.width = bits/8;
+		f.big = !strcmp(end, "be");
+		bool ok = (f.kind == 'u' || f.kind == 'i') && (bits == 8 || bits == 16 || bits == 32 || bits == 64);
+		ok = ok || (f.kind == 'f' && (bits == 32 || bits == 64));
+		ok = ok && (!strcmp(end, "le") || !strcmp(end, "be") || (bits == 8 && !end[0]));
+		must(ok, "unknown bytes format: %s", fmt);
+		return f;
+	}
+
+	item_t buf_peek(buf_t* buf, int64_t off, const char* fmt) {
+		buf_fmt_t f = buf_format(fmt);
+		unsigned char* p = buf_window(buf, off, f.width);
+		uint64_t raw = 0;
+		for (size_t i = 0; i < f.width; i++) raw |= (uint64_t)p[f.big ? f.width-1-i: i] << (i*8);
+
+		if (f.kind == 'f' && f.width == 4) {
+			uint32_t bits = raw; float val;
+			memcpy(&val, &bits, sizeof(val));
+			return number(val);
+		}
+		if (f.kind == 'f') {
+			double val;
+			memcpy(&val, &raw, sizeof(val));
+			return number(val);
+		}
+		if (f.kind == 'i' && f.width < 8) {
+			int shift = 64 - f.width*8;
+			return integer((int64_t)(raw << shift) >> shift);
+		}
+		return integer((int64_t)raw);
+	}
+
+	void buf_poke(buf_t* buf, int64_t off, const char* fmt, item_t val) {
+		char tmp[STRTMP];
+		must(val.type == INTEGER || val.type == FLOAT, "bytes values must be numbers: %s", tmptext(val, tmp, sizeof(tmp)));
+		buf_fmt_t f = buf_format(fmt);
+		unsigned char* p = buf_window(buf, off, f.width);
+		bool i = val.type == INTEGER;
+		uint64_t raw = 0;
+
+		if (f.kind == 'f' && f.width == 4) {
+			float num = i ? val.inum: val.fnum; uint32_t bits;
+			memcpy(&bits, &num, sizeof(bits));
+			raw = bits;
+		}
+		else
+		if (f.kind == 'f') {
+			double num = i ? val.inum: val.fnum;
+			memcpy(&raw, &num, sizeof(raw));
+		}
+		else {
+			// the field's range; u64 integers stop at INT64_MAX
+			int bits = f.width*8;
+			bool sign = f.kind == 'i';
+			if (i) {
+				int64_t lo = sign ? (bits < 64 ? -(INT64_C(1) << (bits-1)): INT64_MIN): 0;
+				int64_t hi = bits < 64 ? (INT64_C(1) << (bits-sign)) - 1: INT64_MAX;
+				must(val.inum >= lo && val.inum <= hi, "bytes value out of range for %s: %s", fmt, tmptext(val, tmp, sizeof(tmp)));
+				raw = val.inum;
+			}
+			else {
+				// truncating a NaN, infinite or out of range float is undefined
+				double num = trunc(val.fnum);
+				double lim = ldexp(1.0, bits-sign);
+				must(num >= (sign ? -lim: 0.0) && num < lim, "bytes value out of range for %s: %s", fmt, tmptext(val, tmp, sizeof(tmp)));
+				raw = sign ? (uint64_t)(int64_t)num: (uint64_t)num;
+			}
+		}
+		for (size_t j = 0; j < f.width; j++) p[f.big ? f.width-1-j: j] = raw >> (j*8);
+	}
+
 	cor_t* cor_allot() {
 		return cors.alloc();
 	}
@@ -656,6 +1177,7 @@ class Rela {
 	}
 
 	void map_set(map_t* map, item_t key, item_t val) {
+		key = text_intern(key);
 		if (val.type == NIL) {
 			map_clr(map, key);
 			return;
@@ -675,6 +1197,43 @@ class Rela {
 		return (index >= 0) ? stringsB.cells[index].data: stringsA.insert(str);
 	}
 
+	const char* strintern(const char* str, size_t len) {
+		std::string tmp(str, len);
+		return strintern(tmp.c_str());
+	}
+
+	bool is_text(item_t a) {
+		return a.type == STRING || a.type == VIEW;
+	}
+
+	// string or slice contents, not NUL terminated
+	const char* text_data(item_t a, size_t* len) {
+		*len = a.type == VIEW ? a.len: strlen(a.str);
+		return a.str;
+	}
+
+	// Slices are only interned on demand: map keys, and host or library
+	// code that needs a NUL terminated string
+	item_t text_intern(item_t a) {
+		if (a.type != VIEW) return a;
+		size_t len = 0;
+		const char* str = text_data(a, &len);
+		return (item_t){.type = STRING, .str = strintern(str, len)};
+	}
+
+	// O(1) view of len bytes at off in a string or view
+	item_t text_slice(item_t src, size_t off, size_t len) {
+		size_t size = 0;
+		const char* str = text_data(src, &size);
+		must(off <= size && len <= size - off, "string slice out of bounds");
+		return view(str + off, len);
+	}
+
+	item_t view(const char* str, size_t len) {
+		must(len <= UINT32_MAX, "string view too long");
+		return (item_t){.type = VIEW, .len = (uint32_t)len, .str = str};
+	}
+
 	const char* substr(const char *start, int off, int len) {
 		char buf[STRBUF];
 		must(len < STRBUF, "substr max len exceeded (%d bytes)", STRBUF-1);
@@ -727,6 +1286,16 @@ class Rela {
 		scope_global = nullptr;
 		routines.items.clear();
 		routine = nullptr;
+		tasks.clear();
+		tasks_free.clear();
+		ready.clear();
+		waiting = map_t();
+		running = -1;
+		temps.vecs.clear();
+		temps.maps.clear();
+		temps.vecs_free.clear();
+		temps.maps_free.clear();
+		callables_purge(true);
 		gc();
 	}
 
@@ -754,6 +1323,8 @@ class Rela {
 		if (a.type == INTEGER) return a.inum != 0;
 		if (a.type == FLOAT) return a.fnum > 0+DBL_EPSILON || a.fnum < 0-DBL_EPSILON;
 		if (a.type == STRING) return a.str && a.str[0];
+		if (a.type == VIEW) return a.len > 0;
+		if (a.type == STREAM) return true;
 		if (a.type == BOOLEAN) return a.flag;
 		if (a.type == VECTOR) return vec_size(a.vec) > 0;
 		if (a.type == MAP) return vec_size(&a.map->keys) > 0;
@@ -762,6 +1333,8 @@ class Rela {
 		if (a.type == OPERATION) return true;
 		if (a.type == EXECUTE) return true;
 		if (a.type == USERDATA) return a.data != nullptr;
+		if (a.type == ARRAY) return arr_size(a.arr) > 0;
+		if (a.type == BYTES) return a.buf->len > 0;
 		return false;
 	}
 
@@ -780,6 +1353,14 @@ class Rela {
 		item_t argv[2] = {a,b};
 		item_t retv[1];
 
+		if (a.type == VIEW || b.type == VIEW) {
+			if (!is_text(a) || !is_text(b)) return false;
+			size_t lenA = 0, lenB = 0;
+			const char* strA = text_data(a, &lenA);
+			const char* strB = text_data(b, &lenB);
+			return lenA == lenB && !memcmp(strA, strB, lenA);
+		}
+
 		if (a.type == b.type) {
 			if (a.type == INTEGER) return a.inum == b.inum;
 			if (a.type == FLOAT) return fabs(a.fnum - b.fnum) < DBL_EPSILON*10;
@@ -815,12 +1396,27 @@ class Rela {
 				return truth(retv[0]);
 			}
 			if (a.type == USERDATA) return a.data == b.data;
+			if (a.type == ARRAY && a.arr == b.arr) return true;
+			if (a.type == ARRAY && arr_size(a.arr) == arr_size(b.arr)) {
+				for (int i = 0, l = arr_size(a.arr); i < l; i++) {
+					if (!equal(arr_get(a.arr, i), arr_get(b.arr, i))) return false;
+				}
+				return true;
+			}
+			if (a.type == BYTES) return a.buf->len == b.buf->len && !memcmp(buf_data(a.buf), buf_data(b.buf), a.buf->len);
 			if (a.type == NIL) return true;
 		}
 		return false;
 	}
 
 	bool less(item_t a, item_t b) {
+		if ((a.type == VIEW || b.type == VIEW) && is_text(a) && is_text(b)) {
+			size_t lenA = 0, lenB = 0;
+			const char* strA = text_data(a, &lenA);
+			const char* strB = text_data(b, &lenB);
+			int cmp = memcmp(strA, strB, std::min(lenA, lenB));
+			return cmp < 0 || (cmp == 0 && lenA < lenB);
+		}
 		if (a.type == b.type) {
 			if (a.type == INTEGER) return a.inum < b.inum;
 			if (a.type == FLOAT) return a.fnum < b.fnum;
@@ -840,6 +1436,11 @@ class Rela {
 				return truth(retv[0]);
 			}
 			if (a.type == MAP) return vec_size(&a.map->keys) < vec_size(&b.map->keys);
+			if (a.type == ARRAY) return arr_size(a.arr) < arr_size(b.arr);
+			if (a.type == BYTES) {
+				int cmp = memcmp(buf_data(a.buf), buf_data(b.buf), std::min(a.buf->len, b.buf->len));
+				return cmp < 0 || (cmp == 0 && a.buf->len < b.buf->len);
+			}
 			if (a.type == USERDATA && meta_get(a.data->meta, "<", &func)) {
 				method(func, 2, argv, 1, retv);
 				return truth(retv[0]);
@@ -856,8 +1457,11 @@ class Rela {
 		if (a.type == INTEGER) return a.inum;
 		if (a.type == FLOAT) return floor(a.fnum);
 		if (a.type == STRING) return strlen(a.str);
+		if (a.type == VIEW) return a.len;
 		if (a.type == VECTOR) return vec_size(a.vec);
 		if (a.type == MAP) return vec_size(&a.map->keys);
+		if (a.type == ARRAY) return arr_size(a.arr);
+		if (a.type == BYTES) return a.buf->len;
 		if (a.type == USERDATA && meta_get(a.data->meta, "#", &func)) {
 			method(func, 1, argv, 1, retv);
 			must(retv[0].type == INTEGER, "meta method # should return an integer");
@@ -944,6 +1548,14 @@ class Rela {
 	const char* tmptext(item_t a, char* tmp, int size) {
 		if (a.type == STRING) return a.str;
 
+		// longer run-time text is interned rather than cut short
+		if (a.type == VIEW) {
+			if ((int)a.len >= size) return text_intern(a).str;
+			memcpy(tmp, a.str, a.len);
+			tmp[a.len] = 0;
+			return tmp;
+		}
+
 		item_t func;
 		item_t argv[1] = {a};
 		item_t retv[1];
@@ -961,8 +1573,8 @@ class Rela {
 
 		if (a.type == USERDATA && meta_get(a.data->meta, "$", &func)) {
 			method(func, 1, argv, 1, retv);
-			must(retv[0].type == STRING, "$ should return a string");
-			return retv[0].str;
+			must(is_text(retv[0]), "$ should return a string");
+			return text_intern(retv[0]).str;
 		}
 
 		if (a.type == USERDATA) snprintf(tmp, size, "%s", type_names[a.type]);
@@ -972,8 +1584,8 @@ class Rela {
 
 		if (a.type == VECTOR && meta_get(a.vec->meta, "$", &func)) {
 			method(func, 1, argv, 1, retv);
-			must(retv[0].type == STRING, "$ should return a string");
-			return retv[0].str;
+			must(is_text(retv[0]), "$ should return a string");
+			return text_intern(retv[0]).str;
 		}
 
 		if (a.type == VECTOR) {
@@ -986,10 +1598,27 @@ class Rela {
 			if (len < size) len += snprintf(tmp+len, size-len, "]");
 		}
 
+		if (a.type == ARRAY) {
+			int len = snprintf(tmp, size, "[");
+			for (int i = 0, l = arr_size(a.arr); len < size && i < l; i++) {
+				if (len < size) len += snprintf(tmp+len, size-len, "%s",
+					tmptext(arr_get(a.arr, i), subtmpA, sizeof(subtmpA)));
+				if (len < size && i < l-1) len += snprintf(tmp+len, size-len, ", ");
+			}
+			if (len < size) len += snprintf(tmp+len, size-len, "]");
+		}
+
+		if (a.type == BYTES) {
+			int len = snprintf(tmp, size, "<");
+			for (size_t i = 0, l = a.buf->len; len < size && i < l; i++)
+				len += snprintf(tmp+len, size-len, i < l-1 ? "%02x ": "%02x", buf_data(a.buf)[i]);
+			if (len < size) len += snprintf(tmp+len, size-len, ">");
+		}
+
 		if (a.type == MAP && meta_get(a.map->meta, "$", &func)) {
 			method(func, 1, argv, 1, retv);
-			must(retv[0].type == STRING, "$ should return a string");
-			return retv[0].str;
+			must(is_text(retv[0]), "$ should return a string");
+			return text_intern(retv[0]).str;
 		}
 
 		if (a.type == MAP) {
@@ -1123,6 +1752,31 @@ class Rela {
 				return code.size()-1;
 			}
 
+			// lit,iadd
+			if (op == OPT_IADD && back1->op == OP_LIT) {
+				back1->op = OPT_IADD_LIT;
+				return code.size()-1;
+			}
+
+			// lit,isub
+			if (op == OPT_ISUB && back1->op == OP_LIT) {
+				back1->op = OPT_IADD_LIT;
+				back1->item.inum = -back1->item.inum;
+				return code.size()-1;
+			}
+
+			// icmp,jfalse -> jicmp (the following drop is folded in too)
+			if (op == OP_JFALSE && back1->op >= OPT_IEQ && back1->op <= OPT_IGTE) {
+				back1->op = (enum opcode_t)(back1->op - OPT_IEQ + OPT_JIEQ);
+				back1->item = item;
+				return code.size()-1;
+			}
+
+			// jicmp,drop
+			if (op == OP_DROP && back1->op >= OPT_JIEQ && back1->op <= OPT_JIGTE && back1->item.type == NIL) {
+				return code.size()-1;
+			}
+
 			// lit,mul
 			if (op == OP_MUL && back1->op == OP_LIT) {
 				back1->op = OPP_MUL_LIT;
@@ -1224,6 +1878,7 @@ class Rela {
 	item_t pop_type(int type) {
 		item_t i = pop();
 		if (type == FLOAT && i.type == INTEGER) return number(i.inum);
+		if (type == STRING && i.type == VIEW) return text_intern(i);
 		must(i.type == type, "pop_type expected %s, found %s", type_names[type], type_names[i.type]);
 		return i;
 	}
@@ -1872,6 +2527,37 @@ class Rela {
 		return local;
 	}
 
+	// locals a block dropped at compile time would have declared, so later
+	// reads still resolve to them rather than to globals
+	void compile_declare(node_t* scope, node_t* node) {
+		if (!scope || !node) return;
+
+		if (node->type == NODE_FUNCTION) {
+			if (node->item.type) compile_local(scope, node);
+			return;
+		}
+
+		if (node->type == NODE_MULTI) {
+			for (auto key: node->keys) {
+				if (key->type == NODE_NAME && !key->index && !key->field && !key->call && !key->chain)
+					compile_local(scope, key);
+			}
+		}
+
+		if (node->type == NODE_FOR) {
+			for (auto& key: node->fkeys) {
+				node_t* nkey = node_allot();
+				nkey->item = key;
+				compile_local(scope, nkey);
+			}
+		}
+
+		compile_declare(scope, node->args);
+		compile_declare(scope, node->chain);
+		for (auto key: node->keys) compile_declare(scope, key);
+		for (auto val: node->vals) compile_declare(scope, val);
+	}
+
 	int compile_assign(node_t* scope, node_t* node, int index) {
 		int local = compile_local(scope, node);
 		compile(OP_LIT, local >= 0 ? integer(local): node->item);
@@ -1890,874 +2576,3917 @@ class Rela {
 		}
 	}
 
-	void process(node_t* scope, node_t *node, int flags, int index, int limit) {
-		int flag_assign = flags & PROCESS_ASSIGN ? 1:0;
+	// Constant folding, run over each statement between parse() and process().
+	// Pure operators and lib math calls on literals become literals, locals
+	// assigned once at the top level of a function with a constant are
+	// propagated to later statements, and constant if/while conditions let
+	// process() drop dead branches.
 
-		// if we're assigning with chained expressions, only OP_SET|OP_ASSIGN the last one
-		bool assigning = flag_assign && !node->chain;
+	struct fold_t {
+		std::vector<std::pair<item_t,int>> writes; // assignments per local name
+		std::vector<std::pair<item_t,item_t>> consts; // propagated locals
+	};
 
-		char tmp[STRTMP];
+	bool fold_value(node_t* node, item_t* val) {
+		if (!node || node->chain || node->index || node->field || node->call) return false;
 
-		// a multi-part expression: a[,b...] = node[,node...]
-		// this is the entry point for most non-control non-opcode statements
-		if (node->type == NODE_MULTI) {
-			assert(!node->args);
-			assert(node->vals.size());
+		if (node->type == NODE_LITERAL) {
+			// interpolated strings are compiled as expressions
+			if (node->item.type == STRING && strchr(node->item.str, '$')) return false;
+			*val = node->item;
+			return true;
+		}
 
-			bool wrap = node->results != RESULTS_ALL && !node->control;
+		if (node->type == NODE_OPCODE && !node->args && !node->vals.size()) {
+			if (node->opcode == OP_TRUE) { *val = (item_t){.type = BOOLEAN, .flag = true}; return true; }
+			if (node->opcode == OP_FALSE) { *val = (item_t){.type = BOOLEAN, .flag = false}; return true; }
+			if (node->opcode == OP_NIL) { *val = nil(); return true; }
+		}
 
-			// substack frame
-			if (wrap)
-				compile(OP_MARK, nil());
+		return false;
+	}
 
-			// stream the values onto the substack
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, -1);
+	// replace an expression with its value, keeping any [index] or chain
+	void fold_literal(node_t* node, item_t val) {
+		node->type = NODE_LITERAL;
+		node->opcode = OP_STOP;
+		node->item = val;
+		node->args = nullptr;
+		node->vals.clear();
+		node->control = false;
+		node->single = true;
+	}
 
-			// OP_SET|OP_ASSIGN index values from the start of the current substack frame
-			for (int i = 0, l = node->keys.size(); i < l; i++) {
-				node_t* subnode = node->keys[i];
-				process(scope, subnode, PROCESS_ASSIGN, i, -1);
-			}
+	// evaluation must not be able to fail: anything that could raise an
+	// error or depend on run-time state is left alone
+	bool fold_safe(enum opcode_t opcode, int argc, item_t* argv) {
+		auto numeric = [&](item_t a) { return a.type == INTEGER || a.type == FLOAT; };
 
-			// end substack frame
-			if (wrap)
-				compile(OP_LIMIT, integer(node->results));
+		switch (opcode) {
+			case OP_NOT:
+			case OP_EQ:
+			case OP_NE:
+				return true;
+			case OP_NEG:
+				return numeric(argv[0]);
+			case OP_COUNT:
+				return argv[0].type == STRING;
+			case OP_ADD:
+			case OP_SUB:
+			case OP_MUL:
+				return numeric(argv[0]) && numeric(argv[1]) && (argv[0].type == FLOAT || argv[1].type == INTEGER);
+			case OP_DIV:
+				if (argv[0].type == FLOAT) return numeric(argv[1]);
+				// fallthrough
+			case OP_MOD:
+				return argv[0].type == INTEGER && argv[1].type == INTEGER && argv[1].inum != 0
+					&& !(argv[0].inum == INT64_MIN && argv[1].inum == -1);
+			case OP_LT:
+			case OP_LTE:
+			case OP_GT:
+			case OP_GTE:
+				return (numeric(argv[0]) && numeric(argv[1])) || (argv[0].type == STRING && argv[1].type == STRING);
+			case OP_SIN: case OP_COS: case OP_TAN: case OP_ASIN: case OP_ACOS: case OP_ATAN:
+			case OP_SINH: case OP_COSH: case OP_TANH: case OP_CEIL: case OP_FLOOR: case OP_SQRT:
+			case OP_LOG: case OP_LOG10: case OP_ABS:
+				return argc == 1 && numeric(argv[0]);
+			case OP_ATAN2:
+			case OP_POW:
+				return argc == 2 && numeric(argv[0]) && numeric(argv[1]);
+			case OP_MIN:
+			case OP_MAX:
+				for (int i = 0; i < argc; i++) if (!numeric(argv[i]) || argv[i].type != argv[0].type) return false;
+				return argc > 0;
+			default:
+				break;
+		}
+		return false;
+	}
 
-			// [expr]
-			if (node->index)
-				compile(assigning ? OP_SET: OP_GET, nil());
+	// run the opcode on the compile-time routine's stack
+	bool fold_eval(enum opcode_t opcode, int argc, item_t* argv, item_t* val) {
+		if (!routine || !fold_safe(opcode, argc, argv)) return false;
+		op_mark();
+		for (int i = 0; i < argc; i++) push(argv[i]);
+		operation_call(opcode);
+		bool single = depth() == 1;
+		if (single) *val = top();
+		limit(0);
+		return single;
+	}
 
-			// [expr](...)
-			if (node->chain)
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
-		}
-		else
-		if (node->type == NODE_NAME) {
-			assert(!node->keys.size() && !node->vals.size());
+	int fold_writes(fold_t* env, item_t name) {
+		for (auto& write: env->writes) if (equal(write.first, name)) return write.second;
+		return 0;
+	}
 
-			// function or function-like opcode call
-			if (node->call) {
-				assert(!assigning);
+	void fold_write(fold_t* env, item_t name) {
+		for (auto& write: env->writes) if (equal(write.first, name)) { write.second++; return; }
+		env->writes.push_back({name, 1});
+	}
 
-				// vecmap[fn()]
-//				if (node->index) {
-//					compile(OP_MARK, nil());
-//						if (node->args)
-//							process(scope, node->args, 0, 0, -1);
-//						compile(OP_LIT, node->item);
-//						compile(OP_FIND, nil());
-//						compile(OP_CALL, nil());
-//					compile(OP_LIMIT, integer(1));
-//					compile(OP_GET, nil());
-//				}
+	// count assignments to local names, not descending into nested functions
+	void fold_count(fold_t* env, node_t* node) {
+		if (!node) return;
 
-				// :fn()
-				if (node->field && node->method) {
-					compile(OP_COPY, nil());
-					compile(OP_LIT, node->item);
-					compile(OP_GET, nil());
-					compile(OP_SHUNT, nil());
-					compile(OP_SHUNT, nil());
-					compile(OP_MARK, nil());
-						compile(OP_SHIFT, nil());
-						if (node->args)
-							process(scope, node->args, 0, 0, -1);
-						compile(OP_SHIFT, nil());
-						compile(OP_CALL, nil());
-					compile(OP_LIMIT, integer(limit));
-				}
-
-				// .fn()
-				if (node->field && !node->method) {
-					compile(OP_LIT, node->item);
-					compile(OP_GET, nil());
-					compile(OP_SHUNT, nil());
-					compile(OP_MARK, nil());
-						if (node->args)
-							process(scope, node->args, 0, 0, -1);
-						compile(OP_SHIFT, nil());
-						compile(OP_CALL, nil());
-					compile(OP_LIMIT, integer(limit));
-				}
+		if (node->type == NODE_FUNCTION) {
+			if (node->item.type) fold_write(env, node->item);
+			fold_count(env, node->args);
+			fold_count(env, node->chain);
+			return;
+		}
 
-				// fn()
-				if (!node->index && !node->field) {
-					compile(OP_MARK, nil());
-						if (node->args)
-							process(scope, node->args, 0, 0, -1);
-						compile_lookup(scope, node);
-						compile(OP_CALL, nil());
-					compile(OP_LIMIT, integer(limit));
-				}
+		if (node->type == NODE_MULTI) {
+			for (auto key: node->keys) {
+				if (key->type == NODE_NAME && !key->index && !key->field && !key->call && !key->chain)
+					fold_write(env, key->item);
 			}
-			// variable reference
-			else {
-				if (assigning) {
-					if (node->index) {
-						compile(OP_LIT, node->item);
-						compile(OP_FIND, nil());
-						compile(OP_SET, nil());
-					}
+		}
 
-					if (node->field) {
-						compile(OP_LIT, node->item);
-						compile(OP_SET, nil());
-					}
+		if (node->type == NODE_FOR) {
+			for (auto& key: node->fkeys) fold_write(env, key);
+		}
 
-					if (!node->index && !node->field) {
-						compile_assign(scope, node, index);
-					}
-				}
-				else {
-					if (node->index) {
-						compile(OP_LIT, node->item);
-						compile(OP_FIND, nil());
-						compile(OP_GET, nil());
-					}
+		fold_count(env, node->args);
+		fold_count(env, node->chain);
+		for (auto key: node->keys) fold_count(env, key);
+		for (auto val: node->vals) fold_count(env, val);
+	}
 
-					if (node->field) {
-						compile(OP_LIT, node->item);
-						compile(OP_GET, nil());
-					}
+	// lib.fn(literals...) for pure math opcodes
+	bool fold_lib(fold_t* env, node_t* node) {
+		node_t* call = node->chain;
 
-					if (!node->index && !node->field) {
-						compile_lookup(scope, node);
-					}
-				}
-			}
+		if (node->call || node->index || node->field || !call) return false;
+		if (call->type != NODE_NAME || !call->field || call->method || !call->call) return false;
+		if (!equal(node->item, string("lib")) || (env && fold_writes(env, node->item))) return false;
 
-			if (node->chain) {
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+		item_t lib, fn;
+		if (!map_get(scope_core, string("lib"), &lib) || lib.type != MAP) return false;
+		if (!map_get(lib.map, call->item, &fn) || fn.type != OPERATION) return false;
+
+		item_t argv[STACK];
+		int argc = 0;
+
+		if (call->args && call->args->type == NODE_MULTI) {
+			if (call->args->keys.size() || call->args->chain || call->args->index) return false;
+			for (auto val: call->args->vals) {
+				if (argc == STACK || !fold_value(val, &argv[argc++])) return false;
 			}
 		}
 		else
-		// function with optional name assignment
-		if (node->type == NODE_FUNCTION) {
-			assert(!node->args);
+		if (call->args) {
+			if (!fold_value(call->args, &argv[argc++])) return false;
+		}
 
-			compile(OP_MARK, nil());
-			int entry = compile(OP_LIT, nil());
+		item_t val;
+		if (!fold_eval(fn.opcode, argc, argv, &val)) return false;
 
-			if (node->item.type) {
-				compile_assign(scope, node, 0);
-			}
+		node->chain = call->chain;
+		fold_literal(node, val);
+		return true;
+	}
 
-			int jump = compile(OP_JMP, nil());
-			compiled(entry)->item = (item_t){.type = SUBROUTINE, .sub = (int)code.size()};
+	node_t* fold(fold_t* env, node_t* node) {
+		if (!node) return node;
 
-			scopes.resize(std::max((size_t)(node->fpath.id+1), scopes.size()));
-			auto& fscope = scopes[node->fpath.id];
+		item_t argv[2];
+		item_t val;
 
-			fscope.id = node->fpath.id;
-			for (int i = 0, l = node->fpath.ids.size(); i < l; i++) {
-				fscope.up.push_back(node->fpath.ids[i]);
+		if (node->type == NODE_FUNCTION) {
+			fold_t inner;
+			for (auto key: node->keys) fold_write(&inner, key->item);
+			for (auto val: node->vals) fold_count(&inner, val);
+
+			for (auto stmt: node->vals) {
+				fold(&inner, stmt);
+
+				// name = constant at the top level of the body holds for every
+				// later statement if it is the only assignment
+				if (stmt->type == NODE_MULTI && stmt->keys.size() == 1 && stmt->vals.size() == 1) {
+					node_t* key = stmt->keys[0];
+					bool plain = key->type == NODE_NAME && !key->index && !key->field && !key->call && !key->chain;
+					if (plain && fold_writes(&inner, key->item) == 1 && fold_value(stmt->vals[0], &val))
+						inner.consts.push_back({key->item, val});
+				}
 			}
 
-			compile(OP_ENTER, integer(fscope.id));
-
-			for (int i = 0, l = node->vals.size(); i < l; i++) {
-				process(node, node->vals[i], 0, 0, 0);
-			}
+			optimise(&inner, node);
+			infer(&inner, node);
 
-			must(node->keys.size() < LOCALS, "too many locals");
+			fold(env, node->args);
+			fold(env, node->chain);
+			return node;
+		}
 
-			for (auto& key: node->keys) {
-				fscope.locals.push_back(key->item.str);
-			}
+		// assignment targets are left alone
+		if (node->type != NODE_MULTI) {
+			for (auto key: node->keys) fold(env, key);
+		}
 
-			// if an explicit return expression is used, these instructions
-			// will be dead code
-			compile(OP_CLEAN, nil());
-			compile(OP_RETURN, nil());
-			compiled(jump)->item = integer(code.size());
-			compile_barrier();
+		fold(env, node->args);
+		for (auto val: node->vals) fold(env, val);
+		fold(env, node->chain);
 
-			// value only returns if not function name() form
-			compile(OP_LIMIT, integer(node->item.type ? 0:1));
+		if (node->type == NODE_NAME && !node->call && !node->field && !node->method) {
+			if (fold_lib(env, node)) return node;
 
-			// function() ... end()
-			if (node->call) {
-				compile(OP_SHUNT, nil());
-				compile(OP_MARK, nil());
-					if (node->args)
-						process(scope, node->args, 0, 0, -1);
-					compile(OP_SHIFT, nil());
-					compile(OP_CALL, nil());
-				compile(OP_LIMIT, integer(limit));
+			if (env) for (auto& known: env->consts) {
+				if (equal(known.first, node->item)) {
+					fold_literal(node, known.second);
+					break;
+				}
 			}
+			return node;
 		}
-		else
-		// function/opcode call
-		if (node->type == NODE_CALL_CHAIN) {
-			compile(OP_SHUNT, nil());
-			compile(OP_MARK, nil());
-				if (node->args)
-					process(scope, node->args, 0, 0, -1);
-				compile(OP_SHIFT, nil());
-				for (int i = 0, l = node->vals.size(); i < l; i++)
-					process(scope, node->vals[i], 0, 0, -1);
-				compile(OP_CALL, nil());
-			compile(OP_LIMIT, integer(limit));
 
-			if (node->index) {
-				compile(assigning ? OP_SET: OP_GET, nil());
+		if (node->type == NODE_OPERATOR && node->vals.size() == 2) {
+			if (!fold_value(node->vals[0], &argv[0]) || !fold_value(node->vals[1], &argv[1])) return node;
+
+			if (node->opcode == OP_AND) {
+				fold_literal(node, truth(argv[0]) ? argv[1]: argv[0]);
+				return node;
+			}
+			if (node->opcode == OP_OR) {
+				fold_literal(node, truth(argv[0]) ? argv[0]: argv[1]);
+				return node;
 			}
+			if (fold_eval(node->opcode, 2, argv, &val)) {
+				fold_literal(node, val);
+			}
+			return node;
+		}
 
-			if (node->chain) {
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+		// (constant) or a single-result wrapper around one
+		if (node->type == NODE_MULTI && node->results == RESULTS_FIRST && !node->keys.size() && node->vals.size() == 1) {
+			if (!node->args && !node->chain && !node->index && fold_value(node->vals[0], &val))
+				fold_literal(node, val);
+			return node;
+		}
+
+		// modifiers -x !x #x
+		if (node->type == NODE_OPCODE && node->args && !node->vals.size()) {
+			bool modifier = node->opcode == OP_NEG || node->opcode == OP_NOT || node->opcode == OP_COUNT;
+			if (modifier && fold_value(node->args, &argv[0]) && fold_eval(node->opcode, 1, argv, &val)) {
+				fold_literal(node, val);
 			}
+			return node;
 		}
-		// inline opcode
-		else
-		if (node->type == NODE_OPCODE) {
-			assert(node->opcode != OP_CALL);
 
-			if (node->args)
-				process(scope, node->args, 0, 0, -1);
+		return node;
+	}
 
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, -1);
+	// Escape analysis. A vector or map literal that is only counted,
+	// unpacked, or read once through a plain [key] or .field cannot outlive
+	// its expression. It is built in scratch storage that is recycled the
+	// moment it is consumed, instead of being allotted from the pools to
+	// wait for gc().
 
-			compile(node->opcode, nil());
+	// the literal inside any single-value wrappers
+	node_t* escape_literal(node_t* node) {
+		while (node && node->type == NODE_MULTI && !node->keys.size() && node->vals.size() == 1 && !node->args && !node->chain && !node->index)
+			node = node->vals[0];
+		if (!node || (node->type != NODE_VEC && node->type != NODE_MAP)) return nullptr;
+		return node->chain || node->index || node->field ? nullptr: node;
+	}
+
+	// a lookup that runs no code between the literal and the read
+	bool escape_lookup(node_t* link) {
+		if (link->method) return false;
+		if (link->field) return link->type == NODE_NAME;
+		if (!link->index) return false;
 
-			if (node->index) {
-				compile(assigning ? OP_SET: OP_GET, nil());
-			}
+		node_t* key = link;
+		if (key->type == NODE_MULTI) {
+			if (key->keys.size() || key->vals.size() != 1 || key->args) return false;
+			key = key->vals[0];
+			if (key->chain || key->index || key->field) return false;
+		}
+		if (key->call || key->args) return false;
+		if (key->type == NODE_LITERAL) return key->item.type != STRING || !strchr(key->item.str, '$');
+		return key->type == NODE_NAME;
+	}
+
+	void escape(node_t* node) {
+		if (!node) return;
+
+		node_t* lit = nullptr;
+		if (node->type == NODE_OPCODE && node->opcode == OP_COUNT && !node->vals.size())
+			lit = escape_literal(node->args);
+		if (node->type == NODE_OPERATOR && node->opcode == OP_UNPACK && node->vals.size() == 1)
+			lit = escape_literal(node->vals[0]);
+		if ((node->type == NODE_VEC || node->type == NODE_MAP) && node->chain && escape_lookup(node->chain))
+			lit = node;
+		if (lit) lit->temp = true;
 
-			if (node->chain) {
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
-			}
-		}
-		else
-		if (node->type == NODE_OPERATOR && node->opcode == OP_AND) {
-			assert(node->vals.size() == 2);
-			process(scope, node->vals[0], 0, 0, 1);
-			int jump = compile(OP_JFALSE, nil());
-			compile(OP_DROP, nil());
-			process(scope, node->vals[1], 0, 0, 1);
-			compiled(jump)->item = integer(code.size());
-			compile_barrier();
-		}
-		else
-		if (node->type == NODE_OPERATOR && node->opcode == OP_OR) {
-			assert(node->vals.size() == 2);
-			process(scope, node->vals[0], 0, 0, 1);
-			int jump = compile(OP_JTRUE, nil());
-			compile(OP_DROP, nil());
-			process(scope, node->vals[1], 0, 0, 1);
-			compiled(jump)->item = integer(code.size());
-			compile_barrier();
+		// assignment targets are written, not consumed
+		if (node->type != NODE_MULTI) {
+			for (auto key: node->keys) escape(key);
 		}
-		else
-		if (node->type == NODE_OPERATOR) {
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, 1);
 
-			compile(node->opcode, nil());
+		escape(node->args);
+		for (auto val: node->vals) escape(val);
+		escape(node->chain);
+	}
 
-			if (node->index) {
-				compile(assigning ? OP_SET: OP_GET, nil());
-			}
+	// Function body rewrites, run by fold() once a body is folded. Like
+	// folding they work on the AST in place: hoist() moves lookups in core
+	// maps such as lib.sqrt out of loops, share() computes a field path read
+	// more than once in a statement only once, and prune() drops code that
+	// cannot run and stores that are never read. A cached path lives in a
+	// hidden local named after it, "@lib.sqrt" or "@p.pos". As with constant
+	// folding, scripts are assumed not to replace lib functions at run time,
+	// and metamethods not to reassign fields read in the same statement.
 
-			if (node->chain) {
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
-			}
+	static const int HOIST_LOCALS = LOCALS/2;
+
+	// a new hidden local leaves room for inlining and registers
+	bool hoist_room(fold_t* env, const char* name) {
+		return fold_writes(env, string(name)) || (int)env->writes.size() < HOIST_LOCALS;
+	}
+
+	// "@base.a.b" for up to max plain field links (-1 for all, stopping
+	// after a call); returns the number of links
+	int hoist_path(node_t* base, int max, std::string* path) {
+		*path = std::string("@") + base->item.str;
+		int links = 0;
+		for (node_t* link = base->chain; link && links != max; link = link->chain) {
+			if (link->type != NODE_NAME || !link->field || link->method || link->index) break;
+			*path += ".";
+			*path += link->item.str;
+			links++;
+			if (link->call) break;
 		}
-		else
-		// string or number literal, optionally part of array chain a[b]["c"]
-		if (node->type == NODE_LITERAL) {
-			assert(!node->args && !node->keys.size() && !node->vals.size());
+		return links;
+	}
 
-			const char *dollar = node->item.type == STRING ? strchr(node->item.str, '$'): nullptr;
+	// links of a core lookup safe to read ahead of time, each looked up in
+	// a value that is a map at compile time, so a path under a branch that
+	// never runs cannot fail early
+	int hoist_links(node_t* base) {
+		item_t val;
+		if (!map_get(scope_core, base->item, &val)) return 0;
+		int links = 0;
+		for (node_t* link = base->chain; link && val.type == MAP; link = link->chain) {
+			if (link->type != NODE_NAME || !link->field || link->method || link->index) break;
+			links++;
+			if (link->call || !map_get(val.map, link->item, &val)) break;
+		}
+		return links;
+	}
+
+	// @base.a.b = base.a.b
+	node_t* hoist_assign(node_t* base, int links, const char* name) {
+		node_t* key = node_allot();
+		key->type = NODE_NAME;
+		key->item = string(name);
+
+		node_t* val = node_allot();
+		val->type = NODE_NAME;
+		val->item = base->item;
+
+		node_t* tail = val;
+		node_t* link = base->chain;
+		for (int i = 0; i < links; i++, link = link->chain) {
+			tail->chain = node_allot();
+			tail = tail->chain;
+			tail->type = NODE_NAME;
+			tail->item = link->item;
+			tail->field = true;
+		}
+
+		node_t* stmt = node_allot();
+		stmt->type = NODE_MULTI;
+		stmt->results = RESULTS_DISCARD;
+		stmt->keys.push_back(key);
+		stmt->vals.push_back(val);
+		return stmt;
+	}
+
+	// base.a.b.rest => @base.a.b.rest
+	void hoist_replace(node_t* base, int links, const char* name) {
+		node_t* link = base->chain;
+		for (int i = 1; i < links; i++) link = link->chain;
+		base->item = string(name);
+		base->call = link->call;
+		base->args = link->args;
+		base->chain = link->chain;
+	}
+
+	// the base of a lookup chain, read rather than assigned
+	bool hoist_base(node_t* node) {
+		return node->type == NODE_NAME && !node->call && !node->index && !node->field && node->chain;
+	}
 
-			if (dollar && dollar < node->item.str + strlen(node->item.str) - 1) {
-				assert(node->item.type == STRING);
+	bool hoist_core(fold_t* env, node_t* node) {
+		item_t val;
+		if (!hoist_base(node) || fold_writes(env, node->item)) return false;
+		return map_get(scope_core, node->item, &val) && val.type == MAP;
+	}
+
+	// assignment through a core map anywhere in the function
+	bool hoist_written(fold_t* env, node_t* node) {
+		if (!node) return false;
+		if (node->type == NODE_MULTI) {
+			for (auto key: node->keys) if (hoist_core(env, key)) return true;
+		}
+		if (hoist_written(env, node->args) || hoist_written(env, node->chain)) return true;
+		for (auto key: node->keys) if (hoist_written(env, key)) return true;
+		for (auto val: node->vals) if (hoist_written(env, val)) return true;
+		return false;
+	}
 
-				const char *str = node->item.str;
-				const char *left = str;
-				const char *right = str;
+	void hoist_collect(fold_t* env, node_t* node, std::vector<node_t*>* found) {
+		if (!node || node->type == NODE_FUNCTION) return;
+		if (hoist_core(env, node)) found->push_back(node);
+		hoist_collect(env, node->args, found);
+		if (node->type != NODE_MULTI) {
+			for (auto key: node->keys) hoist_collect(env, key, found);
+		}
+		for (auto val: node->vals) hoist_collect(env, val, found);
+		hoist_collect(env, node->chain, found);
+	}
 
-				bool started = false;
+	// if blocks are expressions, so a statement may wrap one
+	node_t* hoist_if(node_t* stmt) {
+		if (stmt->type == NODE_MULTI && !stmt->keys.size() && stmt->vals.size() == 1 && !stmt->chain && !stmt->index)
+			stmt = stmt->vals[0];
+		return stmt->type == NODE_IF ? stmt: nullptr;
+	}
 
-				while ((right = strchr(left, '$')) && right && *right) {
-					const char *start = right+1;
-					const char *finish = start;
-					int length = 0;
+	// core lookups in each outermost loop are cached just before it
+	void hoist(fold_t* env, std::vector<node_t*>& block) {
+		for (int i = 0; i < (int)block.size(); i++) {
+			node_t* stmt = block[i];
 
-					if (*start == '(') {
-						start++;
-						const char *rparen = strchr(start, ')');
-						must(rparen, "string interpolation missing closing paren: %s", right);
-						length = rparen-start;
-						finish = rparen+1;
-					}
-					else {
-						length = str_skip(start, isname);
-						finish = &start[length];
-					}
+			if (node_t* cond = hoist_if(stmt)) {
+				hoist(env, cond->vals);
+				hoist(env, cond->keys);
+				continue;
+			}
 
-					if (right > left) {
-						compile(OP_LIT, string(substr(left, 0, right-left+(length ? 0:1))));
-						if (started) compile(OP_CONCAT, nil());
-						started = true;
-					}
+			if (stmt->type != NODE_WHILE && stmt->type != NODE_FOR) continue;
 
-					left = finish;
+			std::vector<node_t*> found;
+			hoist_collect(env, stmt, &found);
 
-					if (length) {
-						const char *sub = substr(start, 0, length);
-						must(length == parse(sub, RESULTS_FIRST, PARSE_COMMA|PARSE_ANDOR), "string interpolation parsing failed");
-						process(scope, parsed, 0, 0, -1);
-						if (started) compile(OP_CONCAT, nil());
-						started = true;
-					}
-				}
-
-				if (strlen(left)) {
-					compile(OP_LIT, string(substr(left, 0, strlen(left))));
-					if (started) compile(OP_CONCAT, nil());
-					started = true;
+			std::vector<std::string> cached;
+			for (auto base: found) {
+				std::string path;
+				int links = hoist_links(base);
+				if (!links || hoist_path(base, links, &path) != links || !hoist_room(env, path.c_str())) continue;
+				if (std::find(cached.begin(), cached.end(), path) == cached.end()) {
+					block.insert(block.begin() + i++, hoist_assign(base, links, path.c_str()));
+					fold_write(env, string(path.c_str()));
+					cached.push_back(path);
 				}
+				hoist_replace(base, links, path.c_str());
 			}
-			else {
-				compile(OP_LIT, node->item);
+		}
+	}
+
+	// no calls, branches or hidden writes, so every read happens exactly
+	// once; a call may only be the last thing evaluated
+	bool share_safe(node_t* node, node_t* last) {
+		if (!node) return true;
+		if ((node->call && node != last) || node->method) return false;
+
+		switch (node->type) {
+			case NODE_MULTI: case NODE_NAME: case NODE_VEC: case NODE_MAP:
+				break;
+			case NODE_LITERAL:
+				if (node->item.type == STRING && strchr(node->item.str, '$')) return false;
+				break;
+			case NODE_OPERATOR:
+				if (node->opcode == OP_AND || node->opcode == OP_OR) return false;
+				break;
+			case NODE_OPCODE:
+				if (node->opcode != OP_NEG && node->opcode != OP_NOT && node->opcode != OP_COUNT &&
+					node->opcode != OP_TRUE && node->opcode != OP_FALSE && node->opcode != OP_NIL) return false;
+				break;
+			default:
+				return false;
+		}
+
+		if (!share_safe(node->args, last) || !share_safe(node->chain, last)) return false;
+		for (auto key: node->keys) if (!share_safe(key, last)) return false;
+		for (auto val: node->vals) if (!share_safe(val, last)) return false;
+		return true;
+	}
+
+	// final link of the expression a statement computes
+	node_t* share_last(node_t* node) {
+		while (node->type == NODE_MULTI && !node->keys.size() && node->vals.size() == 1 && !node->chain && !node->index)
+			node = node->vals[0];
+		if (node->type == NODE_MULTI && node->vals.size() == 1 && !node->chain && !node->index)
+			return share_last(node->vals[0]);
+		while (node->chain) node = node->chain;
+		return node;
+	}
+
+	// reads of field paths on locals
+	void share_collect(fold_t* env, node_t* node, std::vector<node_t*>* found) {
+		if (!node) return;
+		if (hoist_base(node) && fold_writes(env, node->item)) found->push_back(node);
+		share_collect(env, node->args, found);
+		if (node->type != NODE_MULTI) {
+			for (auto key: node->keys) share_collect(env, key, found);
+		}
+		for (auto val: node->vals) share_collect(env, val, found);
+		share_collect(env, node->chain, found);
+	}
+
+	// the longest path read more than once, cached before the statement
+	bool share(fold_t* env, std::vector<node_t*>& block, int* at, node_t* expr) {
+		std::vector<node_t*> found;
+		share_collect(env, expr, &found);
+
+		std::string best;
+		int links = 0;
+		node_t* first = nullptr;
+
+		for (int i = 0, l = found.size(); i < l; i++) {
+			std::string path, other;
+			for (int n = 1, m = hoist_path(found[i], -1, &path); n <= m; n++) {
+				hoist_path(found[i], n, &path);
+				int seen = 0;
+				for (int j = 0; j < l; j++) {
+					if (hoist_path(found[j], n, &other) == n && other == path) seen++;
+				}
+				// worth a local once it saves two lookups
+				if ((seen-1)*n > 1 && n > links) {
+					best = path;
+					links = n;
+					first = found[i];
+				}
 			}
+		}
 
-			if (node->index) {
-				compile(assigning ? OP_SET: OP_GET, nil());
+		if (!first || !hoist_room(env, best.c_str())) return false;
+
+		block.insert(block.begin() + (*at)++, hoist_assign(first, links, best.c_str()));
+		fold_write(env, string(best.c_str()));
+
+		std::string path;
+		for (auto base: found) {
+			if (hoist_path(base, links, &path) == links && path == best)
+				hoist_replace(base, links, best.c_str());
+		}
+		return true;
+	}
+
+	void share(fold_t* env, std::vector<node_t*>& block) {
+		for (int i = 0; i < (int)block.size(); i++) {
+			node_t* stmt = block[i];
+
+			if (node_t* cond = hoist_if(stmt)) {
+				share(env, cond->vals);
+				share(env, cond->keys);
+				continue;
 			}
 
-			if (node->chain) {
-				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			if (stmt->type == NODE_WHILE || stmt->type == NODE_FOR) {
+				share(env, stmt->vals);
+				continue;
 			}
 
-			must(!assigning || node->item.type == STRING, "cannot assign %s",
-				tmptext(node->item, tmp, sizeof(tmp)));
+			node_t* expr = stmt->type == NODE_RETURN ? stmt->args: stmt;
+			if (stmt->type != NODE_RETURN && stmt->type != NODE_MULTI) continue;
+			if (!expr || !share_safe(expr, share_last(expr))) continue;
 
-			// special case allows: "complex-string" = value in map literals
-			if (!node->index && assigning && node->item.type == STRING) {
-				compile(OP_ASSIGN, integer(index));
-			}
+			while (share(env, block, &i, expr));
 		}
-		else
-		// if expression ... [else ...] end
-		// (returns a value for ternary style assignment)
-		if (node->type == NODE_IF) {
-
-			// conditions
-			if (node->args)
-				process(scope, node->args, 0, 0, -1);
+	}
 
-			// if false, jump to else/end
-			int jump = compile(OP_JFALSE, nil());
-			compile(OP_DROP, nil());
+	bool prune_end(node_t* node) {
+		return node->type == NODE_RETURN || (node->type == NODE_OPCODE && (node->opcode == OP_BREAK || node->opcode == OP_CONTINUE));
+	}
 
-			// success block
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, 0);
+	// value whose evaluation has no effect and cannot fail
+	bool prune_pure(fold_t* env, node_t* node) {
+		if (node->call || node->index || node->field || node->chain || node->args) return false;
+		if (node->type == NODE_MULTI)
+			return !node->keys.size() && node->vals.size() == 1 && prune_pure(env, node->vals[0]);
+		if (node->type == NODE_LITERAL)
+			return node->item.type != STRING || !strchr(node->item.str, '$');
+		if (node->type == NODE_NAME)
+			return fold_writes(env, node->item) > 0;
+		if (node->type == NODE_OPCODE)
+			return node->opcode == OP_TRUE || node->opcode == OP_FALSE || node->opcode == OP_NIL;
+		if (node->type == NODE_VEC) {
+			for (auto val: node->vals) if (!prune_pure(env, val)) return false;
+			return true;
+		}
+		if (node->type == NODE_MAP) {
+			for (auto pair: node->vals) {
+				if (!prune_key(pair->keys[0]) || !prune_pure(env, pair->vals[0])) return false;
+			}
+			return true;
+		}
+		return false;
+	}
 
-			// optional failure block
-			if (node->keys.size()) {
-				// jump success path past failure block
-				int jump2 = compile(OP_JMP, nil());
-				compiled(jump)->item = integer(code.size());
-				compile_barrier();
-				compile(OP_DROP, nil());
+	// map literal key that is a plain name or literal, not [computed]
+	bool prune_key(node_t* key) {
+		if (key->call || key->index || key->field || key->chain || key->args || key->vals.size()) return false;
+		if (key->type == NODE_NAME) return true;
+		if (key->type == NODE_LITERAL) return key->item.type != STRING || !strchr(key->item.str, '$');
+		return false;
+	}
 
-				// failure block
-				for (int i = 0, l = node->keys.size(); i < l; i++)
-					process(scope, node->keys[i], 0, 0, 0);
+	// a plain local assigned by a statement
+	bool prune_plain(node_t* key) {
+		return key->type == NODE_NAME && !key->index && !key->field && !key->call && !key->chain;
+	}
+
+	// reads of a name; false if something could read it unseen
+	bool prune_reads(node_t* node, item_t name, int* reads) {
+		if (!node) return true;
+		if (node->type == NODE_FUNCTION) return false;
+		if (node->type == NODE_LITERAL && node->item.type == STRING && strchr(node->item.str, '$')) return false;
+		if (node->type == NODE_NAME && !node->field && equal(node->item, name)) ++*reads;
+		for (auto key: node->keys) {
+			if (node->type == NODE_MULTI && prune_plain(key)) continue;
+			if (!prune_reads(key, name, reads)) return false;
+		}
+		for (auto val: node->vals) if (!prune_reads(val, name, reads)) return false;
+		return prune_reads(node->args, name, reads) && prune_reads(node->chain, name, reads);
+	}
+
+	void prune(fold_t* env, node_t* fn, std::vector<node_t*>& block) {
+		for (int i = 0; i < (int)block.size(); i++) {
+			node_t* stmt = block[i];
+
+			// what follows cannot run, but still declares its locals: keep
+			// it as a while false block, which process() only declares
+			if (prune_end(stmt)) {
+				if (i+1 < (int)block.size()) {
+					node_t* dead = node_allot();
+					dead->type = NODE_WHILE;
+					dead->args = node_allot();
+					dead->args->type = NODE_LITERAL;
+					dead->args->item = (item_t){.type = BOOLEAN, .flag = false};
+					dead->vals.assign(block.begin()+i+1, block.end());
+					block.resize(i+1);
+					block.push_back(dead);
+				}
+				break;
+			}
 
-				compiled(jump2)->item = integer(code.size());
-				compile_barrier();
+			if (node_t* cond = hoist_if(stmt)) {
+				prune(env, fn, cond->vals);
+				prune(env, fn, cond->keys);
+				continue;
 			}
-			else {
-				compiled(jump)->item = integer(code.size());
-				compile_barrier();
+
+			if (stmt->type == NODE_WHILE || stmt->type == NODE_FOR) {
+				prune(env, fn, stmt->vals);
+				continue;
 			}
 
-			must(!assigning, "cannot assign to if block");
+			bool store = stmt->type == NODE_MULTI && stmt->results == RESULTS_DISCARD && stmt->keys.size() == 1 && stmt->vals.size() == 1;
+			if (!store || !prune_plain(stmt->keys[0]) || !prune_pure(env, stmt->vals[0])) continue;
+
+			int reads = 0;
+			bool seen = true;
+			for (auto val: fn->vals) seen = seen && prune_reads(val, stmt->keys[0]->item, &reads);
+
+			if (seen && !reads) block.erase(block.begin() + i--);
 		}
-		else
-		// while expression ... end
-		if (node->type == NODE_WHILE) {
-			assert(node->vals.size());
+	}
 
-			compile(OP_MARK, nil());
-			int loop = compile(OP_LOOP, nil());
-			int begin = code.size();
+	void optimise(fold_t* env, node_t* fn) {
+		bool written = false;
+		for (auto val: fn->vals) written = written || hoist_written(env, val);
+		if (!written) hoist(env, fn->vals);
+		share(env, fn->vals);
+		prune(env, fn, fn->vals);
+	}
 
-			// condition(s)
-			if (node->args)
-				process(scope, node->args, 0, 0, -1);
+	// Type inference, run by fold() after optimise(). A forward pass over a
+	// function body tracks the type each local holds at each statement:
+	// assignments set it, if blocks join their branches, and loops iterate
+	// until the types at the head stop changing. Parameters and anything
+	// read from a call, field or index are unknown. An operator whose two
+	// operands are proven both integers, or both floats, is marked so that
+	// process() emits a monomorphic opcode without type checks.
 
-			// if false, jump to end
-			int iter = compile(OP_JFALSE, nil());
-			compile(OP_DROP, nil());
+	static const int INFER_ANY = -1;
 
-			// do ... end
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, 0);
+	struct infer_t {
+		bool live = true;
+		std::vector<std::pair<item_t,int>> types; // local name -> type_t or INFER_ANY
+	};
 
-			// clean up
-			compile(OP_JMP, integer(begin));
-			compiled(iter)->item = integer(code.size());
-			compiled(loop)->item = integer(code.size());
-			compile_barrier();
-			compile(OP_UNLOOP, nil());
-			compile(OP_LIMIT, integer(0));
+	struct infer_loop_t {
+		infer_t breaks;
+		infer_t nexts;
+	};
 
-			must(!assigning, "cannot assign to while block");
+	int infer_get(infer_t* env, item_t name) {
+		for (auto& local: env->types) if (equal(local.first, name)) return local.second;
+		return INFER_ANY;
+	}
+
+	void infer_set(infer_t* env, item_t name, int type) {
+		for (auto& local: env->types) if (equal(local.first, name)) local.second = type;
+	}
+
+	// control flow merge; a dead path contributes nothing
+	void infer_join(infer_t* env, infer_t* other) {
+		if (!other->live) return;
+		if (!env->live) {
+			*env = *other;
+			return;
 		}
-		else
-		// for k,v in container ... end
+		for (int i = 0, l = env->types.size(); i < l; i++) {
+			if (env->types[i].second != other->types[i].second) env->types[i].second = INFER_ANY;
+		}
+	}
+
+	bool infer_same(infer_t* a, infer_t* b) {
+		if (a->live != b->live) return false;
+		for (int i = 0, l = a->types.size(); i < l; i++) {
+			if (a->types[i].second != b->types[i].second) return false;
+		}
+		return true;
+	}
+
+	// locals written anywhere inside an expression are unknown
+	void infer_clobber(infer_t* env, node_t* node) {
+		if (!node) return;
+
+		if (node->type == NODE_FUNCTION) {
+			if (node->item.type) infer_set(env, node->item, INFER_ANY);
+			return;
+		}
+
+		if (node->type == NODE_MULTI) {
+			for (auto key: node->keys) if (prune_plain(key)) infer_set(env, key->item, INFER_ANY);
+		}
+
 		if (node->type == NODE_FOR) {
-			compile(OP_MARK, nil());
+			for (auto& key: node->fkeys) infer_set(env, key, INFER_ANY);
+		}
 
-			// the iterable
-			if (node->args)
-				process(scope, node->args, 0, 0, -1);
+		infer_clobber(env, node->args);
+		infer_clobber(env, node->chain);
+		for (auto key: node->keys) infer_clobber(env, key);
+		for (auto val: node->vals) infer_clobber(env, val);
+	}
 
-			int loop = compile(OP_LOOP, nil());
-			int begin = code.size();
+	int infer_operator(node_t* node, int a, int b) {
+		bool numeric = (a == INTEGER || a == FLOAT) && (b == INTEGER || b == FLOAT);
+		int type = INFER_ANY;
+		int typed = NIL;
 
-			// OP_FOR expects a vector with key[,val] variable names
+		switch (node->opcode) {
+			// mixed operands take the type of the left, as add() does
+			case OP_ADD: case OP_SUB: case OP_MUL:
+				if (numeric) type = a;
+				if (numeric && a == b) typed = a;
+				break;
+			// integer division can trap, so stays generic
+			case OP_DIV:
+				if (numeric) type = a;
+				if (numeric && a == b && a == FLOAT) typed = a;
+				break;
+			case OP_MOD:
+				if (a == INTEGER && b == INTEGER) type = INTEGER;
+				break;
+			case OP_EQ: case OP_NE: case OP_LT: case OP_LTE: case OP_GT: case OP_GTE:
+				type = BOOLEAN;
+				if (a == INTEGER && b == INTEGER) typed = INTEGER;
+				break;
+			case OP_AND: case OP_OR:
+				if (a == b) type = a;
+				break;
+			default:
+				break;
+		}
 
-			vec_t* keys = vec_allot();
+		// a node seen under different types, such as a loop body before
+		// and after the loop head settles, is not typed
+		node->typed = node->typed < 0 || node->typed == typed ? typed: NIL;
+		return type;
+	}
 
-			if (scope) {
-				for (auto& key: node->fkeys) {
-					node_t* nkey = node_allot();
-					nkey->item = key;
-					int local = compile_local(scope, nkey);
-					vec_push(keys, integer(local));
+	// the type of the single value an expression produces
+	int infer_expr(infer_t* env, node_t* node) {
+		if (!node || node->type == NODE_FUNCTION) return INFER_ANY;
+
+		int type = INFER_ANY;
+
+		if (node->type == NODE_OPERATOR && node->vals.size() == 2) {
+			int a = infer_expr(env, node->vals[0]);
+			int b = infer_expr(env, node->vals[1]);
+			type = infer_operator(node, a, b);
+		}
+		else {
+			int arg = infer_expr(env, node->args);
+			for (auto key: node->keys) infer_expr(env, key);
+
+			int val = INFER_ANY;
+			for (auto item: node->vals) val = infer_expr(env, item);
+
+			switch (node->type) {
+				case NODE_LITERAL:
+					if (node->item.type != STRING || !strchr(node->item.str, '$')) type = node->item.type;
+					break;
+				case NODE_NAME:
+					if (!node->field && !node->method) type = infer_get(env, node->item);
+					break;
+				case NODE_MULTI:
+					if (!node->keys.size() && node->vals.size() == 1) type = val;
+					break;
+				case NODE_VEC:
+					type = VECTOR;
+					break;
+				case NODE_MAP:
+					type = MAP;
+					break;
+				case NODE_OPCODE:
+					if (node->opcode == OP_TRUE || node->opcode == OP_FALSE || node->opcode == OP_NOT) type = BOOLEAN;
+					if (node->opcode == OP_NIL) type = NIL;
+					if (node->opcode == OP_COUNT) type = INTEGER;
+					if (node->opcode == OP_NEG && (arg == INTEGER || arg == FLOAT)) type = arg;
+					break;
+			}
+		}
+
+		infer_expr(env, node->chain);
+		return node->chain || node->index || node->call ? INFER_ANY: type;
+	}
+
+	// iterate the body until the types at the loop head stop changing; a
+	// for loop over an integer counts, over a vector the index counts
+	void infer_loop(infer_t* env, node_t* node, int iter) {
+		infer_t head = *env;
+		infer_t exit;
+		infer_loop_t exits;
+
+		for (;;) {
+			infer_t body = head;
+			exits.breaks.live = false;
+			exits.nexts.live = false;
+
+			if (node->type == NODE_WHILE) {
+				infer_clobber(&body, node->args);
+				infer_expr(&body, node->args);
+			}
+			exit = body;
+
+			for (int i = 0, l = node->fkeys.size(); i < l; i++) {
+				bool step = iter == INTEGER || (i == 0 && l > 1 && iter == VECTOR);
+				infer_set(&body, node->fkeys[i], step ? INTEGER: INFER_ANY);
+			}
+
+			infer_block(&body, node->vals, &exits);
+			infer_join(&body, &exits.nexts);
+
+			infer_t next = *env;
+			infer_join(&next, &body);
+			if (infer_same(&next, &head)) break;
+			head = next;
+		}
+
+		*env = exit;
+		infer_join(env, &exits.breaks);
+	}
+
+	void infer_block(infer_t* env, std::vector<node_t*>& block, infer_loop_t* loop) {
+		for (auto stmt: block) {
+			if (!env->live) return;
+
+			if (node_t* cond = hoist_if(stmt)) {
+				infer_clobber(env, cond->args);
+				infer_expr(env, cond->args);
+				infer_t other = *env;
+				infer_block(env, cond->vals, loop);
+				infer_block(&other, cond->keys, loop);
+				infer_join(env, &other);
+				continue;
+			}
+
+			if (stmt->type == NODE_WHILE || stmt->type == NODE_FOR) {
+				int iter = INFER_ANY;
+				if (stmt->type == NODE_FOR) {
+					infer_clobber(env, stmt->args);
+					iter = infer_expr(env, stmt->args);
 				}
+				infer_loop(env, stmt, iter);
+				continue;
 			}
-			else {
-				for (auto& key: node->fkeys) {
-					vec_push(keys, key);
+
+			if (stmt->type == NODE_OPCODE && (stmt->opcode == OP_BREAK || stmt->opcode == OP_CONTINUE)) {
+				if (loop) infer_join(stmt->opcode == OP_BREAK ? &loop->breaks: &loop->nexts, env);
+				env->live = false;
+				continue;
+			}
+
+			if (stmt->type == NODE_RETURN) {
+				infer_clobber(env, stmt->args);
+				infer_expr(env, stmt->args);
+				env->live = false;
+				continue;
+			}
+
+			if (stmt->type == NODE_MULTI && stmt->keys.size()) {
+				for (auto key: stmt->keys) if (!prune_plain(key)) infer_clobber(env, key);
+				for (auto val: stmt->vals) infer_clobber(env, val);
+				for (auto key: stmt->keys) if (!prune_plain(key)) infer_expr(env, key);
+
+				// one value per name, or a call may have spread its results
+				std::vector<int> types;
+				bool known = stmt->keys.size() == stmt->vals.size();
+				for (auto val: stmt->vals) {
+					types.push_back(infer_expr(env, val));
+					known = known && types.back() != INFER_ANY;
+				}
+
+				for (int i = 0, l = stmt->keys.size(); i < l; i++) {
+					if (prune_plain(stmt->keys[i])) infer_set(env, stmt->keys[i]->item, known ? types[i]: INFER_ANY);
 				}
+				continue;
 			}
 
-			compile(OP_FOR, (item_t){.type = VECTOR, .vec = keys});
+			infer_clobber(env, stmt);
+			infer_expr(env, stmt);
+		}
+	}
 
-			// block
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(scope, node->vals[i], 0, 0, 0);
+	void infer(fold_t* fold, node_t* fn) {
+		infer_t env;
+		env.types = fold->writes;
+		for (auto& local: env.types) local.second = INFER_ANY;
+		infer_block(&env, fn->vals, nullptr);
+	}
 
-			// clean up
-			compile(OP_JMP, integer(begin));
-			compiled(loop)->item = integer(code.size());
-			compile_barrier();
-			compile(OP_UNLOOP, nil());
-			compile(OP_LIMIT, integer(0));
+	// monomorphic opcode for an operator infer() typed
+	enum opcode_t infer_opcode(node_t* node) {
+		if (node->typed == INTEGER) {
+			switch (node->opcode) {
+				case OP_ADD: return OPT_IADD;
+				case OP_SUB: return OPT_ISUB;
+				case OP_MUL: return OPT_IMUL;
+				case OP_EQ:  return OPT_IEQ;
+				case OP_NE:  return OPT_INE;
+				case OP_LT:  return OPT_ILT;
+				case OP_LTE: return OPT_ILTE;
+				case OP_GT:  return OPT_IGT;
+				case OP_GTE: return OPT_IGTE;
+				default: break;
+			}
+		}
+		if (node->typed == FLOAT) {
+			switch (node->opcode) {
+				case OP_ADD: return OPT_FADD;
+				case OP_SUB: return OPT_FSUB;
+				case OP_MUL: return OPT_FMUL;
+				case OP_DIV: return OPT_FDIV;
+				default: break;
+			}
+		}
+		return node->opcode;
+	}
+
+	// Inlining. A named function whose whole body is `return <expr>` over
+	// its parameters, literals and operators is a leaf: it calls nothing, so
+	// it cannot recurse. Calls to a leaf from inside a function compile to
+	// a guarded copy of <expr> reading the arguments from hidden caller
+	// locals. OP_INLINE checks the name still resolves to the same
+	// subroutine and otherwise makes an ordinary call that returns past the
+	// inlined code.
+
+	static const int INLINE_NODES = 16;
+
+	struct inline_t {
+		item_t name;
+		node_t* fn = nullptr;
+		int sub = 0;
+	};
+
+	std::vector<inline_t> inlines;
+
+	bool inline_expr(node_t* fn, node_t* node, int* size) {
+		if (!node || ++*size > INLINE_NODES) return false;
+		if (node->chain || node->index || node->field || node->call || node->keys.size()) return false;
+
+		if (node->type == NODE_LITERAL)
+			return node->item.type != STRING || !strchr(node->item.str, '$');
+
+		if (node->type == NODE_NAME)
+			return scope_find(fn, node->item) >= 0;
+
+		if (node->type == NODE_OPERATOR) {
+			if (node->opcode == OP_UNPACK || node->opcode == OP_MATCH) return false;
+			for (auto val: node->vals) if (!inline_expr(fn, val, size)) return false;
+			return true;
+		}
+
+		if (node->type == NODE_OPCODE && !node->vals.size()) {
+			switch (node->opcode) {
+				case OP_TRUE: case OP_FALSE: case OP_NIL:
+					return !node->args;
+				case OP_NEG: case OP_NOT: case OP_COUNT:
+					return inline_expr(fn, node->args, size);
+				default:
+					break;
+			}
+		}
+
+		return false;
+	}
+
+	// called once the function has been compiled, when keys are final
+	void inline_define(node_t* fn, int sub) {
+		if (fn->vals.size() != 1 || fn->vals[0]->type != NODE_RETURN) return;
+		int size = 0;
+		if (!inline_expr(fn, fn->vals[0]->args, &size)) return;
+		inlines.push_back({fn->item, fn, sub});
+	}
+
+	inline_t* inline_find(item_t name) {
+		for (int i = inlines.size()-1; i >= 0; --i)
+			if (equal(inlines[i].name, name)) return &inlines[i];
+		return nullptr;
+	}
+
+	// copy of a leaf expression with parameters renamed to caller locals
+	node_t* inline_clone(node_t* fn, node_t* node, vec_t* names) {
+		node_t* copy = node_allot();
+		*copy = *node;
+		if (node->type == NODE_NAME)
+			copy->item = vec_get(names, scope_find(fn, node->item));
+		if (node->args)
+			copy->args = inline_clone(fn, node->args, names);
+		for (auto& val: copy->vals)
+			val = inline_clone(fn, val, names);
+		return copy;
+	}
+
+	// stack: args..., function value
+	void compile_inline(node_t* scope, inline_t* leaf) {
+		node_t* fn = leaf->fn;
+
+		if (!compile_room(scope, fn->keys.size())) {
+			compile(OP_CALL, nil());
+			return;
+		}
+
+		// OP_INLINE plan: [subroutine, end ip, local slot per parameter]
+		vec_t* plan = vec_allot();
+		vec_push(plan, integer(leaf->sub));
+		vec_push(plan, integer(0));
+
+		vec_t* names = vec_allot();
+		char tmp[STRTMP];
+		for (auto param: fn->keys) {
+			snprintf(tmp, sizeof(tmp), "%s:%s", leaf->name.str, param->item.str);
+			int slot = compile_hidden(scope, tmp);
+			vec_push(names, string(tmp));
+			vec_push(plan, integer(slot));
+		}
+
+		compile(OP_INLINE, (item_t){.type = VECTOR, .vec = plan});
+		process(scope, inline_clone(fn, fn->vals[0]->args, names), 0, 0, 1);
+
+		vec_cell(plan, 1)->inum = code.size();
+		compile_barrier();
+	}
+
+	// Register code. With enable_registers(), statements inside functions
+	// whose expressions are arithmetic and comparisons compile to
+	// three-address instructions over the frame's local slots instead of
+	// stack pushes wrapped in MARK/LIMIT. Operands are locals, number
+	// literals preloaded into hidden slots by OP_ENTER, or any other single
+	// value computed on the stack and popped into a temporary slot. Slots
+	// are packed eight bits each: dst | a<<8 | b<<16, or a | b<<8 | ip<<16
+	// for compare-and-branch.
+
+	static const int REG_CONST = 1;
+	static const int REG_LOCAL = 2;
+	static const int REG_SPILL = 3;
+	static const int REG_OP = 4;
+
+	bool registers = false;
+
+	// locals still free once every named local in the function is counted
+	bool compile_room(node_t* scope, int extra) {
+		auto& fscope = scopes[scope->fpath.id];
+		return fscope.names + fscope.hidden + extra < LOCALS;
+	}
+
+	// compiler-owned local; the name is not a valid identifier
+	int compile_hidden(node_t* scope, const char* name) {
+		node_t* hidden = node_allot();
+		hidden->item = string(name);
+		int known = scope_find(scope, hidden->item);
+		if (known >= 0) return known;
+		scopes[scope->fpath.id].hidden++;
+		return compile_local(scope, hidden);
+	}
+
+	int reg_kind(node_t* scope, node_t* node) {
+		if (node->index || node->field || node->method) return 0;
+
+		if (node->type == NODE_LITERAL && !node->chain) {
+			item_t val = node->item;
+			if (val.type == INTEGER || val.type == FLOAT || val.type == BOOLEAN) return REG_CONST;
+		}
+
+		if (node->type == NODE_NAME && !node->call && !node->chain && scope_find(scope, node->item) >= 0)
+			return REG_LOCAL;
+
+		if (node->type == NODE_OPERATOR && !node->chain && node->vals.size() == 2) {
+			switch (node->opcode) {
+				case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+				case OP_EQ: case OP_NE: case OP_LT: case OP_LTE: case OP_GT: case OP_GTE:
+					return reg_kind(scope, node->vals[0]) && reg_kind(scope, node->vals[1]) ? REG_OP: 0;
+				default:
+					break;
+			}
+			return 0;
+		}
+
+		// anything else leaving exactly one value on the stack
+		if (node->type == NODE_NAME || (node->type == NODE_LITERAL && node->item.type == STRING))
+			return REG_SPILL;
+
+		return 0;
+	}
+
+	// upper bound on new slots an expression needs
+	int reg_slots(node_t* node) {
+		int n = 1;
+		for (auto val: node->vals) n += reg_slots(val);
+		return node->type == NODE_OPERATOR ? n: 1;
+	}
+
+	int reg_const(node_t* scope, item_t val) {
+		auto& presets = scopes[scope->fpath.id].presets;
+		for (auto& preset: presets) {
+			if (preset.second.type == val.type && equal(preset.second, val)) return preset.first;
+		}
+		char name[STRTMP];
+		snprintf(name, sizeof(name), "#k%d", (int)presets.size());
+		int slot = compile_hidden(scope, name);
+		presets.push_back({slot, val});
+		return slot;
+	}
+
+	int reg_temp(node_t* scope, int* temps) {
+		char name[STRTMP];
+		snprintf(name, sizeof(name), "#t%d", (*temps)++);
+		return compile_hidden(scope, name);
+	}
+
+	enum opcode_t reg_opcode(enum opcode_t opcode) {
+		switch (opcode) {
+			case OP_ADD: return OPR_ADD;
+			case OP_SUB: return OPR_SUB;
+			case OP_MUL: return OPR_MUL;
+			case OP_DIV: return OPR_DIV;
+			case OP_MOD: return OPR_MOD;
+			case OP_EQ:  return OPR_EQ;
+			case OP_NE:  return OPR_NE;
+			case OP_LT:  return OPR_LT;
+			case OP_LTE: return OPR_LTE;
+			case OP_GT:  return OPR_GT;
+			case OP_GTE: return OPR_GTE;
+			default: break;
+		}
+		return OP_STOP;
+	}
+
+	// compile an expression into a slot, dst if given; returns the slot
+	int reg_expr(node_t* scope, node_t* node, int dst, int* temps) {
+		switch (reg_kind(scope, node)) {
+			case REG_CONST:
+				return reg_const(scope, node->item);
+			case REG_LOCAL:
+				return scope_find(scope, node->item);
+			case REG_SPILL: {
+				int slot = dst >= 0 ? dst: reg_temp(scope, temps);
+				process(scope, node, 0, 0, 1);
+				compile(OPR_POP, integer(slot));
+				return slot;
+			}
+		}
+		assert(reg_kind(scope, node) == REG_OP);
+		int a = reg_expr(scope, node->vals[0], -1, temps);
+		int b = reg_expr(scope, node->vals[1], -1, temps);
+		int d = dst >= 0 ? dst: reg_temp(scope, temps);
+		compile(reg_opcode(node->opcode), integer(d | a<<8 | b<<16));
+		return d;
+	}
+
+	// local = expression as a statement
+	bool reg_assign(node_t* scope, node_t* node) {
+		if (!registers || !scope || node->type != NODE_MULTI) return false;
+		if (node->results != RESULTS_DISCARD || node->index || node->chain) return false;
+		if (node->keys.size() != 1 || node->vals.size() != 1) return false;
+
+		node_t* key = node->keys[0];
+		node_t* val = node->vals[0];
+
+		if (key->type != NODE_NAME || key->index || key->field || key->call || key->chain) return false;
+		int kind = reg_kind(scope, val);
+		if (kind != REG_OP && kind != REG_LOCAL && kind != REG_CONST) return false;
+		if (!compile_room(scope, reg_slots(val)+1)) return false;
+
+		int temps = 0;
+		int dst = compile_local(scope, key);
+		int src = reg_expr(scope, val, kind == REG_OP ? dst: -1, &temps);
+		if (src != dst) compile(OPR_MOVE, integer(dst | src<<8));
+		return true;
+	}
+
+	// compare-and-branch for an if/while condition; returns the instruction
+	// to patch with the false target, or -1
+	int reg_test(node_t* scope, node_t* cond) {
+		if (!registers || !scope || !cond || reg_kind(scope, cond) != REG_OP) return -1;
+		if (!compile_room(scope, reg_slots(cond))) return -1;
+
+		enum opcode_t test = OP_STOP;
+		switch (cond->opcode) {
+			case OP_EQ:  test = OPR_TEQ;  break;
+			case OP_NE:  test = OPR_TNE;  break;
+			case OP_LT:  test = OPR_TLT;  break;
+			case OP_LTE: test = OPR_TLTE; break;
+			case OP_GT:  test = OPR_TGT;  break;
+			case OP_GTE: test = OPR_TGTE; break;
+			default: return -1;
+		}
+
+		int temps = 0;
+		int a = reg_expr(scope, cond->vals[0], -1, &temps);
+		int b = reg_expr(scope, cond->vals[1], -1, &temps);
+		return compile(test, integer(a | b<<8));
+	}
+
+	void reg_target(int test, int ip) {
+		compiled(test)->item.inum |= (int64_t)ip<<16;
+	}
+
+	// Stack effects. A node is single when its code always leaves exactly
+	// one value, and limited when it applies process()'s limit itself
+	// (calls end in OP_LIMIT). Neither needs a MARK/LIMIT wrapper to
+	// normalise its result count.
+
+	bool single_result(node_t* node) {
+		if (node->type == NODE_OPCODE && node->vals.size()) return false;
+		if (node->type == NODE_OPCODE && node->args && !single_result(node->args)) return false;
+
+		for (node_t* link = node; link; link = link->chain) {
+			if (link->call || link->type == NODE_CALL_CHAIN) return false;
+			if (link != node && link->type != NODE_NAME && !link->index) return false;
+		}
+
+		switch (node->type) {
+			case NODE_LITERAL:
+				return node->item.type != STRING || !strchr(node->item.str, '$');
+			case NODE_NAME:
+			case NODE_VEC:
+			case NODE_MAP:
+				return true;
+			case NODE_OPERATOR:
+				return node->single;
+			case NODE_OPCODE:
+				return node->single || node->opcode == OP_TRUE || node->opcode == OP_FALSE || node->opcode == OP_NIL;
+			case NODE_MULTI:
+				return node->results == 1 && !node->control;
+		}
+		return false;
+	}
+
+	bool limited_result(node_t* node) {
+		// only names pass the limit along their chain
+		node_t* last = node;
+		for (; last->chain; last = last->chain) {
+			if (last->type != NODE_NAME) return false;
+		}
+		if (last->index) return false;
+		if (last->type == NODE_CALL_CHAIN) return true;
+		return last->type == NODE_NAME && last->call;
+	}
+
+	// nested functions reach the enclosing frame's locals through
+	// uplocal(), so only functions without any may replace their frame
+	bool tail_nested(node_t* node) {
+		if (!node) return false;
+		if (node->type == NODE_FUNCTION) return true;
+		if (tail_nested(node->args) || tail_nested(node->chain)) return true;
+		for (auto key: node->keys) if (tail_nested(key)) return true;
+		for (auto val: node->vals) if (tail_nested(val)) return true;
+		return false;
+	}
+
+	// return fn(...) with a plain function name, unless it will be inlined
+	node_t* tail_call(node_t* scope, node_t* node) {
+		if (!scope || !node || !scopes[scope->fpath.id].tails) return nullptr;
+		if (node->type == NODE_MULTI && !node->keys.size() && node->vals.size() == 1) node = node->vals[0];
+		if (node->type != NODE_NAME || !node->call) return nullptr;
+		if (node->index || node->field || node->chain) return nullptr;
+		return inline_find(node->item) ? nullptr: node;
+	}
+
+	void process(node_t* scope, node_t *node, int flags, int index, int limit) {
+		int flag_assign = flags & PROCESS_ASSIGN ? 1:0;
+
+		// if we're assigning with chained expressions, only OP_SET|OP_ASSIGN the last one
+		bool assigning = flag_assign && !node->chain;
+
+		char tmp[STRTMP];
+
+		// a multi-part expression: a[,b...] = node[,node...]
+		// this is the entry point for most non-control non-opcode statements
+		if (node->type == NODE_MULTI) {
+			assert(!node->args);
+			assert(node->vals.size());
+
+			if (reg_assign(scope, node)) return;
+
+			// lone value with a known or self-limited result count
+			if (!node->keys.size() && node->vals.size() == 1 && node->results >= 0 && !node->control) {
+				node_t* val = node->vals[0];
+				bool direct = limited_result(val) || (single_result(val) && node->results <= 1);
+				if (direct) {
+					process(scope, val, 0, 0, node->results);
+					if (!limited_result(val) && node->results == 0)
+						compile(OP_DROP, nil());
+					if (node->index)
+						compile(assigning ? OP_SET: OP_GET, nil());
+					if (node->chain)
+						process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+					return;
+				}
+			}
+
+			// local = single value
+			if (scope && node->keys.size() == 1 && node->vals.size() == 1 && node->results == RESULTS_DISCARD && !node->index && !node->chain) {
+				node_t* key = node->keys[0];
+				node_t* val = node->vals[0];
+				bool plain = key->type == NODE_NAME && !key->index && !key->field && !key->call && !key->chain;
+				if (plain && (single_result(val) || limited_result(val))) {
+					int local = compile_local(scope, key);
+					process(scope, val, 0, 0, 1);
+					compile(OPP_ASSIGNP, integer(local));
+					return;
+				}
+			}
+
+			bool wrap = node->results != RESULTS_ALL && !node->control;
+
+			// substack frame
+			if (wrap)
+				compile(OP_MARK, nil());
+
+			// stream the values onto the substack
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, -1);
+
+			// OP_SET|OP_ASSIGN index values from the start of the current substack frame
+			for (int i = 0, l = node->keys.size(); i < l; i++) {
+				node_t* subnode = node->keys[i];
+				process(scope, subnode, PROCESS_ASSIGN, i, -1);
+			}
+
+			// end substack frame
+			if (wrap)
+				compile(OP_LIMIT, integer(node->results));
+
+			// [expr]
+			if (node->index)
+				compile(assigning ? OP_SET: OP_GET, nil());
+
+			// [expr](...)
+			if (node->chain)
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+		}
+		else
+		if (node->type == NODE_NAME) {
+			assert(!node->keys.size() && !node->vals.size());
+
+			// function or function-like opcode call
+			if (node->call) {
+				assert(!assigning);
+
+				// vecmap[fn()]
+//				if (node->index) {
+//					compile(OP_MARK, nil());
+//						if (node->args)
+//							process(scope, node->args, 0, 0, -1);
+//						compile(OP_LIT, node->item);
+//						compile(OP_FIND, nil());
+//						compile(OP_CALL, nil());
+//					compile(OP_LIMIT, integer(1));
+//					compile(OP_GET, nil());
+//				}
+
+				// :fn()
+				if (node->field && node->method) {
+					compile(OP_COPY, nil());
+					compile(OP_LIT, node->item);
+					compile(OP_GET, nil());
+					compile(OP_SHUNT, nil());
+					compile(OP_SHUNT, nil());
+					compile(OP_MARK, nil());
+						compile(OP_SHIFT, nil());
+						if (node->args)
+							process(scope, node->args, 0, 0, -1);
+						compile(OP_SHIFT, nil());
+						compile(OP_CALL, nil());
+					compile(OP_LIMIT, integer(node->chain ? 1: limit));
+				}
+
+				// .fn()
+				if (node->field && !node->method) {
+					compile(OP_LIT, node->item);
+					compile(OP_GET, nil());
+					compile(OP_SHUNT, nil());
+					compile(OP_MARK, nil());
+						if (node->args)
+							process(scope, node->args, 0, 0, -1);
+						compile(OP_SHIFT, nil());
+						compile(OP_CALL, nil());
+					compile(OP_LIMIT, integer(node->chain ? 1: limit));
+				}
+
+				// fn()
+				if (!node->index && !node->field) {
+					inline_t* leaf = scope ? inline_find(node->item): nullptr;
+					compile(OP_MARK, nil());
+						if (node->args)
+							process(scope, node->args, 0, 0, -1);
+						compile_lookup(scope, node);
+						if (leaf)
+							compile_inline(scope, leaf);
+						else
+							compile(OP_CALL, nil());
+					compile(OP_LIMIT, integer(node->chain ? 1: limit));
+				}
+			}
+			// variable reference
+			else {
+				if (assigning) {
+					if (node->index) {
+						compile(OP_LIT, node->item);
+						compile(OP_FIND, nil());
+						compile(OP_SET, nil());
+					}
+
+					if (node->field) {
+						compile(OP_LIT, node->item);
+						compile(OP_SET, nil());
+					}
+
+					if (!node->index && !node->field) {
+						compile_assign(scope, node, index);
+					}
+				}
+				else {
+					if (node->index) {
+						compile(OP_LIT, node->item);
+						compile(OP_FIND, nil());
+						compile(OP_GET, nil());
+					}
+
+					if (node->field) {
+						compile(OP_LIT, node->item);
+						compile(OP_GET, nil());
+					}
+
+					if (!node->index && !node->field) {
+						compile_lookup(scope, node);
+					}
+				}
+			}
+
+			// only the end of a chain returns multiple results
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, limit);
+			}
+		}
+		else
+		// function with optional name assignment
+		if (node->type == NODE_FUNCTION) {
+			assert(!node->args);
+
+			compile(OP_MARK, nil());
+			int entry = compile(OP_LIT, nil());
+
+			if (node->item.type) {
+				compile_assign(scope, node, 0);
+			}
+
+			int jump = compile(OP_JMP, nil());
+			compiled(entry)->item = (item_t){.type = SUBROUTINE, .sub = (int)code.size()};
+
+			scopes.resize(std::max((size_t)(node->fpath.id+1), scopes.size()));
+			auto& fscope = scopes[node->fpath.id];
+
+			fscope.id = node->fpath.id;
+			for (int i = 0, l = node->fpath.ids.size(); i < l; i++) {
+				fscope.up.push_back(node->fpath.ids[i]);
+			}
+
+			compile(OP_ENTER, integer(fscope.id));
+
+			fold_t names;
+			for (auto key: node->keys) fold_write(&names, key->item);
+			for (auto val: node->vals) fold_count(&names, val);
+			fscope.names = names.writes.size();
+
+			fscope.tails = true;
+			for (auto val: node->vals) fscope.tails = fscope.tails && !tail_nested(val);
+
+			for (int i = 0, l = node->vals.size(); i < l; i++) {
+				process(node, node->vals[i], 0, 0, 0);
+			}
+
+			must(node->keys.size() < LOCALS, "too many locals");
+
+			for (auto& key: node->keys) {
+				fscope.locals.push_back(key->item.str);
+			}
+
+			// if an explicit return expression is used, these instructions
+			// will be dead code
+			compile(OP_CLEAN, nil());
+			compile(OP_RETURN, nil());
+			compiled(jump)->item = integer(code.size());
+			compile_barrier();
+
+			if (node->item.type)
+				inline_define(node, compiled(entry)->item.sub);
+
+			// value only returns if not function name() form
+			compile(OP_LIMIT, integer(node->item.type ? 0:1));
+
+			// function() ... end()
+			if (node->call) {
+				compile(OP_SHUNT, nil());
+				compile(OP_MARK, nil());
+					if (node->args)
+						process(scope, node->args, 0, 0, -1);
+					compile(OP_SHIFT, nil());
+					compile(OP_CALL, nil());
+				compile(OP_LIMIT, integer(limit));
+			}
+		}
+		else
+		// function/opcode call
+		if (node->type == NODE_CALL_CHAIN) {
+			compile(OP_SHUNT, nil());
+			compile(OP_MARK, nil());
+				if (node->args)
+					process(scope, node->args, 0, 0, -1);
+				compile(OP_SHIFT, nil());
+				for (int i = 0, l = node->vals.size(); i < l; i++)
+					process(scope, node->vals[i], 0, 0, -1);
+				compile(OP_CALL, nil());
+			compile(OP_LIMIT, integer(limit));
+
+			if (node->index) {
+				compile(assigning ? OP_SET: OP_GET, nil());
+			}
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+		}
+		// inline opcode
+		else
+		if (node->type == NODE_OPCODE) {
+			assert(node->opcode != OP_CALL);
+
+			if (node->args)
+				process(scope, node->args, 0, 0, -1);
+
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, -1);
+
+			compile(node->opcode, nil());
+
+			if (node->index) {
+				compile(assigning ? OP_SET: OP_GET, nil());
+			}
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+		}
+		else
+		if (node->type == NODE_OPERATOR && node->opcode == OP_AND) {
+			assert(node->vals.size() == 2);
+			process(scope, node->vals[0], 0, 0, 1);
+			int jump = compile(OP_JFALSE, nil());
+			compile(OP_DROP, nil());
+			process(scope, node->vals[1], 0, 0, 1);
+			compiled(jump)->item = integer(code.size());
+			compile_barrier();
+		}
+		else
+		if (node->type == NODE_OPERATOR && node->opcode == OP_OR) {
+			assert(node->vals.size() == 2);
+			process(scope, node->vals[0], 0, 0, 1);
+			int jump = compile(OP_JTRUE, nil());
+			compile(OP_DROP, nil());
+			process(scope, node->vals[1], 0, 0, 1);
+			compiled(jump)->item = integer(code.size());
+			compile_barrier();
+		}
+		else
+		if (node->type == NODE_OPERATOR) {
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, 1);
+
+			compile(infer_opcode(node), nil());
+
+			if (node->index) {
+				compile(assigning ? OP_SET: OP_GET, nil());
+			}
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+		}
+		else
+		// string or number literal, optionally part of array chain a[b]["c"]
+		if (node->type == NODE_LITERAL) {
+			assert(!node->args && !node->keys.size() && !node->vals.size());
+
+			const char *dollar = node->item.type == STRING ? strchr(node->item.str, '$'): nullptr;
+
+			if (dollar && dollar < node->item.str + strlen(node->item.str) - 1) {
+				assert(node->item.type == STRING);
+
+				const char *str = node->item.str;
+				const char *left = str;
+				const char *right = str;
+
+				bool started = false;
+
+				while ((right = strchr(left, '$')) && right && *right) {
+					const char *start = right+1;
+					const char *finish = start;
+					int length = 0;
+
+					if (*start == '(') {
+						start++;
+						const char *rparen = strchr(start, ')');
+						must(rparen, "string interpolation missing closing paren: %s", right);
+						length = rparen-start;
+						finish = rparen+1;
+					}
+					else {
+						length = str_skip(start, isname);
+						finish = &start[length];
+					}
+
+					if (right > left) {
+						compile(OP_LIT, string(substr(left, 0, right-left+(length ? 0:1))));
+						if (started) compile(OP_CONCAT, nil());
+						started = true;
+					}
+
+					left = finish;
+
+					if (length) {
+						const char *sub = substr(start, 0, length);
+						must(length == parse(sub, RESULTS_FIRST, PARSE_COMMA|PARSE_ANDOR), "string interpolation parsing failed");
+						process(scope, parsed, 0, 0, -1);
+						if (started) compile(OP_CONCAT, nil());
+						started = true;
+					}
+				}
+
+				if (strlen(left)) {
+					compile(OP_LIT, string(substr(left, 0, strlen(left))));
+					if (started) compile(OP_CONCAT, nil());
+					started = true;
+				}
+			}
+			else {
+				compile(OP_LIT, node->item);
+			}
+
+			if (node->index) {
+				compile(assigning ? OP_SET: OP_GET, nil());
+			}
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+
+			must(!assigning || node->item.type == STRING, "cannot assign %s",
+				tmptext(node->item, tmp, sizeof(tmp)));
+
+			// special case allows: "complex-string" = value in map literals
+			if (!node->index && assigning && node->item.type == STRING) {
+				compile(OP_ASSIGN, integer(index));
+			}
+		}
+		else
+		// if expression ... [else ...] end
+		// (returns a value for ternary style assignment)
+		if (node->type == NODE_IF) {
+			item_t cond;
+
+			// constant condition: only the live block. A false condition
+			// with no else block is the result, as when tested at run time
+			if (fold_value(node->args, &cond)) {
+				if (!truth(cond) && !node->keys.size())
+					compile(OP_LIT, cond);
+				// the dropped block still declares its locals, in source order
+				if (!truth(cond)) for (auto stmt: node->vals) compile_declare(scope, stmt);
+				auto& block = truth(cond) ? node->vals: node->keys;
+				for (int i = 0, l = block.size(); i < l; i++)
+					process(scope, block[i], 0, 0, 0);
+				if (truth(cond)) for (auto stmt: node->keys) compile_declare(scope, stmt);
+				must(!assigning, "cannot assign to if block");
+				return;
+			}
+
+			// register compare-and-branch leaves nothing on the stack, so a
+			// false condition with no else block pushes its own result
+			int test = reg_test(scope, node->args);
+			if (test >= 0) {
+				for (int i = 0, l = node->vals.size(); i < l; i++)
+					process(scope, node->vals[i], 0, 0, 0);
+				int jump = compile(OP_JMP, nil());
+				reg_target(test, code.size());
+				compile_barrier();
+				if (node->keys.size()) {
+					for (int i = 0, l = node->keys.size(); i < l; i++)
+						process(scope, node->keys[i], 0, 0, 0);
+				}
+				else {
+					compile(OP_FALSE, nil());
+				}
+				compiled(jump)->item = integer(code.size());
+				compile_barrier();
+				must(!assigning, "cannot assign to if block");
+				return;
+			}
+
+			// conditions
+			if (node->args)
+				process(scope, node->args, 0, 0, -1);
+
+			// if false, jump to else/end
+			int jump = compile(OP_JFALSE, nil());
+			compile(OP_DROP, nil());
+
+			// success block
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, 0);
+
+			// optional failure block
+			if (node->keys.size()) {
+				// jump success path past failure block
+				int jump2 = compile(OP_JMP, nil());
+				compiled(jump)->item = integer(code.size());
+				compile_barrier();
+				compile(OP_DROP, nil());
+
+				// failure block
+				for (int i = 0, l = node->keys.size(); i < l; i++)
+					process(scope, node->keys[i], 0, 0, 0);
+
+				compiled(jump2)->item = integer(code.size());
+				compile_barrier();
+			}
+			else {
+				compiled(jump)->item = integer(code.size());
+				compile_barrier();
+			}
+
+			must(!assigning, "cannot assign to if block");
+		}
+		else
+		// while expression ... end
+		if (node->type == NODE_WHILE) {
+			assert(node->vals.size());
+
+			// constant condition: never runs, or runs without a test
+			item_t cond;
+			bool fixed = fold_value(node->args, &cond);
+			if (fixed && !truth(cond)) {
+				for (auto stmt: node->vals) compile_declare(scope, stmt);
+				must(!assigning, "cannot assign to while block");
+				return;
+			}
+
+			compile(OP_MARK, nil());
+			int loop = compile(OP_LOOP, nil());
+			int begin = code.size();
+			int iter = -1;
+			int test = fixed ? -1: reg_test(scope, node->args);
+
+			if (!fixed && test < 0) {
+				// condition(s)
+				if (node->args)
+					process(scope, node->args, 0, 0, -1);
+
+				// if false, jump to end
+				iter = compile(OP_JFALSE, nil());
+				compile(OP_DROP, nil());
+			}
+
+			// do ... end
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, 0);
+
+			// clean up
+			compile(OP_JMP, integer(begin));
+			if (iter >= 0) compiled(iter)->item = integer(code.size());
+			if (test >= 0) reg_target(test, code.size());
+			compiled(loop)->item = integer(code.size());
+			compile_barrier();
+			compile(OP_UNLOOP, nil());
+			compile(OP_LIMIT, integer(0));
+
+			must(!assigning, "cannot assign to while block");
+		}
+		else
+		// for k,v in container ... end
+		if (node->type == NODE_FOR) {
+			compile(OP_MARK, nil());
+
+			// the iterable
+			if (node->args)
+				process(scope, node->args, 0, 0, -1);
+
+			int loop = compile(OP_LOOP, nil());
+			int begin = code.size();
+
+			// OP_FOR expects a vector with key[,val] variable names
+
+			vec_t* keys = vec_allot();
+
+			if (scope) {
+				for (auto& key: node->fkeys) {
+					node_t* nkey = node_allot();
+					nkey->item = key;
+					int local = compile_local(scope, nkey);
+					vec_push(keys, integer(local));
+				}
+			}
+			else {
+				for (auto& key: node->fkeys) {
+					vec_push(keys, key);
+				}
+			}
+
+			compile(OP_FOR, (item_t){.type = VECTOR, .vec = keys});
+
+			// block
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(scope, node->vals[i], 0, 0, 0);
+
+			// clean up
+			compile(OP_JMP, integer(begin));
+			compiled(loop)->item = integer(code.size());
+			compile_barrier();
+			compile(OP_UNLOOP, nil());
+			compile(OP_LIMIT, integer(0));
+
+			must(!assigning, "cannot assign to for block");
+		}
+		else
+		// return 0 or more values
+		if (node->type == NODE_RETURN) {
+			compile(OP_CLEAN, nil());
+
+			node_t* tail = tail_call(scope, node->args);
+
+			if (tail) {
+				compile(OP_MARK, nil());
+					if (tail->args)
+						process(scope, tail->args, 0, 0, -1);
+					compile_lookup(scope, tail);
+					compile(OP_TAIL, nil());
+				compile(OP_LIMIT, integer(-1));
+			}
+			else
+			if (node->args)
+				process(scope, node->args, 0, 0, -1);
+
+			compile(OP_RETURN, nil());
+
+			must(!assigning, "cannot assign to return");
+		}
+		else
+		// literal vector [1,2,3]
+		if (node->type == NODE_VEC) {
+			assert(!node->args);
+			compile(node->temp ? OPP_VTEMP: OP_VECTOR, nil());
+			compile(OP_MARK, nil());
+
+			for (int i = 0, l = node->vals.size(); i < l; i++) {
+				process(scope, node->vals[i], 0, 0, -1);
+				compile(OP_VPUSH, nil());
+			}
+
+			compile(OP_LIMIT, integer(0));
+			compile(OP_SHIFT, nil());
+
+			if (node->temp)
+				compile(OPP_UNTEMP, nil());
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+		}
+		else
+		// literal map { a = 1, b = 2, c = nil }
+		if (node->type == NODE_MAP) {
+			compile(OP_MARK, nil());
+			compile(node->temp ? OPP_MTEMP: OP_MAP, nil());
+			assert(!node->args);
+
+			for (int i = 0, l = node->vals.size(); i < l; i++)
+				process(nullptr, node->vals[i], 0, 0, 0);
+
+			compile(OP_UNMAP, nil());
+			compile(OP_LIMIT, integer(1));
+
+			if (node->temp)
+				compile(OPP_UNTEMP, nil());
+
+			if (node->chain) {
+				process(scope, node->chain, flag_assign ? PROCESS_ASSIGN: 0, 0, 1);
+			}
+		}
+		else {
+			must(0, "unexpected expression type: %d", node->type);
+		}
+	}
+
+	void source(const char *source) {
+		int offset = skip_gap(source);
+
+		while (source[offset]) {
+			offset += parse(&source[offset], RESULTS_DISCARD, PARSE_COMMA|PARSE_ANDOR);
+			node_t* node = fold(nullptr, parsed);
+			escape(node);
+			process(nullptr, node, 0, 0, -1);
+		}
+
+		must(!depth(), "parse unbalanced");
+	}
+
+	item_t& literal() {
+		return code[routine->ip-1].item;
+	}
+
+	int64_t literal_int() {
+		item_t& lit = literal();
+		return lit.type == INTEGER ? lit.inum: 0;
+	}
+
+	void op_print() {
+		int items = depth();
+		if (!items) return;
+
+		item_t* item = stack_cell(-items);
+
+		char tmp[STRBUF];
+		for (int i = 0; i < items; i++, item++) {
+			if (item->type == VIEW) {
+				fprintf(stdout, "%s%.*s", i ? "\t": "", (int)item->len, item->str);
+				continue;
+			}
+			const char *str = tmptext(*item, tmp, sizeof(tmp));
+			fprintf(stdout, "%s%s", i ? "\t": "", str);
+		}
+		fprintf(stdout, "\n");
+		fflush(stdout);
+	}
+
+	void op_clean() {
+		routine->stack.depth -= depth();
+	}
+
+	void meta_set(item_t obj, item_t meta) {
+		if (obj.type == VECTOR) {
+			obj.vec->meta = meta;
+			return;
+		}
+
+		if (obj.type == MAP) {
+			obj.map->meta = meta;
+			return;
+		}
+
+		if (obj.type == USERDATA) {
+			obj.data->meta = meta;
+			return;
+		}
+
+		if (obj.type == ARRAY) {
+			obj.arr->meta = meta;
+			return;
+		}
+
+		char tmp[STRTMP];
+		must(false, "cannot set meta on %s", tmptext(obj, tmp, sizeof(tmp)));
+	}
+
+	void op_meta_set() {
+		item_t meta = pop();
+		item_t obj = pop();
+		meta_set(obj, meta);
+	}
+
+	void op_meta_get() {
+		item_t obj = pop();
+
+		if (obj.type == VECTOR) {
+			push(obj.vec->meta);
+			return;
+		}
+
+		if (obj.type == MAP) {
+			push(obj.map->meta);
+			return;
+		}
+
+		if (obj.type == USERDATA) {
+			push(obj.data->meta);
+			return;
+		}
+
+		if (obj.type == ARRAY) {
+			push(obj.arr->meta);
+			return;
+		}
+
+		push(nil());
+	}
+
+	void op_map() {
+		opush(routine->map);
+		routine->map = (item_t){.type = MAP, .map = map_allot()};
+	}
+
+	void op_unmap() {
+		push(routine->map);
+		routine->map = opop();
+	}
+
+	vec_t* temp_vec() {
+		if (!temps.vecs_free.size()) {
+			temps.vecs.emplace_back();
+			return &temps.vecs.back();
+		}
+		vec_t* vec = temps.vecs_free.back();
+		temps.vecs_free.pop_back();
+		vec->items.clear();
+		return vec;
+	}
+
+	map_t* temp_map() {
+		if (!temps.maps_free.size()) {
+			temps.maps.emplace_back();
+			return &temps.maps.back();
+		}
+		map_t* map = temps.maps_free.back();
+		temps.maps_free.pop_back();
+		map->keys.items.clear();
+		map->vals.items.clear();
+		return map;
+	}
+
+	// vector literal escape() proved is consumed in place
+	void op_vtemp() {
+		opush((item_t){.type = VECTOR, .vec = temp_vec()});
+	}
+
+	// map literal escape() proved is consumed in place
+	void op_mtemp() {
+		opush(routine->map);
+		routine->map = (item_t){.type = MAP, .map = temp_map()};
+	}
+
+	// the scratch literal on top is read by the very next instruction and
+	// never again, so its storage can go back on the free list now
+	void op_untemp() {
+		item_t a = top();
+		if (a.type == VECTOR) temps.vecs_free.push_back(a.vec);
+		if (a.type == MAP) temps.maps_free.push_back(a.map);
+	}
+
+	void op_mark() {
+		cor_t* cor = routine;
+		assert(cor->marks.depth < (int)(sizeof(cor->marks.cells)/sizeof(int)));
+		cor->marks.cells[cor->marks.depth++] = cor->stack.depth;
+	}
+
+	void op_mark2() {
+		op_mark();
+		op_mark();
+	}
+
+	void limit(int count) {
+		cor_t* cor = routine;
+		assert(cor->marks.depth > 0);
+		int old_depth = cor->marks.cells[--cor->marks.depth];
+		if (count >= 0) {
+			int req_depth = old_depth + count;
+			while (req_depth > cor->stack.depth) push(nil());
+			cor->stack.depth = req_depth;
+		}
+	}
+
+	void op_limit() {
+		limit(literal_int());
+	}
+
+	void op_limit2() {
+		limit(-1);
+		limit(literal_int());
+	}
+
+	void arrive(int ip) {
+		cor_t* cor = routine;
+
+		must(cor->frames.depth < (int)(sizeof(cor->frames.cells)/sizeof(frame_t)), "call stack overflow");
+		frame_t* frame = &cor->frames.cells[cor->frames.depth++];
+
+		frame->loops = cor->loops.depth;
+		frame->marks = cor->marks.depth;
+		frame->ip = cor->ip;
+
+		frame->locals.depth = 0;
+		frame->scope = 0;
+
+		frame->map = cor->map;
+		cor->map = nil();
+
+		cor->ip = ip;
+	}
+
+	void depart() {
+		cor_t* cor = routine;
+
+		assert(cor->frames.depth > 0);
+		frame_t* frame = &cor->frames.cells[--cor->frames.depth];
+
+		cor->ip = frame->ip;
+		cor->marks.depth = frame->marks;
+		cor->loops.depth = frame->loops;
+
+		cor->map = frame->map;
+	}
+
+	void op_coroutine() {
+		cor_t *cor = cor_allot();
+
+		must(depth() && item(0)->type == SUBROUTINE, "coroutine missing subroutine");
+
+		int ip = item(0)->sub;
+
+		vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor});
+		routine = cor;
+
+		cor->state = COR_RUNNING;
+		arrive(ip);
+		op_mark();
+
+		cor->state = COR_SUSPENDED;
+
+		vec_pop(&routines);
+		routine = vec_top(&routines).cor;
+
+		op_clean();
+
+		push((item_t){.type = COROUTINE, .cor = cor});
+	}
+
+	void op_resume() {
+		must(depth() && item(0)->type == COROUTINE, "resume missing coroutine");
+		cor_t *cor = item(0)->cor;
+
+		int items = depth();
+		cor_t* caller = routine;
+
+		if (cor->state == COR_DEAD) {
+			caller->stack.depth -= items;
+			push(nil());
+			return;
+		}
+
+		cor->state = COR_RUNNING;
+
+		vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor});
+		routine = cor;
+
+		for (int i = 1; i < items; i++) {
+			int index = caller->stack.depth-items+i;
+			push(*stack_ref(caller, index));
+		}
+
+		caller->stack.depth -= items;
+	}
+
+	void op_yield() {
+		int items = depth();
+
+		cor_t* caller = routine;
+		caller->state = COR_SUSPENDED;
+
+		vec_pop(&routines);
+		routine = vec_top(&routines).cor;
+
+		for (int i = 0; i < items; i++) {
+			int index = caller->stack.depth-items+i;
+			push(*stack_ref(caller, index));
+		}
+
+		caller->stack.depth -= items;
+	}
+
+	// yield a wait token ahead of the arguments, parking a scheduled task
+	void op_wait() {
+		must(vec_size(&routines) > 1, "wait outside coroutine");
+		int items = depth();
+		push(nil());
+		for (int i = items; i > 0; i--) *item(i) = *item(i-1);
+		*item(0) = operation(OP_WAIT);
+		op_yield();
+	}
+
+	void op_global() {
+		push((item_t){.type = MAP, .map = scope_global});
+	}
+
+	void call(item_t item) {
+		if (item.type == OPERATION) {
+			operation_call(item.opcode);
+			return;
+		}
+		if (item.type == EXECUTE) {
+			if (item.function < 0) {
+				callable_t& c = callables[-item.function-1];
+				if (c.direct) c.direct(this, c.obj); else c.fn();
+			}
+			else execute(item.function);
+			return;
+		}
+
+		int args = depth();
+
+		char tmp[STRTMP];
+		must(item.type == SUBROUTINE, "invalid function: %s (ip: %u)", tmptext(item, tmp, sizeof(tmp)), routine->ip);
+
+		arrive(item.sub);
+
+		op_mark();
+		// subroutines need to know the base of their subframe,
+		// which is the same as the current depth of the outer
+		// frame mark
+		routine->marks.cells[routine->marks.depth-1] -= args;
+	}
+
+	void op_call() {
+		call(pop());
+	}
+
+	// return f(...): a subroutine takes over the current frame, with its
+	// arguments moved down to the frame base as call() would leave them.
+	// Anything else is an ordinary call, falling through to limit,return
+	void op_tail() {
+		cor_t* cor = routine;
+		item_t item = pop();
+
+		if (item.type != SUBROUTINE) {
+			call(item);
+			return;
+		}
+
+		frame_t* frame = &cor->frames.top();
+		int base = cor->marks.cells[frame->marks];
+		int args = depth();
+		int from = cor->stack.depth - args;
+
+		for (int i = 0; i < args; i++)
+			cor->stack.cells[base+i] = cor->stack.cells[from+i];
+
+		cor->stack.depth = base + args;
+		cor->marks.depth = frame->marks + 1;
+		cor->loops.depth = frame->loops;
+
+		frame->locals.depth = 0;
+		frame->scope = 0;
+
+		cor->map = nil();
+		cor->ip = item.sub;
+	}
+
+	void op_return() {
+		cor_t* cor = routine;
+
+		// subroutines leave only results in their subframe, which
+		// migrate to the caller frame when depart() truncates the
+		// marks stack
+		depart();
+
+		if (!cor->ip) {
+			op_yield();
+			cor->state = COR_DEAD;
+			return;
+		}
+	}
+
+	void op_drop() {
+		pop();
+	}
+
+	void op_lit() {
+		push(literal());
+	}
+
+	void op_loop() {
+		assert(routine->loops.depth+2 < (int)(sizeof(routine->loops.cells)/sizeof(int)));
+		routine->loops.cells[routine->loops.depth++] = routine->marks.depth;
+		routine->loops.cells[routine->loops.depth++] = literal_int();
+		routine->loops.cells[routine->loops.depth++] = 0;
+	}
+
+	void op_unloop() {
+		assert(routine->loops.depth > 2);
+		--routine->loops.depth;
+		--routine->loops.depth;
+		must(routine->loops.cells[--routine->loops.depth] == routine->marks.depth, "mark stack mismatch (unloop)");
+	}
+
+	void op_break() {
+		routine->ip = routine->loops.cells[routine->loops.depth-2];
+		routine->marks.depth = routine->loops.cells[routine->loops.depth-3];
+		while (depth()) pop();
+	}
+
+	void op_continue() {
+		routine->ip = routine->loops.cells[routine->loops.depth-2]-1;
+		routine->marks.depth = routine->loops.cells[routine->loops.depth-3];
+		while (depth()) pop();
+	}
+
+	void op_copy() {
+		push(top());
+	}
+
+	void op_shunt() {
+		opush(pop());
+	}
+
+	void op_shift() {
+		push(opop());
+	}
+
+	void op_nil() {
+		push(nil());
+	}
+
+	void op_true() {
+		push((item_t){.type = BOOLEAN, .flag = 1});
+	}
+
+	void op_false() {
+		push((item_t){.type = BOOLEAN, .flag = 0});
+	}
+
+	void op_jmp() {
+		routine->ip = literal_int();
+	}
+
+	void op_jfalse() {
+		if (!truth(top())) op_jmp();
+	}
+
+	void op_jtrue() {
+		if (truth(top())) op_jmp();
+	}
+
+	void op_vector() {
+		opush((item_t){.type = VECTOR, .vec = vec_allot()});
+	}
+
+	void op_vpush() {
+		for (int i = 0, l = depth(); i < l; i++)
+			vec_push(otop().vec, *item(i));
+		op_clean();
+	}
+
+	void op_unpack() {
+		item_t a = pop();
 
-			must(!assigning, "cannot assign to for block");
+		if (a.type == ARRAY) {
+			for (int i = 0, l = arr_size(a.arr); i < l; i++)
+				push(arr_get(a.arr, i));
+			return;
 		}
-		else
-		// return 0 or more values
-		if (node->type == NODE_RETURN) {
-			compile(OP_CLEAN, nil());
 
-			if (node->args)
-				process(scope, node->args, 0, 0, -1);
+		if (a.type == BYTES) {
+			for (int i = 0, l = a.buf->len; i < l; i++)
+				push(buf_get(a.buf, i));
+			return;
+		}
 
-			compile(OP_RETURN, nil());
+		must(a.type == VECTOR, "pop_type expected %s, found %s", type_names[VECTOR], type_names[a.type]);
+		for (int i = 0, l = vec_size(a.vec); i < l; i++)
+			push(vec_get(a.vec, i));
+	}
 
-			must(!assigning, "cannot assign to return");
+	// lib.array(kind, n|vector|array)
+	void op_array() {
+		must(depth() == 2, "array(kind, size|vector)");
+		item_t src = pop();
+		arr_t* arr = arr_allot(arr_kind(pop_type(STRING).str));
+
+		if (src.type == INTEGER) {
+			must(src.inum >= 0, "array size must be positive");
+			arr_resize(arr, src.inum);
 		}
 		else
-		// literal vector [1,2,3]
-		if (node->type == NODE_VEC) {
-			assert(!node->args);
-			compile(OP_VECTOR, nil());
-			compile(OP_MARK, nil());
-
-			for (int i = 0, l = node->vals.size(); i < l; i++) {
-				process(scope, node->vals[i], 0, 0, -1);
-				compile(OP_VPUSH, nil());
-			}
-
-			compile(OP_LIMIT, integer(0));
-			compile(OP_SHIFT, nil());
+		if (src.type == VECTOR) {
+			arr_resize(arr, vec_size(src.vec));
+			for (int i = 0, l = vec_size(src.vec); i < l; i++) arr_set(arr, i, vec_get(src.vec, i));
 		}
 		else
-		// literal map { a = 1, b = 2, c = nil }
-		if (node->type == NODE_MAP) {
-			compile(OP_MARK, nil());
-			compile(OP_MAP, nil());
-			assert(!node->args);
-
-			for (int i = 0, l = node->vals.size(); i < l; i++)
-				process(nullptr, node->vals[i], 0, 0, 0);
-
-			compile(OP_UNMAP, nil());
-			compile(OP_LIMIT, integer(1));
+		if (src.type == ARRAY) {
+			arr_resize(arr, arr_size(src.arr));
+			for (int i = 0, l = arr_size(src.arr); i < l; i++) arr_set(arr, i, arr_get(src.arr, i));
 		}
 		else {
-			must(0, "unexpected expression type: %d", node->type);
+			must(false, "array(kind, size|vector)");
 		}
+
+		push((item_t){.type = ARRAY, .arr = arr});
 	}
 
-	void source(const char *source) {
-		int offset = skip_gap(source);
+	// Bulk numeric kernels over vectors and typed arrays. f64 arrays use
+	// AVX2 when the CPU has it; the scalar loops are left for the compiler
+	// to vectorize with the baseline instruction set. Vectors and mixed
+	// kinds take a generic path that follows the add()/multiply() rules.
 
-		while (source[offset]) {
-			offset += parse(&source[offset], RESULTS_DISCARD, PARSE_COMMA|PARSE_ANDOR);
-			process(nullptr, parsed, 0, 0, -1);
-		}
+	static bool avx2() {
+		#ifdef __x86_64__
+		static bool has = __builtin_cpu_supports("avx2");
+		return has;
+		#else
+		return false;
+		#endif
+	}
+
+	#ifdef __x86_64__
+	__attribute__((target("avx2")))
+	static double hsum_avx2(__m256d v) {
+		double lanes[4];
+		_mm256_storeu_pd(lanes, v);
+		return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+
+	__attribute__((target("avx2")))
+	static double f64_sum_avx2(const double* x, size_t n) {
+		__m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			a = _mm256_add_pd(a, _mm256_loadu_pd(x+i));
+			b = _mm256_add_pd(b, _mm256_loadu_pd(x+i+4));
+		}
+		double s = hsum_avx2(_mm256_add_pd(a, b));
+		for (; i < n; i++) s += x[i];
+		return s;
+	}
+
+	__attribute__((target("avx2")))
+	static double f64_dot_avx2(const double* x, const double* y, size_t n) {
+		__m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+			b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4)));
+		}
+		double s = hsum_avx2(_mm256_add_pd(a, b));
+		for (; i < n; i++) s += x[i] * y[i];
+		return s;
+	}
+
+	__attribute__((target("avx2")))
+	// NaN is skipped: max_pd/min_pd return the second operand when either
+	// is NaN, so the running extreme is never replaced by one. All NaN
+	// gives the starting infinity.
+	static double f64_extreme_avx2(const double* x, size_t n, bool max) {
+		__m256d m = _mm256_set1_pd(max ? -INFINITY: INFINITY);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256d v = _mm256_loadu_pd(x+i);
+			m = max ? _mm256_max_pd(v, m): _mm256_min_pd(v, m);
+		}
+		double lanes[4];
+		_mm256_storeu_pd(lanes, m);
+		double r = lanes[0];
+		for (int j = 1; j < 4; j++) r = max ? std::max(r, lanes[j]): std::min(r, lanes[j]);
+		for (; i < n; i++) r = max ? std::max(r, x[i]): std::min(r, x[i]);
+		return r;
+	}
+
+	__attribute__((target("avx2")))
+	static void f64_axpy_avx2(double a, const double* x, double* y, size_t n) {
+		__m256d va = _mm256_set1_pd(a);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m256d v = _mm256_add_pd(_mm256_loadu_pd(y+i), _mm256_mul_pd(va, _mm256_loadu_pd(x+i)));
+			_mm256_storeu_pd(y+i, v);
+		}
+		for (; i < n; i++) y[i] += a * x[i];
+	}
+
+	__attribute__((target("avx2")))
+	static void f64_scale_avx2(double* x, double k, size_t n) {
+		__m256d vk = _mm256_set1_pd(k);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x+i, _mm256_mul_pd(_mm256_loadu_pd(x+i), vk));
+		for (; i < n; i++) x[i] *= k;
+	}
+
+	__attribute__((target("avx2")))
+	static void f64_add_avx2(double* x, const double* y, size_t n) {
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x+i, _mm256_add_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+		for (; i < n; i++) x[i] += y[i];
+	}
+
+	__attribute__((target("avx2")))
+	static void f64_clamp_avx2(double* x, double lo, double hi, size_t n) {
+		__m256d vl = _mm256_set1_pd(lo), vh = _mm256_set1_pd(hi);
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x+i, _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(x+i), vl), vh));
+		for (; i < n; i++) x[i] = std::min(std::max(x[i], lo), hi);
+	}
+	#endif
 
-		must(!depth(), "parse unbalanced");
+	template <typename T>
+	static double sum_scalar(const T* x, size_t n) {
+		double a = 0, b = 0, c = 0, d = 0;
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) { a += x[i]; b += x[i+1]; c += x[i+2]; d += x[i+3]; }
+		for (; i < n; i++) a += x[i];
+		return (a + b) + (c + d);
 	}
 
-	item_t& literal() {
-		return code[routine->ip-1].item;
+	template <typename T>
+	static double dot_scalar(const T* x, const T* y, size_t n) {
+		double a = 0, b = 0, c = 0, d = 0;
+		size_t i = 0;
+		for (; i + 4 <= n; i += 4) { a += x[i]*y[i]; b += x[i+1]*y[i+1]; c += x[i+2]*y[i+2]; d += x[i+3]*y[i+3]; }
+		for (; i < n; i++) a += x[i]*y[i];
+		return (a + b) + (c + d);
 	}
 
-	int64_t literal_int() {
-		item_t& lit = literal();
-		return lit.type == INTEGER ? lit.inum: 0;
+	// elements of a vector or array
+	int bulk_size(item_t src) {
+		char tmp[STRTMP];
+		must(src.type == VECTOR || src.type == ARRAY, "expected vector or array: %s", tmptext(src, tmp, sizeof(tmp)));
+		return src.type == ARRAY ? arr_size(src.arr): vec_size(src.vec);
 	}
 
-	void op_print() {
-		int items = depth();
-		if (!items) return;
+	item_t bulk_get(item_t src, int i) {
+		return src.type == ARRAY ? arr_get(src.arr, i): vec_get(src.vec, i);
+	}
 
-		item_t* item = stack_cell(-items);
+	void bulk_set(item_t dst, int i, item_t val) {
+		if (dst.type == ARRAY) arr_set(dst.arr, i, val); else vec_cell(dst.vec, i)[0] = val;
+	}
 
-		char tmp[STRBUF];
-		for (int i = 0; i < items; i++) {
-			const char *str = tmptext(*item++, tmp, sizeof(tmp));
-			fprintf(stdout, "%s%s", i ? "\t": "", str);
-		}
-		fprintf(stdout, "\n");
-		fflush(stdout);
+	item_t bulk_num(item_t val) {
+		char tmp[STRTMP];
+		must(val.type == INTEGER || val.type == FLOAT, "expected number: %s", tmptext(val, tmp, sizeof(tmp)));
+		return val;
 	}
 
-	void op_clean() {
-		routine->stack.depth -= depth();
+	bool same_kind(item_t a, item_t b) {
+		return a.type == ARRAY && b.type == ARRAY && a.arr->kind == b.arr->kind;
 	}
 
-	void meta_set(item_t obj, item_t meta) {
-		if (obj.type == VECTOR) {
-			obj.vec->meta = meta;
-			return;
-		}
+	// lib.sum(x)
+	void op_sum() {
+		item_t x = pop();
+		int n = bulk_size(x);
 
-		if (obj.type == MAP) {
-			obj.map->meta = meta;
+		if (x.type == ARRAY) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				if constexpr (std::is_same<T,double>::value) {
+					#ifdef __x86_64__
+					if (avx2()) { push(number(f64_sum_avx2(p, n))); return; }
+					#endif
+					push(number(sum_scalar(p, n)));
+				}
+				else if constexpr (std::is_floating_point<T>::value) {
+					push(number(sum_scalar(p, n)));
+				}
+				else {
+					int64_t s = 0;
+					for (int i = 0; i < n; i++) s += p[i];
+					push(integer(s));
+				}
+			});
 			return;
 		}
 
-		if (obj.type == USERDATA) {
-			obj.data->meta = meta;
+		item_t s = n ? bulk_num(vec_get(x.vec, 0)): integer(0);
+		for (int i = 1; i < n; i++) s = add(s, bulk_num(vec_get(x.vec, i)));
+		push(s);
+	}
+
+	// lib.dot(x, y)
+	void op_dot() {
+		item_t y = pop();
+		item_t x = pop();
+		int n = bulk_size(x);
+		must(n == bulk_size(y), "dot size mismatch");
+
+		if (same_kind(x, y)) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				T* q = (T*)y.arr->bytes.data();
+				if constexpr (std::is_same<T,double>::value) {
+					#ifdef __x86_64__
+					if (avx2()) { push(number(f64_dot_avx2(p, q, n))); return; }
+					#endif
+					push(number(dot_scalar(p, q, n)));
+				}
+				else if constexpr (std::is_floating_point<T>::value) {
+					push(number(dot_scalar(p, q, n)));
+				}
+				else {
+					int64_t s = 0;
+					for (int i = 0; i < n; i++) s += (int64_t)p[i] * q[i];
+					push(integer(s));
+				}
+			});
 			return;
 		}
 
-		char tmp[STRTMP];
-		must(false, "cannot set meta on %s", tmptext(obj, tmp, sizeof(tmp)));
-	}
-
-	void op_meta_set() {
-		item_t meta = pop();
-		item_t obj = pop();
-		meta_set(obj, meta);
+		item_t s = integer(0);
+		for (int i = 0; i < n; i++) {
+			item_t m = multiply(bulk_num(bulk_get(x, i)), bulk_num(bulk_get(y, i)));
+			s = i ? add(s, m): m;
+		}
+		push(s);
 	}
 
-	void op_meta_get() {
-		item_t obj = pop();
+	// lib.argmin(x), lib.argmax(x) => value, index of the first extreme.
+	// NaN elements are skipped; if every element is NaN the index is 0.
+	void extreme(bool max) {
+		item_t x = pop();
+		int n = bulk_size(x);
 
-		if (obj.type == VECTOR) {
-			push(obj.vec->meta);
+		if (!n) {
+			push(nil());
 			return;
 		}
 
-		if (obj.type == MAP) {
-			push(obj.map->meta);
-			return;
-		}
+		int index = 0;
 
-		if (obj.type == USERDATA) {
-			push(obj.data->meta);
+		if (x.type == ARRAY) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				#ifdef __x86_64__
+				if constexpr (std::is_same<T,double>::value) {
+					if (avx2()) {
+						double m = f64_extreme_avx2(p, n, max);
+						while (index < n && !(p[index] == m)) index++;
+						if (index == n) index = 0;
+						return;
+					}
+				}
+				#endif
+				for (int i = 1; i < n; i++) {
+					if (p[i] != p[i]) continue;
+					if (p[index] != p[index] || (max ? p[index] < p[i]: p[i] < p[index])) index = i;
+				}
+			});
+			push(arr_get(x.arr, index));
+			push(integer(index));
 			return;
 		}
 
-		push(nil());
+		for (int i = 1; i < n; i++) {
+			item_t a = bulk_num(vec_get(x.vec, index));
+			item_t b = bulk_num(vec_get(x.vec, i));
+			double av = a.type == FLOAT ? a.fnum: a.inum;
+			double bv = b.type == FLOAT ? b.fnum: b.inum;
+			if (bv != bv) continue;
+			if (av != av || (max ? av < bv: bv < av)) index = i;
+		}
+		push(vec_get(x.vec, index));
+		push(integer(index));
 	}
 
-	void op_map() {
-		opush(routine->map);
-		routine->map = (item_t){.type = MAP, .map = map_allot()};
+	void op_argmin() {
+		extreme(false);
 	}
 
-	void op_unmap() {
-		push(routine->map);
-		routine->map = opop();
+	void op_argmax() {
+		extreme(true);
 	}
 
-	void op_mark() {
-		cor_t* cor = routine;
-		assert(cor->marks.depth < (int)(sizeof(cor->marks.cells)/sizeof(int)));
-		cor->marks.cells[cor->marks.depth++] = cor->stack.depth;
+	// Integer array kernels fail on a result outside the element type, as
+	// arr_set() does, rather than wrapping
+	template <typename T>
+	T bulk_fit(int64_t v, bool overflow) {
+		must(!overflow && v >= std::numeric_limits<T>::min() && v <= std::numeric_limits<T>::max(),
+			"array value out of range for %s", sizeof(T) == 4 ? "i32": "i64");
+		return (T)v;
 	}
 
-	void op_mark2() {
-		op_mark();
-		op_mark();
+	int64_t bulk_trunc(double f) {
+		must(f >= -9223372036854775808.0 && f < 9223372036854775808.0, "array value out of range for i64: %g", f);
+		return (int64_t)f;
 	}
 
-	void limit(int count) {
-		cor_t* cor = routine;
-		assert(cor->marks.depth > 0);
-		int old_depth = cor->marks.cells[--cor->marks.depth];
-		if (count >= 0) {
-			int req_depth = old_depth + count;
-			while (req_depth > cor->stack.depth) push(nil());
-			cor->stack.depth = req_depth;
+	// lib.scale(x, k) in place
+	void op_scale() {
+		item_t k = bulk_num(pop());
+		item_t x = pop();
+		int n = bulk_size(x);
+
+		if (x.type == ARRAY) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				if constexpr (std::is_floating_point<T>::value) {
+					double kv = k.type == FLOAT ? k.fnum: k.inum;
+					#ifdef __x86_64__
+					if constexpr (std::is_same<T,double>::value) {
+						if (avx2()) { f64_scale_avx2(p, kv, n); return; }
+					}
+					#endif
+					for (int i = 0; i < n; i++) p[i] *= kv;
+				}
+				else {
+					int64_t kv = k.type == FLOAT ? bulk_trunc(k.fnum): k.inum;
+					for (int i = 0; i < n; i++) {
+						int64_t v = 0;
+						p[i] = bulk_fit<T>(v, __builtin_mul_overflow((int64_t)p[i], kv, &v));
+					}
+				}
+			});
+		}
+		else {
+			for (int i = 0; i < n; i++) vec_cell(x.vec, i)[0] = multiply(bulk_num(vec_get(x.vec, i)), k);
 		}
+		push(x);
 	}
 
-	void op_limit() {
-		limit(literal_int());
-	}
+	// lib.add(x, y) x += y in place
+	void op_vadd() {
+		item_t y = pop();
+		item_t x = pop();
+		int n = bulk_size(x);
+		must(n == bulk_size(y), "add size mismatch");
 
-	void op_limit2() {
-		limit(-1);
-		limit(literal_int());
+		if (same_kind(x, y)) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				T* q = (T*)y.arr->bytes.data();
+				#ifdef __x86_64__
+				if constexpr (std::is_same<T,double>::value) {
+					if (avx2()) { f64_add_avx2(p, q, n); return; }
+				}
+				#endif
+				if constexpr (std::is_floating_point<T>::value) {
+					for (int i = 0; i < n; i++) p[i] += q[i];
+				}
+				else {
+					for (int i = 0; i < n; i++) {
+						int64_t v = 0;
+						p[i] = bulk_fit<T>(v, __builtin_add_overflow((int64_t)p[i], (int64_t)q[i], &v));
+					}
+				}
+			});
+		}
+		else {
+			for (int i = 0; i < n; i++) bulk_set(x, i, add(bulk_num(bulk_get(x, i)), bulk_num(bulk_get(y, i))));
+		}
+		push(x);
+	}
+
+	// lib.axpy(a, x, y) y += a*x in place
+	void op_axpy() {
+		item_t y = pop();
+		item_t x = pop();
+		item_t a = bulk_num(pop());
+		int n = bulk_size(y);
+		must(n == bulk_size(x), "axpy size mismatch");
+
+		if (same_kind(x, y)) {
+			arr_visit(y.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				T* q = (T*)x.arr->bytes.data();
+				if constexpr (std::is_floating_point<T>::value) {
+					double av = a.type == FLOAT ? a.fnum: a.inum;
+					#ifdef __x86_64__
+					if constexpr (std::is_same<T,double>::value) {
+						if (avx2()) { f64_axpy_avx2(av, q, p, n); return; }
+					}
+					#endif
+					for (int i = 0; i < n; i++) p[i] += av * q[i];
+				}
+				else
+				if (a.type == INTEGER) {
+					for (int i = 0; i < n; i++) {
+						int64_t m = 0, v = 0;
+						bool over = __builtin_mul_overflow(a.inum, (int64_t)q[i], &m);
+						p[i] = bulk_fit<T>(v, over || __builtin_add_overflow((int64_t)p[i], m, &v));
+					}
+				}
+				else {
+					for (int i = 0; i < n; i++) {
+						int64_t v = 0;
+						p[i] = bulk_fit<T>(v, __builtin_add_overflow((int64_t)p[i], bulk_trunc(a.fnum * q[i]), &v));
+					}
+				}
+			});
+		}
+		else {
+			for (int i = 0; i < n; i++) bulk_set(y, i, add(bulk_num(bulk_get(y, i)), multiply(a, bulk_num(bulk_get(x, i)))));
+		}
+		push(y);
 	}
 
-	void arrive(int ip) {
-		cor_t* cor = routine;
-
-		assert(cor->frames.depth < (int)(sizeof(cor->frames.cells)/sizeof(frame_t)));
-		frame_t* frame = &cor->frames.cells[cor->frames.depth++];
-
-		frame->loops = cor->loops.depth;
-		frame->marks = cor->marks.depth;
-		frame->ip = cor->ip;
-
-		frame->locals.depth = 0;
-		frame->scope = 0;
+	// lib.clamp(x, lo, hi) in place
+	void op_clamp() {
+		item_t hi = bulk_num(pop());
+		item_t lo = bulk_num(pop());
+		item_t x = pop();
+		int n = bulk_size(x);
 
-		frame->map = cor->map;
-		cor->map = nil();
+		double lv = lo.type == FLOAT ? lo.fnum: lo.inum;
+		double hv = hi.type == FLOAT ? hi.fnum: hi.inum;
 
-		cor->ip = ip;
+		if (x.type == ARRAY) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				#ifdef __x86_64__
+				if constexpr (std::is_same<T,double>::value) {
+					if (avx2()) { f64_clamp_avx2(p, lv, hv, n); return; }
+				}
+				#endif
+				T l = lv, h = hv;
+				for (int i = 0; i < n; i++) p[i] = std::min(std::max(p[i], l), h);
+			});
+		}
+		else {
+			for (int i = 0; i < n; i++) {
+				item_t v = bulk_num(vec_get(x.vec, i));
+				double d = v.type == FLOAT ? v.fnum: v.inum;
+				if (d < lv) vec_cell(x.vec, i)[0] = lo;
+				if (d > hv) vec_cell(x.vec, i)[0] = hi;
+			}
+		}
+		push(x);
 	}
 
-	void depart() {
-		cor_t* cor = routine;
-
-		assert(cor->frames.depth > 0);
-		frame_t* frame = &cor->frames.cells[--cor->frames.depth];
-
-		cor->ip = frame->ip;
-		cor->marks.depth = frame->marks;
-		cor->loops.depth = frame->loops;
+	// lib.prefix(x) running sum in place
+	void op_prefix() {
+		item_t x = pop();
+		int n = bulk_size(x);
 
-		cor->map = frame->map;
+		if (x.type == ARRAY) {
+			arr_visit(x.arr, [&](auto* p) {
+				typedef std::remove_pointer_t<decltype(p)> T;
+				if constexpr (std::is_floating_point<T>::value) {
+					for (int i = 1; i < n; i++) p[i] += p[i-1];
+				}
+				else {
+					for (int i = 1; i < n; i++) {
+						int64_t v = 0;
+						p[i] = bulk_fit<T>(v, __builtin_add_overflow((int64_t)p[i], (int64_t)p[i-1], &v));
+					}
+				}
+			});
+		}
+		else {
+			for (int i = 1; i < n; i++) vec_cell(x.vec, i)[0] = add(bulk_num(vec_get(x.vec, i-1)), bulk_num(vec_get(x.vec, i)));
+		}
+		push(x);
 	}
 
-	void op_coroutine() {
-		cor_t *cor = cor_allot();
+	// lib.bytes(n|string|vector|bytes) copy
+	void op_bytes() {
+		must(depth() == 1, "bytes(size|string|vector|bytes)");
+		item_t src = pop();
+		buf_t* buf = nullptr;
 
-		must(depth() && item(0)->type == SUBROUTINE, "coroutine missing subroutine");
+		if (src.type == INTEGER) {
+			must(src.inum >= 0, "bytes size must be positive");
+			buf = buf_allot(src.inum);
+		}
+		else
+		if (is_text(src)) {
+			size_t len = 0;
+			const char* str = text_data(src, &len);
+			buf = buf_allot(len);
+			memcpy(buf_data(buf), str, len);
+		}
+		else
+		if (src.type == BYTES) {
+			buf = buf_allot(src.buf->len);
+			memcpy(buf_data(buf), buf_data(src.buf), buf->len);
+		}
+		else
+		if (src.type == VECTOR) {
+			buf = buf_allot(vec_size(src.vec));
+			for (int i = 0, l = vec_size(src.vec); i < l; i++) buf_set(buf, i, vec_get(src.vec, i));
+		}
+		else {
+			must(false, "bytes(size|string|vector|bytes)");
+		}
 
-		int ip = item(0)->sub;
+		push((item_t){.type = BYTES, .buf = buf});
+	}
 
-		vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor});
-		routine = cor;
+	// lib.slice(bytes|string, off[, len]) view without copying
+	void op_slice() {
+		must(depth() == 2 || depth() == 3, "slice(bytes|string, offset[, length])");
+		int64_t len = depth() == 3 ? pop_type(INTEGER).inum: -1;
+		int64_t off = pop_type(INTEGER).inum;
+		item_t src = pop();
+		must(src.type == BYTES || is_text(src), "slice(bytes|string, offset[, length])");
+		size_t size = 0;
+		if (src.type == BYTES) size = src.buf->len; else text_data(src, &size);
+		if (off < 0) off += size;
+		must(off >= 0 && off <= (int64_t)size, "slice out of bounds");
+		if (len < 0) len = size - off;
+		push(src.type == BYTES
+			? (item_t){.type = BYTES, .buf = buf_slice(src.buf, off, len)}
+			: text_slice(src, off, len)
+		);
+	}
+
+	// lib.peek(bytes, off, fmt) => number
+	void op_peek() {
+		must(depth() == 3, "peek(bytes, offset, format)");
+		const char* fmt = pop_type(STRING).str;
+		int64_t off = pop_type(INTEGER).inum;
+		buf_t* buf = pop_type(BYTES).buf;
+		push(buf_peek(buf, off, fmt));
+	}
+
+	// lib.poke(bytes, off, fmt, value) => bytes
+	void op_poke() {
+		must(depth() == 4, "poke(bytes, offset, format, value)");
+		item_t val = pop();
+		const char* fmt = pop_type(STRING).str;
+		int64_t off = pop_type(INTEGER).inum;
+		item_t buf = pop_type(BYTES);
+		buf_poke(buf.buf, off, fmt, val);
+		push(buf);
+	}
+
+	// lib.str: scans use memchr/memmem and results are views, either of
+	// the source or of one text allocation sized up front
+
+	item_t pop_text() {
+		item_t a = pop();
+		must(is_text(a), "pop_type expected %s, found %s", type_names[STRING], type_names[a.type]);
+		return a;
+	}
+
+	const char* text_find(const char* str, size_t len, const char* sub, size_t slen) {
+		if (slen == 1) return (const char*)memchr(str, sub[0], len);
+		return (const char*)memmem(str, len, sub, slen);
+	}
+
+	// lib.str.split(s[, sep]) => vector; splits on whitespace runs without sep
+	void op_str_split() {
+		must(depth() == 1 || depth() == 2, "split(string[, separator])");
+		size_t slen = 0;
+		const char* sep = depth() == 2 ? text_data(pop_text(), &slen): nullptr;
+		size_t len = 0;
+		const char* str = text_data(pop_text(), &len);
+		const char* end = str+len;
+		vec_t* vec = vec_allot();
+
+		if (!sep) {
+			while (str < end) {
+				while (str < end && isspace((unsigned char)*str)) str++;
+				const char* word = str;
+				while (str < end && !isspace((unsigned char)*str)) str++;
+				if (str > word) vec_push(vec, view(word, str-word));
+			}
+		}
+		else {
+			must(slen > 0, "split separator is empty");
+			for (const char* hit; (hit = text_find(str, end-str, sep, slen)); str = hit+slen)
+				vec_push(vec, view(str, hit-str));
+			vec_push(vec, view(str, end-str));
+		}
 
-		cor->state = COR_RUNNING;
-		arrive(ip);
-		op_mark();
+		push((item_t){.type = VECTOR, .vec = vec});
+	}
 
-		cor->state = COR_SUSPENDED;
+	// lib.str.join(vector[, sep]) => string
+	void op_str_join() {
+		must(depth() == 1 || depth() == 2, "join(vector[, separator])");
+		size_t slen = 0;
+		const char* sep = depth() == 2 ? text_data(pop_text(), &slen): "";
+		vec_t* vec = pop_type(VECTOR).vec;
+		int count = vec_size(vec);
+		char tmp[STRTMP];
 
-		vec_pop(&routines);
-		routine = vec_top(&routines).cor;
+		auto piece = [&](int i, size_t* len) {
+			item_t cell = vec_get(vec, i);
+			if (is_text(cell)) return text_data(cell, len);
+			const char* str = tmptext(cell, tmp, sizeof(tmp));
+			*len = strlen(str);
+			return str;
+		};
 
-		op_clean();
+		size_t total = count ? slen*(count-1): 0;
+		for (int i = 0; i < count; i++) {
+			size_t len = 0;
+			piece(i, &len);
+			total += len;
+		}
 
-		push((item_t){.type = COROUTINE, .cor = cor});
+		char* out = texts.alloc(total);
+		char* p = out;
+		for (int i = 0; i < count; i++) {
+			size_t len = 0;
+			const char* str = piece(i, &len);
+			if (i) { memcpy(p, sep, slen); p += slen; }
+			memcpy(p, str, len);
+			p += len;
+		}
+
+		push(view(out, total));
+	}
+
+	// lib.str.find(s, sub[, start]) => index or nil
+	void op_str_find() {
+		must(depth() == 2 || depth() == 3, "find(string, substring[, start])");
+		int64_t start = depth() == 3 ? pop_type(INTEGER).inum: 0;
+		size_t slen = 0, len = 0;
+		const char* sub = text_data(pop_text(), &slen);
+		const char* str = text_data(pop_text(), &len);
+		if (start < 0) start += len;
+		must(start >= 0, "find start out of bounds");
+		const char* hit = (size_t)start + slen > len ? nullptr
+			: slen ? text_find(str+start, len-start, sub, slen): str+start;
+		push(hit ? integer(hit-str): nil());
+	}
+
+	// lib.str.rfind(s, sub) => last index or nil
+	void op_str_rfind() {
+		must(depth() == 2, "rfind(string, substring)");
+		size_t slen = 0, len = 0;
+		const char* sub = text_data(pop_text(), &slen);
+		const char* str = text_data(pop_text(), &len);
+		const char* hit = nullptr;
+		if (slen <= len) {
+			size_t i = len - slen + 1;
+			while (!hit && i > 0) {
+				const char* p = slen ? (const char*)memrchr(str, sub[0], i): str+i-1;
+				if (!p) break;
+				if (!memcmp(p, sub, slen)) hit = p;
+				i = p-str;
+			}
+		}
+		push(hit ? integer(hit-str): nil());
 	}
 
-	void op_resume() {
-		must(depth() && item(0)->type == COROUTINE, "resume missing coroutine");
-		cor_t *cor = item(0)->cor;
-
-		int items = depth();
-		cor_t* caller = routine;
+	// lib.str.replace(s, old, new[, limit]) => string
+	void op_str_replace() {
+		must(depth() == 3 || depth() == 4, "replace(string, old, new[, limit])");
+		int64_t limit = depth() == 4 ? pop_type(INTEGER).inum: -1;
+		item_t with = pop_text();
+		size_t wlen = 0, olen = 0, len = 0;
+		const char* wstr = text_data(with, &wlen);
+		const char* old = text_data(pop_text(), &olen);
+		item_t src = pop_text();
+		const char* str = text_data(src, &len);
+		const char* end = str+len;
+		must(olen > 0, "replace old string is empty");
 
-		if (cor->state == COR_DEAD) {
-			caller->stack.depth -= items;
-			push(nil());
+		int64_t hits = 0;
+		for (const char* p = str, *hit; (limit < 0 || hits < limit) && (hit = text_find(p, end-p, old, olen)); p = hit+olen)
+			hits++;
+
+		if (!hits) {
+			push(src);
 			return;
 		}
 
-		cor->state = COR_RUNNING;
+		size_t total = len + hits*wlen - hits*olen;
+		char* out = texts.alloc(total);
+		char* o = out;
+		const char* p = str;
+		for (int64_t i = 0; i < hits; i++) {
+			const char* hit = text_find(p, end-p, old, olen);
+			memcpy(o, p, hit-p); o += hit-p;
+			memcpy(o, wstr, wlen); o += wlen;
+			p = hit+olen;
+		}
+		memcpy(o, p, end-p);
+		push(view(out, total));
+	}
 
-		vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor});
-		routine = cor;
+	// lib.str.starts(s, prefix) => boolean
+	void op_str_starts() {
+		must(depth() == 2, "starts(string, prefix)");
+		size_t plen = 0, len = 0;
+		const char* pre = text_data(pop_text(), &plen);
+		const char* str = text_data(pop_text(), &len);
+		push((item_t){.type = BOOLEAN, .flag = plen <= len && !memcmp(str, pre, plen)});
+	}
 
-		for (int i = 1; i < items; i++) {
-			int index = caller->stack.depth-items+i;
-			push(*stack_ref(caller, index));
-		}
+	// lib.str.ends(s, suffix) => boolean
+	void op_str_ends() {
+		must(depth() == 2, "ends(string, suffix)");
+		size_t plen = 0, len = 0;
+		const char* suf = text_data(pop_text(), &plen);
+		const char* str = text_data(pop_text(), &len);
+		push((item_t){.type = BOOLEAN, .flag = plen <= len && !memcmp(str+len-plen, suf, plen)});
+	}
 
-		caller->stack.depth -= items;
+	// lib.str.trim(s) => view without leading and trailing whitespace
+	void op_str_trim() {
+		must(depth() == 1, "trim(string)");
+		size_t len = 0;
+		const char* str = text_data(pop_text(), &len);
+		const char* end = str+len;
+		while (str < end && isspace((unsigned char)*str)) str++;
+		while (end > str && isspace((unsigned char)end[-1])) end--;
+		push(view(str, end-str));
 	}
 
-	void op_yield() {
-		int items = depth();
+	void str_case(int (*fn)(int)) {
+		must(depth() == 1, "upper|lower(string)");
+		size_t len = 0;
+		const char* str = text_data(pop_text(), &len);
+		char* out = texts.alloc(len);
+		for (size_t i = 0; i < len; i++) out[i] = fn((unsigned char)str[i]);
+		push(view(out, len));
+	}
 
-		cor_t* caller = routine;
-		caller->state = COR_SUSPENDED;
+	void op_str_upper() {
+		str_case(toupper);
+	}
 
-		vec_pop(&routines);
-		routine = vec_top(&routines).cor;
+	void op_str_lower() {
+		str_case(tolower);
+	}
 
-		for (int i = 0; i < items; i++) {
-			int index = caller->stack.depth-items+i;
-			push(*stack_ref(caller, index));
+	// lib.str.format(fmt, ...) printf-style: d i x X o c f F e E g G s %
+	void op_str_format() {
+		int argc = depth();
+		item_t* argv = items();
+		must(argc > 0 && is_text(argv[0]), "format(string, ...)");
+		size_t len = 0;
+		const char* fmt = text_data(argv[0], &len);
+		const char* end = fmt+len;
+		int arg = 1;
+		std::string out;
+		char tmp[STRTMP];
+
+		auto put = [&](const std::string& spec, auto val) {
+			int n = snprintf(nullptr, 0, spec.c_str(), val);
+			size_t at = out.size();
+			out.resize(at+n+1);
+			snprintf(&out[at], n+1, spec.c_str(), val);
+			out.resize(at+n);
+		};
+
+		for (const char* p = fmt; p < end; ) {
+			if (*p != '%') {
+				const char* q = (const char*)memchr(p, '%', end-p);
+				if (!q) q = end;
+				out.append(p, q-p);
+				p = q;
+				continue;
+			}
+			if (p+1 < end && p[1] == '%') {
+				out += '%';
+				p += 2;
+				continue;
+			}
+
+			const char* q = p+1;
+			while (q < end && strchr("-+ #0", *q)) q++;
+			while (q < end && isdigit((unsigned char)*q)) q++;
+			if (q < end && *q == '.') q++;
+			while (q < end && isdigit((unsigned char)*q)) q++;
+			must(q < end, "format incomplete: %%%.*s", (int)(q-p-1), p+1);
+			must(arg < argc, "format missing argument %d", arg);
+
+			char conv = *q++;
+			std::string spec(p, q-p-1);
+			item_t val = argv[arg++];
+			bool num = val.type == INTEGER || val.type == FLOAT;
+
+			if (strchr("dixXoc", conv)) {
+				must(num, "format %%%c expected a number: %s", conv, tmptext(val, tmp, sizeof(tmp)));
+				long long inum = val.type == INTEGER ? val.inum: (int64_t)val.fnum;
+				if (conv == 'c') put(spec + conv, (int)inum); else put(spec + "ll" + conv, inum);
+			}
+			else
+			if (strchr("fFeEgG", conv)) {
+				must(num, "format %%%c expected a number: %s", conv, tmptext(val, tmp, sizeof(tmp)));
+				put(spec + conv, val.type == INTEGER ? (double)val.inum: val.fnum);
+			}
+			else
+			if (conv == 's') {
+				size_t slen = 0;
+				const char* str = is_text(val) ? text_data(val, &slen): tmptext(val, tmp, sizeof(tmp));
+				if (!is_text(val)) slen = strlen(str);
+				put(spec + conv, std::string(str, slen).c_str());
+			}
+			else {
+				must(false, "format unknown conversion: %%%c", conv);
+			}
+			p = q;
 		}
 
-		caller->stack.depth -= items;
+		op_clean();
+		char* str = texts.alloc(out.size());
+		memcpy(str, out.data(), out.size());
+		push(view(str, out.size()));
+	}
+
+	// next line as a view without its line ending, or nil at the end.
+	// JSON streams skip blank lines.
+	item_t stream_line(stream_t* stream) {
+		const char* base = stream->map.get();
+		const char* end = base + stream->size;
+		while (stream->pos < stream->size) {
+			const char* start = base + stream->pos;
+			const char* eol = (const char*)memchr(start, '\n', end-start);
+			stream->pos = eol ? eol-base+1: stream->size;
+			if (!eol) eol = end;
+			if (eol > start && eol[-1] == '\r') eol--;
+			if (stream->mode == STREAM_JSON && json_blank(start, eol)) continue;
+			return view(start, eol-start);
+		}
+		return nil();
 	}
 
-	void op_global() {
-		push((item_t){.type = MAP, .map = scope_global});
-	}
+	// lib.io.lines(path) => stream of lines as views into a file mapping
+	void op_io_lines() {
+		must(depth() == 1, "lines(path)");
+		const char* path = pop_type(STRING).str;
+		int fd = open(path, O_RDONLY);
+		must(fd >= 0, "cannot open %s", path);
+
+		struct stat st;
+		bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+
+		// pipes, FIFOs and /proc files report no size, so read them whole
+		if (!regular) {
+			size_t size = 0;
+			size_t cap = 0;
+			char* buf = nullptr;
+			for (;;) {
+				if (size == cap) {
+					cap = cap ? cap*2: 65536;
+					buf = (char*)realloc(buf, cap);
+				}
+				ssize_t got = read(fd, buf+size, cap-size);
+				if (got < 0 && errno == EINTR) continue;
+				if (got <= 0) {
+					if (got < 0) {
+						free(buf);
+						close(fd);
+						must(false, "cannot read %s", path);
+					}
+					break;
+				}
+				size += got;
+			}
+			close(fd);
 
-	void call(item_t item) {
-		if (item.type == OPERATION) {
-			operation_call(item.opcode);
-			return;
-		}
-		if (item.type == EXECUTE) {
-			execute(item.function);
+			stream_t* stream = streams.alloc();
+			stream->map = std::shared_ptr<char>(buf, [](char* p) { free(p); });
+			stream->size = size;
+			push((item_t){.type = STREAM, .stream = stream});
 			return;
 		}
 
-		int args = depth();
+		size_t size = st.st_size;
+		void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		must(map != MAP_FAILED, "cannot map %s", path);
+		madvise(map, size, MADV_SEQUENTIAL);
 
-		char tmp[STRTMP];
-		must(item.type == SUBROUTINE, "invalid function: %s (ip: %u)", tmptext(item, tmp, sizeof(tmp)), routine->ip);
+		stream_t* stream = streams.alloc();
+		stream->map = std::shared_ptr<char>((char*)map, [size](char* p) { munmap(p, size); });
+		stream->size = size;
+		push((item_t){.type = STREAM, .stream = stream});
+	}
 
-		arrive(item.sub);
+	// JSON codec. Objects become maps with their keys sorted once rather
+	// than inserted one at a time; null members are dropped as a map cannot
+	// hold nil. Strings without escapes are views of the source text.
 
-		op_mark();
-		// subroutines need to know the base of their subframe,
-		// which is the same as the current depth of the outer
-		// frame mark
-		routine->marks.cells[routine->marks.depth-1] -= args;
-	}
+	static const int JSON_DEPTH = 256;
 
-	void op_call() {
-		call(pop());
-	}
+	static const int JSON_KEYS = 64;
 
-	void op_return() {
-		cor_t* cor = routine;
+	struct json_t {
+		const char* start;
+		const char* p;
+		const char* end;
+		int depth;
+		const char* keys[JSON_KEYS]; // recently interned object keys
+	};
 
-		// subroutines leave only results in their subframe, which
-		// migrate to the caller frame when depart() truncates the
-		// marks stack
-		depart();
+	// object members of all open objects, innermost last
+	std::vector<std::pair<item_t,item_t>> json_members;
 
-		if (!cor->ip) {
-			cor->state = COR_DEAD;
-			op_yield();
-			return;
-		}
+	// records usually repeat their keys, so avoid most strintern lookups
+	item_t json_key(json_t& j) {
+		size_t len = 0;
+		const char* str = text_data(json_string(j), &len);
+		uint32_t hash = len;
+		for (size_t i = 0; i < len; i++) hash = hash*31 + (unsigned char)str[i];
+		const char** slot = &j.keys[hash % JSON_KEYS];
+		if (!*slot || strncmp(*slot, str, len) || (*slot)[len]) *slot = strintern(str, len);
+		return (item_t){.type = STRING, .str = *slot};
 	}
 
-	void op_drop() {
-		pop();
+	bool json_blank(const char* p, const char* end) {
+		while (p < end && isspace((unsigned char)*p)) p++;
+		return p == end;
 	}
 
-	void op_lit() {
-		push(literal());
+	void json_space(json_t& j) {
+		while (j.p < j.end && (*j.p == ' ' || *j.p == '\n' || *j.p == '\r' || *j.p == '\t')) j.p++;
 	}
 
-	void op_loop() {
-		assert(routine->loops.depth+2 < (int)(sizeof(routine->loops.cells)/sizeof(int)));
-		routine->loops.cells[routine->loops.depth++] = routine->marks.depth;
-		routine->loops.cells[routine->loops.depth++] = literal_int();
-		routine->loops.cells[routine->loops.depth++] = 0;
+	void json_fail(json_t& j, const char* what) {
+		must(false, "json %s at offset %d", what, (int)(j.p-j.start));
 	}
 
-	void op_unloop() {
-		assert(routine->loops.depth > 2);
-		--routine->loops.depth;
-		--routine->loops.depth;
-		must(routine->loops.cells[--routine->loops.depth] == routine->marks.depth, "mark stack mismatch (unloop)");
+	void json_expect(json_t& j, char c) {
+		json_space(j);
+		if (j.p >= j.end || *j.p != c) {
+			char what[16];
+			snprintf(what, sizeof(what), "expected '%c'", c);
+			json_fail(j, what);
+		}
+		j.p++;
 	}
 
-	void op_break() {
-		routine->ip = routine->loops.cells[routine->loops.depth-2];
-		routine->marks.depth = routine->loops.cells[routine->loops.depth-3];
-		while (depth()) pop();
+	bool json_word(json_t& j, const char* word) {
+		size_t len = strlen(word);
+		if ((size_t)(j.end-j.p) < len || memcmp(j.p, word, len)) return false;
+		j.p += len;
+		return true;
 	}
 
-	void op_continue() {
-		routine->ip = routine->loops.cells[routine->loops.depth-2]-1;
-		routine->marks.depth = routine->loops.cells[routine->loops.depth-3];
-		while (depth()) pop();
+	void json_utf8(std::string& out, uint32_t cp) {
+		if (cp < 0x80) { out += (char)cp; return; }
+		if (cp < 0x800) { out += (char)(0xC0|(cp>>6)); out += (char)(0x80|(cp&0x3F)); return; }
+		if (cp < 0x10000) { out += (char)(0xE0|(cp>>12)); out += (char)(0x80|((cp>>6)&0x3F)); out += (char)(0x80|(cp&0x3F)); return; }
+		out += (char)(0xF0|(cp>>18)); out += (char)(0x80|((cp>>12)&0x3F)); out += (char)(0x80|((cp>>6)&0x3F)); out += (char)(0x80|(cp&0x3F));
 	}
 
-	void op_copy() {
-		push(top());
+	uint32_t json_hex4(json_t& j) {
+		if (j.end-j.p < 4) json_fail(j, "bad \\u escape");
+		uint32_t cp = 0;
+		for (int i = 0; i < 4; i++) {
+			int c = *j.p++;
+			cp <<= 4;
+			if (c >= '0' && c <= '9') cp |= c-'0';
+			else if (c >= 'a' && c <= 'f') cp |= c-'a'+10;
+			else if (c >= 'A' && c <= 'F') cp |= c-'A'+10;
+			else json_fail(j, "bad \\u escape");
+		}
+		return cp;
 	}
 
-	void op_shunt() {
-		opush(pop());
-	}
+	item_t json_string(json_t& j) {
+		json_expect(j, '"');
+		const char* start = j.p;
+		while (j.p < j.end && *j.p != '"' && *j.p != '\\') j.p++;
+		if (j.p >= j.end) json_fail(j, "unterminated string");
+		if (*j.p == '"') return view(start, j.p++ - start);
 
-	void op_shift() {
-		push(opop());
-	}
+		std::string out(start, j.p-start);
+		while (j.p < j.end && *j.p != '"') {
+			char c = *j.p++;
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (j.p >= j.end) break;
+			c = *j.p++;
+			switch (c) {
+				case '"': case '\\': case '/': out += c; break;
+				case 'b': out += '\b'; break;
+				case 'f': out += '\f'; break;
+				case 'n': out += '\n'; break;
+				case 'r': out += '\r'; break;
+				case 't': out += '\t'; break;
+				case 'u': {
+					uint32_t cp = json_hex4(j);
+					// unpaired surrogates become U+FFFD; a \u after a high
+					// surrogate that is not a low one is decoded on its own
+					if (cp >= 0xD800 && cp < 0xE000) {
+						const char* next = j.p;
+						uint32_t lo = cp < 0xDC00 && json_word(j, "\\u") ? json_hex4(j): 0;
+						if (lo >= 0xDC00 && lo < 0xE000) cp = 0x10000 + ((cp-0xD800)<<10) + (lo-0xDC00);
+						else { cp = 0xFFFD; j.p = next; }
+					}
+					json_utf8(out, cp);
+					break;
+				}
+				default: json_fail(j, "bad escape");
+			}
+		}
+		if (j.p >= j.end) json_fail(j, "unterminated string");
+		j.p++;
+		char* str = texts.alloc(out.size());
+		memcpy(str, out.data(), out.size());
+		return view(str, out.size());
+	}
+
+	item_t json_number(json_t& j) {
+		const char* start = j.p;
+
+		// common case: short integer, no strtoll round trip
+		bool neg = j.p < j.end && *j.p == '-';
+		const char* d = j.p + neg;
+		int64_t inum = 0;
+		while (d < j.end && d-start < 18 && isdigit((unsigned char)*d)) inum = inum*10 + (*d++ - '0');
+		if (d > j.p + neg && (d == j.end || !(isdigit((unsigned char)*d) || (*d && strchr(".eE+-", *d))))) {
+			j.p = d;
+			return integer(neg ? -inum: inum);
+		}
+
+		bool real = false;
+		if (j.p < j.end && *j.p == '-') j.p++;
+		while (j.p < j.end && (isdigit((unsigned char)*j.p) || (*j.p && strchr(".eE+-", *j.p)))) {
+			real = real || !isdigit((unsigned char)*j.p);
+			j.p++;
+		}
+		char tmp[64];
+		size_t len = j.p-start;
+		if (!len || len >= sizeof(tmp)) json_fail(j, "bad number");
+		memcpy(tmp, start, len);
+		tmp[len] = 0;
+		char* end = nullptr;
+		errno = 0;
+		item_t val = real ? number(strtod(tmp, &end)): integer(strtoll(tmp, &end, 10));
+		if (!real && errno == ERANGE) val = number(strtod(tmp, &end));
+		if (end != tmp+len) json_fail(j, "bad number");
+		return val;
+	}
+
+	item_t json_value(json_t& j) {
+		json_space(j);
+		if (j.p >= j.end) json_fail(j, "unexpected end");
+		if (j.depth > JSON_DEPTH) json_fail(j, "nested too deeply");
+
+		char c = *j.p;
+
+		if (c == '"') return json_string(j);
+
+		if (c == '[') {
+			j.p++;
+			j.depth++;
+			vec_t* vec = vec_allot();
+			json_space(j);
+			if (j.p < j.end && *j.p == ']') j.p++;
+			else {
+				do vec_push(vec, json_value(j)); while (json_space(j), j.p < j.end && *j.p == ',' && j.p++);
+				json_expect(j, ']');
+			}
+			j.depth--;
+			return (item_t){.type = VECTOR, .vec = vec};
+		}
 
-	void op_nil() {
-		push(nil());
-	}
+		if (c == '{') {
+			j.p++;
+			j.depth++;
+			size_t base = json_members.size();
+			json_space(j);
+			if (j.p < j.end && *j.p == '}') j.p++;
+			else {
+				do {
+					item_t key = json_key(j);
+					json_expect(j, ':');
+					item_t val = json_value(j);
+					if (val.type != NIL) json_members.push_back({key, val});
+				}
+				while (json_space(j), j.p < j.end && *j.p == ',' && j.p++);
+				json_expect(j, '}');
+			}
+			j.depth--;
+
+			// keys are interned: sort once by text, last duplicate wins
+			auto first = json_members.begin()+base, last = json_members.end();
+			auto before = [](const std::pair<item_t,item_t>& a, const std::pair<item_t,item_t>& b) {
+				return a.first.str != b.first.str && strcmp(a.first.str, b.first.str) < 0;
+			};
+			if (last-first > 16) std::stable_sort(first, last, before);
+			else {
+				for (auto it = first; it != last; ++it)
+					std::rotate(std::upper_bound(first, it, *it, before), it, it+1);
+			}
 
-	void op_true() {
-		push((item_t){.type = BOOLEAN, .flag = 1});
-	}
+			map_t* map = map_allot();
+			map->keys.items.reserve(last-first);
+			map->vals.items.reserve(last-first);
+			for (auto it = first; it != last; ++it) {
+				if (it+1 != last && (it+1)->first.str == it->first.str) continue;
+				map->keys.items.push_back(it->first);
+				map->vals.items.push_back(it->second);
+			}
+			json_members.resize(base);
+			return (item_t){.type = MAP, .map = map};
+		}
 
-	void op_false() {
-		push((item_t){.type = BOOLEAN, .flag = 0});
+		if (json_word(j, "true")) return (item_t){.type = BOOLEAN, .flag = true};
+		if (json_word(j, "false")) return (item_t){.type = BOOLEAN, .flag = false};
+		if (json_word(j, "null")) return nil();
+		if (c == '-' || isdigit((unsigned char)c)) return json_number(j);
+
+		json_fail(j, "unexpected character");
+		return nil();
 	}
 
-	void op_jmp() {
-		routine->ip = literal_int();
+	item_t json_decode(const char* str, size_t len) {
+		json_t j = {str, str, str+len, 0, {}};
+		json_members.clear(); // may hold leftovers from a failed decode
+		item_t val = json_value(j);
+		json_space(j);
+		if (j.p != j.end) json_fail(j, "trailing characters");
+		return val;
+	}
+
+	void json_quote(std::string& out, const char* str, size_t len) {
+		out += '"';
+		for (const char* end = str+len; str < end; ) {
+			const char* run = str;
+			while (str < end && (unsigned char)*str >= 0x20 && *str != '"' && *str != '\\') str++;
+			out.append(run, str-run);
+			if (str == end) break;
+			char c = *str++;
+			switch (c) {
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default: {
+					char tmp[8];
+					snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned char)c);
+					out += tmp;
+				}
+			}
+		}
+		out += '"';
 	}
 
-	void op_jfalse() {
-		if (!truth(top())) op_jmp();
+	void json_encode(std::string& out, item_t a, int depth) {
+		char tmp[STRTMP];
+		must(depth < JSON_DEPTH, "json encode nested too deeply");
+
+		if (a.type == NIL) out += "null";
+		else
+		if (a.type == BOOLEAN) out += a.flag ? "true": "false";
+		else
+		if (a.type == INTEGER) {
+			snprintf(tmp, sizeof(tmp), "%lld", (long long)a.inum);
+			out += tmp;
+		}
+		else
+		if (a.type == FLOAT) {
+			must(std::isfinite(a.fnum), "json cannot encode %f", a.fnum);
+			// shortest of %.15g and %.17g that reads back exactly
+			snprintf(tmp, sizeof(tmp), "%.15g", a.fnum);
+			if (strtod(tmp, nullptr) != a.fnum) snprintf(tmp, sizeof(tmp), "%.17g", a.fnum);
+			if (!strpbrk(tmp, ".eEn")) strcat(tmp, ".0");
+			out += tmp;
+		}
+		else
+		if (is_text(a)) {
+			size_t len = 0;
+			const char* str = text_data(a, &len);
+			json_quote(out, str, len);
+		}
+		else
+		if (a.type == VECTOR || a.type == ARRAY) {
+			out += '[';
+			for (int i = 0, l = count(a); i < l; i++) {
+				if (i) out += ',';
+				json_encode(out, a.type == ARRAY ? arr_get(a.arr, i): vec_get(a.vec, i), depth+1);
+			}
+			out += ']';
+		}
+		else
+		if (a.type == MAP) {
+			out += '{';
+			for (int i = 0, l = vec_size(&a.map->keys); i < l; i++) {
+				if (i) out += ',';
+				item_t key = vec_get(&a.map->keys, i);
+				if (is_text(key)) json_encode(out, key, depth+1);
+				else {
+					const char* str = tmptext(key, tmp, sizeof(tmp));
+					json_quote(out, str, strlen(str));
+				}
+				out += ':';
+				json_encode(out, vec_get(&a.map->vals, i), depth+1);
+			}
+			out += '}';
+		}
+		else {
+			must(false, "json cannot encode %s", tmptext(a, tmp, sizeof(tmp)));
+		}
+	}
+
+	// lib.json.decode(string) => value
+	void op_json_decode() {
+		must(depth() == 1, "decode(string)");
+		size_t len = 0;
+		const char* str = text_data(pop_text(), &len);
+		push(json_decode(str, len));
+	}
+
+	// lib.json.encode(value) => string
+	void op_json_encode() {
+		must(depth() == 1, "encode(value)");
+		std::string out;
+		json_encode(out, pop(), 0);
+		char* str = texts.alloc(out.size());
+		memcpy(str, out.data(), out.size());
+		push(view(str, out.size()));
+	}
+
+	// lib.json.lines(stream) => stream yielding one decoded value per line
+	void op_json_lines() {
+		must(depth() == 1, "lines(stream)");
+		item_t stream = pop_type(STREAM);
+		stream.stream->mode = STREAM_JSON;
+		push(stream);
+	}
+
+	// CSV. Fields are views of the source unless they contain doubled
+	// quotes. Unquoted fields are scanned with a byte class table so each
+	// byte costs one load and test.
+
+	std::vector<item_t> csv_fields;
+
+	// stream over a string, kept alive by the stream
+	stream_t* stream_text(item_t src) {
+		size_t len = 0;
+		const char* str = text_data(src, &len);
+		stream_t* stream = streams.alloc();
+		stream->map = std::shared_ptr<char>((char*)str, [](char*) {});
+		stream->src = src;
+		stream->size = len;
+		return stream;
+	}
+
+	// whole field is a decimal integer or number: optional sign, digits,
+	// optional fraction and exponent. No whitespace, hex, inf or nan.
+	bool text_number(const char* str, size_t len, item_t* val) {
+		char tmp[64];
+		if (!len || len >= sizeof(tmp)) return false;
+		memcpy(tmp, str, len);
+		tmp[len] = 0;
+
+		const char* p = tmp;
+		if (*p == '+' || *p == '-') p++;
+		size_t digits = 0;
+		while (isdigit((unsigned char)*p)) { p++; digits++; }
+		bool integral = *p == 0;
+		if (*p == '.') {
+			p++;
+			while (isdigit((unsigned char)*p)) { p++; digits++; }
+		}
+		if (!digits) return false;
+		if (*p == 'e' || *p == 'E') {
+			p++;
+			if (*p == '+' || *p == '-') p++;
+			if (!isdigit((unsigned char)*p)) return false;
+			while (isdigit((unsigned char)*p)) p++;
+		}
+		if (*p) return false;
+
+		errno = 0;
+		if (integral) {
+			int64_t inum = strtoll(tmp, nullptr, 10);
+			if (errno != ERANGE) {
+				*val = integer(inum);
+				return true;
+			}
+		}
+		*val = number(strtod(tmp, nullptr));
+		return true;
 	}
 
-	void op_jtrue() {
-		if (truth(top())) op_jmp();
+	// parse the record at stream->pos into csv_fields; false at the end.
+	// Blank lines are skipped rather than read as one empty field, so a
+	// trailing newline or a spacer line never makes a record.
+	bool csv_record(stream_t* stream) {
+		const char* base = stream->map.get();
+		const char* p = base + stream->pos;
+		const char* end = base + stream->size;
+		char delim = stream->delim;
+		const bool* stop = stream->stop;
+
+		while (p < end && (*p == '\n' || *p == '\r')) p++;
+		csv_fields.clear();
+		if (p >= end) {
+			stream->pos = stream->size;
+			return false;
+		}
+
+		for (;;) {
+			item_t field;
+			if (p < end && *p == '"') {
+				const char* start = ++p;
+				bool doubled = false;
+				for (;;) {
+					p = (const char*)memchr(p, '"', end-p);
+					must(p, "csv unterminated quote at offset %d", (int)(start-base-1));
+					if (p+1 < end && p[1] == '"') { doubled = true; p += 2; continue; }
+					break;
+				}
+				if (!doubled) field = view(start, p-start);
+				else {
+					char* out = texts.alloc(p-start);
+					size_t len = 0;
+					for (const char* q = start; q < p; q++) {
+						out[len++] = *q;
+						if (*q == '"') q++;
+					}
+					field = view(out, len);
+				}
+				p++;
+				while (p < end && !stop[(unsigned char)*p]) p++;
+			}
+			else {
+				const char* start = p;
+				while (p < end && !stop[(unsigned char)*p]) p++;
+				field = view(start, p-start);
+				if (stream->numbers) text_number(start, p-start, &field);
+			}
+			csv_fields.push_back(field);
+
+			if (p < end && *p == delim) {
+				p++;
+				continue;
+			}
+			if (p < end && *p == '\r') p++;
+			if (p < end && *p == '\n') p++;
+			break;
+		}
+
+		stream->pos = p-base;
+		return true;
 	}
 
-	void op_vector() {
-		opush((item_t){.type = VECTOR, .vec = vec_allot()});
+	// next record as a vector, or a map keyed by the header; nil at the end
+	item_t csv_row(stream_t* stream) {
+		if (!csv_record(stream)) return nil();
+
+		if (stream->header.type == VECTOR) {
+			map_t* map = map_allot();
+			vec_t* names = stream->header.vec;
+			for (int i = 0, l = std::min((int)csv_fields.size(), (int)vec_size(names)); i < l; i++)
+				map_set(map, vec_get(names, i), csv_fields[i]);
+			return (item_t){.type = MAP, .map = map};
+		}
+
+		vec_t* vec = vec_allot();
+		vec->items.assign(csv_fields.begin(), csv_fields.end());
+		return (item_t){.type = VECTOR, .vec = vec};
 	}
 
-	void op_vpush() {
-		for (int i = 0, l = depth(); i < l; i++)
-			vec_push(otop().vec, *item(i));
-		op_clean();
+	// csv source and options {delim = ",", header = false, numbers = false}
+	stream_t* csv_open(item_t src, item_t opts) {
+		stream_t* stream = nullptr;
+		if (src.type == STREAM) stream = src.stream;
+		else {
+			must(is_text(src), "csv source must be a stream or string");
+			stream = stream_text(src);
+		}
+		stream->mode = STREAM_CSV;
+
+		item_t opt;
+		bool header = false;
+		if (opts.type == MAP) {
+			if (map_get(opts.map, string("delim"), &opt)) {
+				size_t len = 0;
+				must(is_text(opt) && (text_data(opt, &len), len == 1), "csv delim must be one character");
+				stream->delim = text_data(opt, &len)[0];
+			}
+			if (map_get(opts.map, string("header"), &opt)) header = truth(opt);
+			if (map_get(opts.map, string("numbers"), &opt)) stream->numbers = truth(opt);
+		}
+		else {
+			must(opts.type == NIL, "csv options must be a map");
+		}
+
+		memset(stream->stop, 0, sizeof(stream->stop));
+		stream->stop[(unsigned char)stream->delim] = true;
+		stream->stop['\n'] = stream->stop['\r'] = true;
+
+		if (header) {
+			bool numbers = stream->numbers;
+			stream->numbers = false;
+			vec_t* names = vec_allot();
+			if (csv_record(stream)) {
+				for (auto& field: csv_fields) vec_push(names, text_intern(field));
+			}
+			stream->header = (item_t){.type = VECTOR, .vec = names};
+			stream->numbers = numbers;
+		}
+		return stream;
 	}
 
-	void op_unpack() {
-		vec_t* vec = pop_type(VECTOR).vec;
+	// lib.csv.rows(stream|string[, opts]) => stream of vectors or maps
+	void op_csv_rows() {
+		must(depth() == 1 || depth() == 2, "rows(source[, options])");
+		item_t opts = depth() == 2 ? pop(): nil();
+		item_t src = pop();
+		push((item_t){.type = STREAM, .stream = csv_open(src, opts)});
+	}
+
+	// lib.csv.columns(stream|string, kinds[, opts]) => columns in one pass.
+	// Kinds are array kinds for typed columns, anything else gives a vector
+	// of strings. The result is a map by header name or a vector. A cell
+	// that is empty in a typed column, or absent from a short row, takes
+	// opts.missing; without it float columns get NaN and the rest fail.
+	void op_csv_columns() {
+		must(depth() == 2 || depth() == 3, "columns(source, kinds[, options])");
+		item_t opts = depth() == 3 ? pop(): nil();
+		vec_t* kinds = pop_type(VECTOR).vec;
+		item_t src = pop();
+		stream_t* stream = csv_open(src, opts);
+
+		item_t missing = nil();
+		bool fill = opts.type == MAP && map_get(opts.map, string("missing"), &missing);
+
+		int ncols = vec_size(kinds);
+		std::vector<item_t> columns;
+		for (int c = 0; c < ncols; c++) {
+			item_t kind = vec_get(kinds, c);
+			bool typed = is_text(kind) && text_intern(kind).str != string("string").str;
+			columns.push_back(typed
+				? (item_t){.type = ARRAY, .arr = arr_allot(arr_kind(text_intern(kind).str))}
+				: (item_t){.type = VECTOR, .vec = vec_allot()}
+			);
+		}
 
-		for (int i = 0, l = vec_size(vec); i < l; i++)
-			push(vec_get(vec, i));
+		int row = 0;
+		char tmp[STRTMP];
+		while (csv_record(stream)) {
+			for (int c = 0; c < ncols; c++) {
+				bool absent = c >= (int)csv_fields.size();
+				item_t field = absent ? nil(): csv_fields[c];
+				bool typed = columns[c].type == ARRAY;
+				bool real = typed && (columns[c].arr->kind == ARRAY_F64 || columns[c].arr->kind == ARRAY_F32);
+				size_t len = 0;
+				bool empty = is_text(field) && (text_data(field, &len), !len);
+
+				if (absent || (typed && empty)) {
+					must(fill || real, "csv row %d column %d is missing", row, c);
+					field = fill ? missing: number(NAN);
+				}
+				if (!typed) {
+					vec_push(columns[c].vec, field);
+					continue;
+				}
+				if (is_text(field)) {
+					const char* str = text_data(field, &len);
+					must(text_number(str, len, &field), "csv row %d column %d not a number: %s", row, c, tmptext(field, tmp, sizeof(tmp)));
+				}
+				arr_set(columns[c].arr, row, field);
+			}
+			row++;
+		}
+
+		if (stream->header.type == VECTOR) {
+			map_t* map = map_allot();
+			vec_t* names = stream->header.vec;
+			for (int c = 0; c < ncols && c < (int)vec_size(names); c++) map_set(map, vec_get(names, c), columns[c]);
+			push((item_t){.type = MAP, .map = map});
+			return;
+		}
+
+		vec_t* vec = vec_allot();
+		vec->items.assign(columns.begin(), columns.end());
+		push((item_t){.type = VECTOR, .vec = vec});
 	}
 
 	void op_type() {
@@ -2780,7 +6509,92 @@ class Rela {
 		while (i++ < l) {
 			frame->locals.push(nil());
 		}
-		op_clean();
+		for (auto& preset: scope.presets) {
+			frame->locals[preset.first] = preset.second;
+		}
+		op_clean();
+	}
+
+	// register instructions over the current frame's local slots
+
+	item_t* regs() {
+		return routine->frames.top().locals.cells;
+	}
+
+	template <typename F>
+	void opr_binary(F fn) {
+		item_t* r = regs();
+		int64_t x = literal_int();
+		r[x&255] = fn(r[x>>8&255], r[x>>16&255]);
+	}
+
+	// a|b<<8|ip<<16: continue if the comparison holds, else jump
+	template <typename F>
+	void opr_test(F fn) {
+		item_t* r = regs();
+		int64_t x = literal_int();
+		if (!fn(r[x&255], r[x>>8&255])) routine->ip = x>>16;
+	}
+
+	void opr_move() {
+		item_t* r = regs();
+		int64_t x = literal_int();
+		r[x&255] = r[x>>8&255];
+	}
+
+	void opr_pop() {
+		regs()[literal_int()] = pop();
+	}
+
+	static item_t boolean(bool b) {
+		return (item_t){.type = BOOLEAN, .flag = b};
+	}
+
+	item_t subtract(item_t a, item_t b) {
+		char tmp[STRTMP];
+		if (b.type == INTEGER) b.inum = -b.inum;
+		else if (b.type == FLOAT) b.fnum = -b.fnum;
+		else must(0, "cannot negate %s", tmptext(b, tmp, sizeof(tmp)));
+		return add(a, b);
+	}
+
+	void opr_add() { opr_binary([&](item_t a, item_t b) { return add(a, b); }); }
+	void opr_sub() { opr_binary([&](item_t a, item_t b) { return subtract(a, b); }); }
+	void opr_mul() { opr_binary([&](item_t a, item_t b) { return multiply(a, b); }); }
+	void opr_div() { opr_binary([&](item_t a, item_t b) { return divide(a, b); }); }
+	void opr_mod() { opr_binary([&](item_t a, item_t b) { return integer(a.inum % b.inum); }); }
+	void opr_eq()  { opr_binary([&](item_t a, item_t b) { return boolean(equal(a, b)); }); }
+	void opr_ne()  { opr_binary([&](item_t a, item_t b) { return boolean(!equal(a, b)); }); }
+	void opr_lt()  { opr_binary([&](item_t a, item_t b) { return boolean(less(a, b)); }); }
+	void opr_lte() { opr_binary([&](item_t a, item_t b) { return boolean(less(a, b) || equal(a, b)); }); }
+	void opr_gt()  { opr_binary([&](item_t a, item_t b) { return boolean(!less(a, b) && !equal(a, b)); }); }
+	void opr_gte() { opr_binary([&](item_t a, item_t b) { return boolean(!less(a, b)); }); }
+
+	void opr_teq()  { opr_test([&](item_t a, item_t b) { return equal(a, b); }); }
+	void opr_tne()  { opr_test([&](item_t a, item_t b) { return !equal(a, b); }); }
+	void opr_tlt()  { opr_test([&](item_t a, item_t b) { return less(a, b); }); }
+	void opr_tlte() { opr_test([&](item_t a, item_t b) { return less(a, b) || equal(a, b); }); }
+	void opr_tgt()  { opr_test([&](item_t a, item_t b) { return !less(a, b) && !equal(a, b); }); }
+	void opr_tgte() { opr_test([&](item_t a, item_t b) { return !less(a, b); }); }
+
+	// guarded inline call: bind the arguments to the caller's hidden locals
+	void op_inline() {
+		cor_t* cor = routine;
+		item_t* plan = literal().vec->items.data();
+		item_t* fn = stack_cell(-1);
+		// rebound: an ordinary call returning past the inlined code
+		if (fn->type != SUBROUTINE || fn->sub != plan[0].inum) {
+			cor->ip = plan[1].inum;
+			call(pop());
+			return;
+		}
+
+		frame_t* frame = &cor->frames.top();
+		int base = cor->marks.cells[cor->marks.depth-1];
+		int d = cor->stack.depth - base - 1;
+		for (int i = 0, l = literal().vec->items.size()-2; i < l; i++)
+			frame->locals[plan[i+2].inum] = i < d ? cor->stack.cells[base+i]: nil();
+		cor->stack.depth = base;
 	}
 
 	// locate a local variable cell in the current frame
@@ -2928,6 +6742,30 @@ class Rela {
 			}
 		}
 		else
+		if (iter.type == ARRAY) {
+			if (step >= (int)arr_size(iter.arr)) {
+				routine->ip = routine->loops.cells[routine->loops.depth-2];
+			}
+			else {
+				if (varc > 1)
+					assign(vars->items[var++], integer(step));
+				if (varc > 0)
+					assign(vars->items[var++], arr_get(iter.arr, step));
+			}
+		}
+		else
+		if (iter.type == BYTES) {
+			if (step >= (int)iter.buf->len) {
+				routine->ip = routine->loops.cells[routine->loops.depth-2];
+			}
+			else {
+				if (varc > 1)
+					assign(vars->items[var++], integer(step));
+				if (varc > 0)
+					assign(vars->items[var++], buf_get(iter.buf, step));
+			}
+		}
+		else
 		if (iter.type == MAP) {
 			if (step >= (int)vec_size(&iter.map->keys)) {
 				routine->ip = routine->loops.cells[routine->loops.depth-2];
@@ -2940,6 +6778,32 @@ class Rela {
 			}
 		}
 		else
+		if (iter.type == STREAM && iter.stream->mode == STREAM_CSV) {
+			item_t row = csv_row(iter.stream);
+			if (row.type == NIL) {
+				routine->ip = routine->loops.cells[routine->loops.depth-2];
+			}
+			else {
+				if (varc > 1)
+					assign(vars->items[var++], integer(step));
+				if (varc > 0)
+					assign(vars->items[var++], row);
+			}
+		}
+		else
+		if (iter.type == STREAM) {
+			item_t line = stream_line(iter.stream);
+			if (line.type == NIL) {
+				routine->ip = routine->loops.cells[routine->loops.depth-2];
+			}
+			else {
+				if (varc > 1)
+					assign(vars->items[var++], integer(step));
+				if (varc > 0)
+					assign(vars->items[var++], iter.stream->mode == STREAM_JSON ? json_decode(line.str, line.len): line);
+			}
+		}
+		else
 		if (iter.type == SUBROUTINE || iter.type == EXECUTE) {
 			item_t argv[1] = {integer(step)};
 			item_t retv[2] = {nil(), nil()};
@@ -2962,7 +6826,9 @@ class Rela {
 			push(iter);
 			push(integer(step));
 			op_resume();
-			while (routine == iter.cor && tick());
+			nesting++;
+			while (routine == iter.cor && tick_nested());
+			nesting--;
 
 			if (!depth() || item(0)->type == NIL) {
 				routine->ip = routine->loops.cells[routine->loops.depth-2];
@@ -2993,6 +6859,14 @@ class Rela {
 			vec_cell(dst.vec, key.inum)[0] = val;
 		}
 		else
+		if (dst.type == ARRAY && key.type == INTEGER) {
+			arr_set(dst.arr, key.inum, val);
+		}
+		else
+		if (dst.type == BYTES && key.type == INTEGER) {
+			buf_set(dst.buf, key.inum, val);
+		}
+		else
 		if (dst.type == MAP) {
 			map_set(dst.map, key, val);
 		}
@@ -3020,16 +6894,30 @@ class Rela {
 			return vec_get(src.vec, key.inum);
 		}
 		else
-		if (src.type == VECTOR && src.vec->meta.type != NIL && key.type == STRING) {
+		if (src.type == VECTOR && src.vec->meta.type != NIL && is_text(key)) {
+			item_t val = nil();
+			meta_get(src.vec->meta, text_intern(key).str, &val);
+			return val;
+		}
+		else
+		if (src.type == ARRAY && key.type == INTEGER) {
+			return arr_get(src.arr, key.inum);
+		}
+		else
+		if (src.type == ARRAY && src.arr->meta.type != NIL && is_text(key)) {
 			item_t val = nil();
-			meta_get(src.vec->meta, key.str, &val);
+			meta_get(src.arr->meta, text_intern(key).str, &val);
 			return val;
 		}
+		else
+		if (src.type == BYTES && key.type == INTEGER) {
+			return buf_get(src.buf, key.inum);
+		}
 		if (src.type == MAP) {
 			item_t val = nil();
 			map_get(src.map, key, &val);
-			if (val.type == NIL && src.map->meta.type != NIL && key.type == STRING) {
-				meta_get(src.map->meta, key.str, &val);
+			if (val.type == NIL && src.map->meta.type != NIL && is_text(key)) {
+				meta_get(src.map->meta, text_intern(key).str, &val);
 			}
 			return val;
 		}
@@ -3152,27 +7040,94 @@ class Rela {
 		op_drop();
 	}
 
+	// typed operators, emitted where infer() proved the operand types
+	void op_iadd() {
+		stack_cell(-2)->inum += stack_cell(-1)->inum;
+		op_drop();
+	}
+
+	void op_isub() {
+		stack_cell(-2)->inum -= stack_cell(-1)->inum;
+		op_drop();
+	}
+
+	void op_imul() {
+		stack_cell(-2)->inum *= stack_cell(-1)->inum;
+		op_drop();
+	}
+
+	void op_iadd_lit() {
+		stack_cell(-1)->inum += literal().inum;
+	}
+
+	void op_icmp(bool flag) {
+		op_drop();
+		*stack_cell(-1) = (item_t){.type = BOOLEAN, .flag = flag};
+	}
+
+	void op_ieq()  { op_icmp(stack_cell(-2)->inum == stack_cell(-1)->inum); }
+	void op_ine()  { op_icmp(stack_cell(-2)->inum != stack_cell(-1)->inum); }
+	void op_ilt()  { op_icmp(stack_cell(-2)->inum <  stack_cell(-1)->inum); }
+	void op_ilte() { op_icmp(stack_cell(-2)->inum <= stack_cell(-1)->inum); }
+	void op_igt()  { op_icmp(stack_cell(-2)->inum >  stack_cell(-1)->inum); }
+	void op_igte() { op_icmp(stack_cell(-2)->inum >= stack_cell(-1)->inum); }
+
+	// compare fused with the jfalse,drop after it: both operands are
+	// consumed, and only a false result is left for the jump target
+	void op_jicmp(bool flag) {
+		op_drop();
+		if (flag) {
+			op_drop();
+			return;
+		}
+		*stack_cell(-1) = (item_t){.type = BOOLEAN, .flag = false};
+		op_jmp();
+	}
+
+	void op_jieq()  { op_jicmp(stack_cell(-2)->inum == stack_cell(-1)->inum); }
+	void op_jine()  { op_jicmp(stack_cell(-2)->inum != stack_cell(-1)->inum); }
+	void op_jilt()  { op_jicmp(stack_cell(-2)->inum <  stack_cell(-1)->inum); }
+	void op_jilte() { op_jicmp(stack_cell(-2)->inum <= stack_cell(-1)->inum); }
+	void op_jigt()  { op_jicmp(stack_cell(-2)->inum >  stack_cell(-1)->inum); }
+	void op_jigte() { op_jicmp(stack_cell(-2)->inum >= stack_cell(-1)->inum); }
+
+	void op_fadd() {
+		stack_cell(-2)->fnum += stack_cell(-1)->fnum;
+		op_drop();
+	}
+
+	void op_fsub() {
+		stack_cell(-2)->fnum -= stack_cell(-1)->fnum;
+		op_drop();
+	}
+
+	void op_fmul() {
+		stack_cell(-2)->fnum *= stack_cell(-1)->fnum;
+		op_drop();
+	}
+
+	void op_fdiv() {
+		stack_cell(-2)->fnum /= stack_cell(-1)->fnum;
+		op_drop();
+	}
+
 	void op_concat() {
 		item_t b = pop();
 		item_t a = pop();
 		char tmpA[STRTMP];
 		char tmpB[STRTMP];
 
-		const char *as = tmptext(a, tmpA, sizeof(tmpA));
-		const char *bs = tmptext(b, tmpB, sizeof(tmpB));
-		int lenA = strlen(as);
-		int lenB = strlen(bs);
+		size_t lenA = 0, lenB = 0;
+		const char *as = is_text(a) ? text_data(a, &lenA): tmptext(a, tmpA, sizeof(tmpA));
+		const char *bs = is_text(b) ? text_data(b, &lenB): tmptext(b, tmpB, sizeof(tmpB));
+		if (!is_text(a)) lenA = strlen(as);
+		if (!is_text(b)) lenB = strlen(bs);
 
-		must(lenA+lenB < STRBUF, "op_concat max length exceeded (%d bytes)", STRBUF-1);
-
-		char buf[STRBUF];
-		char* ap = buf+0;
-		char* bp = buf+lenA;
-		memcpy(ap, as, lenA);
-		memcpy(bp, bs, lenB);
-		buf[lenA+lenB] = 0;
-
-		push(string(buf));
+		// result is a view of run-time text, interned only if needed
+		char* str = texts.alloc(lenA+lenB);
+		memcpy(str, as, lenA);
+		memcpy(str+lenA, bs, lenB);
+		push(view(str, lenA+lenB));
 	}
 
 	void op_count() {
@@ -3219,7 +7174,7 @@ class Rela {
 		item_t a = pop();
 		while (depth()) {
 			item_t b = pop();
-			must(a.type == b.type, "op_min mixed types");
+			must(a.type == b.type || (is_text(a) && is_text(b)), "op_min mixed types");
 			a = less(a, b) ? a: b;
 		}
 		push(a);
@@ -3229,7 +7184,7 @@ class Rela {
 		item_t a = pop();
 		while (depth()) {
 			item_t b = pop();
-			must(a.type == b.type, "op_min mixed types");
+			must(a.type == b.type || (is_text(a) && is_text(b)), "op_min mixed types");
 			a = less(a, b) ? b: a;
 		}
 		push(a);
@@ -3238,7 +7193,10 @@ class Rela {
 	void op_match() {
 	#ifdef PCRE
 		item_t pattern = pop_type(STRING);
-		item_t subject = pop_type(STRING);
+		item_t subject = pop();
+		must(is_text(subject), "pop_type expected %s, found %s", type_names[STRING], type_names[subject.type]);
+		size_t subject_len = 0;
+		const char* subject_str = text_data(subject, &subject_len);
 
 		const char *error;
 		int erroffset;
@@ -3254,7 +7212,7 @@ class Rela {
 		must(extra && !error, "pcre_study: %s", pattern.str);
 	#endif
 
-		int matches = pcre_exec(re, extra, subject.str, strlen(subject.str), 0, 0, ovector, sizeof(ovector));
+		int matches = pcre_exec(re, extra, subject_str, subject_len, 0, 0, ovector, sizeof(ovector));
 
 		if (matches < 0) {
 			if (extra)
@@ -3270,7 +7228,7 @@ class Rela {
 		for (int i = 0; i < matches; i++) {
 			int offset = ovector[2*i];
 			int length = ovector[2*i+1] - offset;
-			push(string(substr(subject.str, offset, length)));
+			push(offset < 0 ? string(""): text_slice(subject, offset, length));
 		}
 
 		if (extra)
@@ -3283,7 +7241,15 @@ class Rela {
 	}
 
 	void op_sort() {
-		item_t a = pop_type(VECTOR);
+		item_t a = pop();
+
+		if (a.type == ARRAY) {
+			arr_visit(a.arr, [&](auto* p) { std::sort(p, p + arr_size(a.arr)); });
+			push(a);
+			return;
+		}
+
+		must(a.type == VECTOR, "pop_type expected %s, found %s", type_names[VECTOR], type_names[a.type]);
 		if (vec_size(a.vec) > 0) vec_sort(a.vec);
 		push(a);
 	}
@@ -3326,7 +7292,7 @@ class Rela {
 	// lit,assign0
 	void op_assignl() {
 		// indexed from the base of the current subframe
-		assign(literal(), *item(0));
+		assign(literal(), depth() ? *item(0): nil());
 	}
 
 	// dups
@@ -3360,6 +7326,27 @@ class Rela {
 			case OP_LIMIT:     op_limit();     return;
 			case OP_CLEAN:     op_clean();     return;
 			case OP_RETURN:    op_return();    return;
+			case OP_TAIL:      op_tail();      return;
+			case OP_INLINE:    op_inline();    return;
+			case OPR_MOVE:     opr_move();   return;
+			case OPR_POP:      opr_pop();    return;
+			case OPR_ADD:      opr_add();    return;
+			case OPR_SUB:      opr_sub();    return;
+			case OPR_MUL:      opr_mul();    return;
+			case OPR_DIV:      opr_div();    return;
+			case OPR_MOD:      opr_mod();    return;
+			case OPR_EQ:       opr_eq();     return;
+			case OPR_NE:       opr_ne();     return;
+			case OPR_LT:       opr_lt();     return;
+			case OPR_LTE:      opr_lte();    return;
+			case OPR_GT:       opr_gt();     return;
+			case OPR_GTE:      opr_gte();    return;
+			case OPR_TEQ:      opr_teq();    return;
+			case OPR_TNE:      opr_tne();    return;
+			case OPR_TLT:      opr_tlt();    return;
+			case OPR_TLTE:     opr_tlte();   return;
+			case OPR_TGT:      opr_tgt();    return;
+			case OPR_TGTE:     opr_tgte();   return;
 			case OP_LGET:      op_lget();      return;
 			case OPP_LCALL:    op_lcall();     return;
 			case OPP_FNAME:    op_fname();     return;
@@ -3373,6 +7360,29 @@ class Rela {
 			case OPP_UPDATE:   op_update();    return;
 			case OPP_MARK2:    op_mark2();     return;
 			case OPP_LIMIT2:   op_limit2();    return;
+			case OPP_VTEMP:    op_vtemp();     return;
+			case OPP_MTEMP:    op_mtemp();     return;
+			case OPP_UNTEMP:   op_untemp();    return;
+			case OPT_IADD:      op_iadd();      return;
+			case OPT_ISUB:      op_isub();      return;
+			case OPT_IMUL:      op_imul();      return;
+			case OPT_IADD_LIT:  op_iadd_lit();  return;
+			case OPT_IEQ:       op_ieq();       return;
+			case OPT_INE:       op_ine();       return;
+			case OPT_ILT:       op_ilt();       return;
+			case OPT_ILTE:      op_ilte();      return;
+			case OPT_IGT:       op_igt();       return;
+			case OPT_IGTE:      op_igte();      return;
+			case OPT_JIEQ:      op_jieq();      return;
+			case OPT_JINE:      op_jine();      return;
+			case OPT_JILT:      op_jilt();      return;
+			case OPT_JILTE:     op_jilte();     return;
+			case OPT_JIGT:      op_jigt();      return;
+			case OPT_JIGTE:     op_jigte();     return;
+			case OPT_FADD:      op_fadd();      return;
+			case OPT_FSUB:      op_fsub();      return;
+			case OPT_FMUL:      op_fmul();      return;
+			case OPT_FDIV:      op_fdiv();      return;
 			case OP_PRINT:     op_print();     return;
 			case OP_COROUTINE: op_coroutine(); return;
 			case OP_RESUME:    op_resume();    return;
@@ -3442,6 +7452,39 @@ class Rela {
 			case OP_TYPE:      op_type();      return;
 			case OP_UNPACK:    op_unpack();    return;
 			case OP_GC:        gc();           return;
+			case OP_WAIT:      op_wait();      return;
+			case OP_ARRAY:     op_array();     return;
+			case OP_SUM:       op_sum();       return;
+			case OP_DOT:       op_dot();       return;
+			case OP_ARGMIN:    op_argmin();    return;
+			case OP_ARGMAX:    op_argmax();    return;
+			case OP_SCALE:     op_scale();     return;
+			case OP_VADD:      op_vadd();      return;
+			case OP_AXPY:      op_axpy();      return;
+			case OP_CLAMP:     op_clamp();     return;
+			case OP_PREFIX:    op_prefix();    return;
+			case OP_BYTES:     op_bytes();     return;
+			case OP_SLICE:     op_slice();     return;
+			case OP_PEEK:      op_peek();      return;
+			case OP_POKE:      op_poke();      return;
+			case OP_STR_SPLIT:   op_str_split();   return;
+			case OP_STR_JOIN:    op_str_join();    return;
+			case OP_STR_FIND:    op_str_find();    return;
+			case OP_STR_RFIND:   op_str_rfind();   return;
+			case OP_STR_REPLACE: op_str_replace(); return;
+			case OP_STR_STARTS:  op_str_starts();  return;
+			case OP_STR_ENDS:    op_str_ends();    return;
+			case OP_STR_TRIM:    op_str_trim();    return;
+			case OP_STR_UPPER:   op_str_upper();   return;
+			case OP_STR_LOWER:   op_str_lower();   return;
+			case OP_STR_FORMAT:  op_str_format();  return;
+			case OP_IO_LINES:    op_io_lines();    return;
+			case OP_JSON_DECODE: op_json_decode(); return;
+			case OP_JSON_ENCODE: op_json_encode(); return;
+			case OP_JSON_LINES:  op_json_lines();  return;
+			case OP_CSV_ROWS:    op_csv_rows();    return;
+			case OP_CSV_COLUMNS: op_csv_columns(); return;
+			case OP_LAST:        break;
 		}
 		must(false, "invalid operation");
 	}
@@ -3459,6 +7502,27 @@ class Rela {
 			case OP_LIMIT:     return "limit";
 			case OP_CLEAN:     return "clean";
 			case OP_RETURN:    return "return";
+			case OP_TAIL:      return "tail";
+			case OP_INLINE:    return "inline";
+			case OPR_MOVE:     return "rmove";
+			case OPR_POP:      return "rpop";
+			case OPR_ADD:      return "radd";
+			case OPR_SUB:      return "rsub";
+			case OPR_MUL:      return "rmul";
+			case OPR_DIV:      return "rdiv";
+			case OPR_MOD:      return "rmod";
+			case OPR_EQ:       return "req";
+			case OPR_NE:       return "rne";
+			case OPR_LT:       return "rlt";
+			case OPR_LTE:      return "rlte";
+			case OPR_GT:       return "rgt";
+			case OPR_GTE:      return "rgte";
+			case OPR_TEQ:      return "rteq";
+			case OPR_TNE:      return "rtne";
+			case OPR_TLT:      return "rtlt";
+			case OPR_TLTE:     return "rtlte";
+			case OPR_TGT:      return "rtgt";
+			case OPR_TGTE:     return "rtgte";
 			case OP_LGET:      return "lget";
 			case OPP_LCALL:    return "lcall";
 			case OPP_FNAME:    return "fname";
@@ -3472,6 +7536,29 @@ class Rela {
 			case OPP_UPDATE:   return "update";
 			case OPP_MARK2:    return "mark2";
 			case OPP_LIMIT2:   return "limit2";
+			case OPP_VTEMP:    return "vtemp";
+			case OPP_MTEMP:    return "mtemp";
+			case OPP_UNTEMP:   return "untemp";
+			case OPT_IADD:      return "iadd";
+			case OPT_ISUB:      return "isub";
+			case OPT_IMUL:      return "imul";
+			case OPT_IADD_LIT:  return "iadd_lit";
+			case OPT_IEQ:       return "ieq";
+			case OPT_INE:       return "ine";
+			case OPT_ILT:       return "ilt";
+			case OPT_ILTE:      return "ilte";
+			case OPT_IGT:       return "igt";
+			case OPT_IGTE:      return "igte";
+			case OPT_JIEQ:      return "jieq";
+			case OPT_JINE:      return "jine";
+			case OPT_JILT:      return "jilt";
+			case OPT_JILTE:     return "jilte";
+			case OPT_JIGT:      return "jigt";
+			case OPT_JIGTE:     return "jigte";
+			case OPT_FADD:      return "fadd";
+			case OPT_FSUB:      return "fsub";
+			case OPT_FMUL:      return "fmul";
+			case OPT_FDIV:      return "fdiv";
 			case OP_PRINT:     return "print";
 			case OP_COROUTINE: return "coroutine";
 			case OP_RESUME:    return "resume";
@@ -3541,6 +7628,38 @@ class Rela {
 			case OP_TYPE:      return "type";
 			case OP_UNPACK:    return "unpack";
 			case OP_GC:        return "gc";
+			case OP_WAIT:      return "wait";
+			case OP_ARRAY:     return "array";
+			case OP_SUM:       return "sum";
+			case OP_DOT:       return "dot";
+			case OP_ARGMIN:    return "argmin";
+			case OP_ARGMAX:    return "argmax";
+			case OP_SCALE:     return "scale";
+			case OP_VADD:      return "add";
+			case OP_AXPY:      return "axpy";
+			case OP_CLAMP:     return "clamp";
+			case OP_PREFIX:    return "prefix";
+			case OP_BYTES:     return "bytes";
+			case OP_SLICE:     return "slice";
+			case OP_PEEK:      return "peek";
+			case OP_POKE:      return "poke";
+			case OP_STR_SPLIT:   return "split";
+			case OP_STR_JOIN:    return "join";
+			case OP_STR_FIND:    return "find";
+			case OP_STR_RFIND:   return "rfind";
+			case OP_STR_REPLACE: return "replace";
+			case OP_STR_STARTS:  return "starts";
+			case OP_STR_ENDS:    return "ends";
+			case OP_STR_TRIM:    return "trim";
+			case OP_STR_UPPER:   return "upper";
+			case OP_STR_LOWER:   return "lower";
+			case OP_STR_FORMAT:  return "format";
+			case OP_IO_LINES:    return "lines";
+			case OP_JSON_DECODE: return "decode";
+			case OP_JSON_ENCODE: return "encode";
+			case OP_JSON_LINES:  return "lines";
+			case OP_CSV_ROWS:    return "rows";
+			case OP_CSV_COLUMNS: return "columns";
 			default:           return "(function)";
 		}
 	}
@@ -3559,6 +7678,16 @@ class Rela {
 		vecs.clear();
 		cors.clear();
 		data.clear();
+		arrs.clear();
+		bufs.clear();
+		blobs.clear();
+		streams.clear();
+		callables.clear();
+		callables_free.clear();
+		natives.clear();
+		#ifdef JIT
+		jit_release();
+		#endif
 	}
 
 	bool tick() {
@@ -3569,23 +7698,301 @@ class Rela {
 		return opcode != OP_STOP;
 	}
 
-	void tick_all() {
+	// tick() for nested execution, charged to the active budget later
+	bool tick_nested() {
+		nest.spent++;
+		nest.total++;
+		must(nest.limit < 0 || nest.total <= nest.limit, "budget exceeded in nested call");
+		must(!nest.deadline || nest.total % SLICE || nanos() < nest.deadline, "budget exceeded in nested call");
+		return tick();
+	}
+
+	// Returns false if the tick budget runs out before OP_STOP, leaving all
+	// execution state in the routines chain so it can be picked up again.
+	// A negative budget never runs out. Nested execution via method() for
+	// meta-methods and iterator functions cannot pause, so its ticks are
+	// charged after the instruction that started it. It may run past the
+	// budget, up to the cap in nest.
+	bool tick_all(int64_t& ticks) {
+		return ticks < 0 ? tick_loop<false>(ticks): tick_loop<true>(ticks);
+	}
+
+	// Native code from the JIT or a linked transpile() unit, by ip. A
+	// native function starts at routine->ip and returns the remaining
+	// tick budget once control leaves the code it covers.
+	typedef int64_t (*native_fn)(Rela* rela, int64_t budget);
+	std::vector<native_fn> natives;
+
+	bool native_ready(int ip) {
+		return (size_t)ip < natives.size() && natives[ip];
+	}
+
+	// run native code for as long as routine->ip lands on some
+	template <bool counted>
+	void native_run(int64_t& n) {
+		int64_t budget = counted ? n: INT64_MAX;
+		while (budget && native_ready(routine->ip)) {
+			budget = natives[routine->ip](this, budget);
+			#ifdef JIT
+			if (jit_fault) {
+				std::exception_ptr fault = jit_fault;
+				jit_fault = nullptr;
+				std::rethrow_exception(fault);
+			}
+			#endif
+		}
+		if (counted) n = budget;
+	}
+
+	// OP_ENTER at ip has already been counted and skipped by tick_loop
+	template <bool counted>
+	bool native_function(int ip, int64_t& n) {
+		#ifdef JIT
+		if (!native_ready(ip)) jit_function(ip);
+		#endif
+		if (!native_ready(ip)) return false;
+		routine->ip = ip;
+		if (counted) n++;
+		native_run<counted>(n);
+		return true;
+	}
+
+	// backward OP_JMP at ip, already taken to the loop head
+	template <bool counted>
+	void native_loop(int ip, int64_t& n) {
+		int head = code[ip].item.inum;
+		#ifdef JIT
+		if (!native_ready(head)) jit_loop(ip);
+		#endif
+		if (native_ready(head)) native_run<counted>(n);
+	}
+
+	// transpile() units linked into the host, tried after each module()
+	typedef bool (*transpiled_fn)(Rela& rela, uint64_t hash);
+
+	static std::vector<transpiled_fn>& transpiled_units() {
+		static std::vector<transpiled_fn> units;
+		return units;
+	}
+
+	void code_hash_item(uint64_t& h, const item_t& item) {
+		auto mix = [&](const void* p, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				h ^= ((const uint8_t*)p)[i];
+				h *= 1099511628211ull;
+			}
+		};
+		mix(&item.type, sizeof(item.type));
+		switch (item.type) {
+			case INTEGER: mix(&item.inum, sizeof(item.inum)); break;
+			case FLOAT: mix(&item.fnum, sizeof(item.fnum)); break;
+			case BOOLEAN: mix(&item.flag, sizeof(item.flag)); break;
+			case SUBROUTINE: mix(&item.sub, sizeof(item.sub)); break;
+			case OPERATION: mix(&item.opcode, sizeof(item.opcode)); break;
+			case EXECUTE: mix(&item.function, sizeof(item.function)); break;
+			case STRING: mix(item.str, strlen(item.str)); break;
+			case VECTOR: for (auto& x: item.vec->items) code_hash_item(h, x); break;
+			default: break;
+		}
+	}
+
+	// identifies the code (and opcode numbering) a unit was generated from
+	uint64_t code_hash() {
+		uint64_t h = 14695981039346656037ull;
+		item_t ops = integer(OP_LAST);
+		code_hash_item(h, ops);
+		for (auto& c: code) {
+			code_hash_item(h, integer(c.op));
+			code_hash_item(h, c.item);
+		}
+		return h;
+	}
+
+	// handlers transpiled code calls by name; the rest use operation_call()
+	const char* transpile_handler(enum opcode_t op) {
+		switch (op) {
+			case OP_FOR:      return "op_for";
+			case OP_ENTER:    return "op_enter";
+			case OP_LIT:      return "op_lit";
+			case OP_MARK:     return "op_mark";
+			case OP_LIMIT:    return "op_limit";
+			case OPP_MARK2:   return "op_mark2";
+			case OPP_LIMIT2:  return "op_limit2";
+			case OP_CLEAN:    return "op_clean";
+			case OP_RETURN:   return "op_return";
+			case OP_TAIL:     return "op_tail";
+			case OP_INLINE:   return "op_inline";
+			case OPR_MOVE:    return "opr_move";
+			case OPR_POP:     return "opr_pop";
+			case OPR_ADD:     return "opr_add";
+			case OPR_SUB:     return "opr_sub";
+			case OPR_MUL:     return "opr_mul";
+			case OPR_DIV:     return "opr_div";
+			case OPR_MOD:     return "opr_mod";
+			case OPR_EQ:      return "opr_eq";
+			case OPR_NE:      return "opr_ne";
+			case OPR_LT:      return "opr_lt";
+			case OPR_LTE:     return "opr_lte";
+			case OPR_GT:      return "opr_gt";
+			case OPR_GTE:     return "opr_gte";
+			case OPR_TEQ:     return "opr_teq";
+			case OPR_TNE:     return "opr_tne";
+			case OPR_TLT:     return "opr_tlt";
+			case OPR_TLTE:    return "opr_tlte";
+			case OPR_TGT:     return "opr_tgt";
+			case OPR_TGTE:    return "opr_tgte";
+			case OP_LGET:     return "op_lget";
+			case OPP_LCALL:   return "op_lcall";
+			case OPP_FNAME:   return "op_fname";
+			case OPP_CFUNC:   return "op_cfunc";
+			case OPP_ASSIGNL: return "op_assignl";
+			case OPP_ASSIGNP: return "op_assignp";
+			case OPP_MUL_LIT: return "op_mul_lit";
+			case OPP_ADD_LIT: return "op_add_lit";
+			case OPT_IADD:     return "op_iadd";
+			case OPT_ISUB:     return "op_isub";
+			case OPT_IMUL:     return "op_imul";
+			case OPT_IADD_LIT: return "op_iadd_lit";
+			case OPT_IEQ:      return "op_ieq";
+			case OPT_INE:      return "op_ine";
+			case OPT_ILT:      return "op_ilt";
+			case OPT_ILTE:     return "op_ilte";
+			case OPT_IGT:      return "op_igt";
+			case OPT_IGTE:     return "op_igte";
+			case OPT_JIEQ:     return "op_jieq";
+			case OPT_JINE:     return "op_jine";
+			case OPT_JILT:     return "op_jilt";
+			case OPT_JILTE:    return "op_jilte";
+			case OPT_JIGT:     return "op_jigt";
+			case OPT_JIGTE:    return "op_jigte";
+			case OPT_FADD:     return "op_fadd";
+			case OPT_FSUB:     return "op_fsub";
+			case OPT_FMUL:     return "op_fmul";
+			case OPT_FDIV:     return "op_fdiv";
+			case OPP_GNAME:   return "op_gname";
+			case OPP_COPIES:  return "op_copies";
+			case OPP_UPDATE:  return "op_update";
+			case OP_CALL:     return "op_call";
+			case OP_LOOP:     return "op_loop";
+			case OP_UNLOOP:   return "op_unloop";
+			case OP_JFALSE:   return "op_jfalse";
+			case OP_JTRUE:    return "op_jtrue";
+			case OP_NIL:      return "op_nil";
+			case OP_TRUE:     return "op_true";
+			case OP_FALSE:    return "op_false";
+			case OP_COPY:     return "op_copy";
+			case OP_SHUNT:    return "op_shunt";
+			case OP_SHIFT:    return "op_shift";
+			case OP_DROP:     return "op_drop";
+			case OP_ASSIGN:   return "op_assign";
+			case OP_FIND:     return "op_find";
+			case OP_GET:      return "op_get";
+			case OP_SET:      return "op_set";
+			case OP_COUNT:    return "op_count";
+			case OP_ADD:      return "op_add";
+			case OP_SUB:      return "op_sub";
+			case OP_MUL:      return "op_mul";
+			case OP_DIV:      return "op_div";
+			case OP_MOD:      return "op_mod";
+			case OP_NEG:      return "op_neg";
+			case OP_NOT:      return "op_not";
+			case OP_EQ:       return "op_eq";
+			case OP_NE:       return "op_ne";
+			case OP_LT:       return "op_lt";
+			case OP_GT:       return "op_gt";
+			case OP_LTE:      return "op_lte";
+			case OP_GTE:      return "op_gte";
+			default:          return nullptr;
+		}
+	}
+
+	// always continue at the next instruction on the same routine
+	bool transpile_plain(enum opcode_t op) {
+		if (op >= OPR_MOVE && op <= OPR_GTE) return true;
+		if (op >= OPT_IADD && op <= OPT_IGTE) return true;
+		if (op >= OPT_FADD && op <= OPT_FDIV) return true;
+		switch (op) {
+			case OP_ENTER: case OP_LIT: case OP_MARK: case OP_LIMIT: case OPP_MARK2: case OPP_LIMIT2:
+			case OP_CLEAN: case OP_LGET: case OPP_FNAME: case OPP_GNAME: case OPP_ASSIGNL: case OPP_ASSIGNP:
+			case OPP_MUL_LIT: case OPP_ADD_LIT: case OPP_COPIES: case OP_LOOP: case OP_UNLOOP:
+			case OP_GLOBAL: case OP_MAP: case OP_VECTOR: case OP_VPUSH: case OP_UNMAP: case OP_NIL: case OP_TRUE:
+			case OPP_VTEMP: case OPP_MTEMP: case OPP_UNTEMP:
+			case OP_FALSE: case OP_COPY: case OP_SHUNT: case OP_SHIFT: case OP_ASSIGN: case OP_FIND: case OP_SET:
+			case OP_GET: case OP_COUNT: case OP_DROP: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+			case OP_MOD: case OP_NEG: case OP_NOT: case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LTE:
+			case OP_GTE: case OP_CONCAT:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	// the other ip an instruction may continue at, or -1
+	int transpile_target(int ip) {
+		code_t& c = code[ip];
+		if ((c.op == OP_JMP || c.op == OP_JFALSE || c.op == OP_JTRUE) && c.item.type == INTEGER)
+			return c.item.inum;
+		if (c.op >= OPR_TEQ && c.op <= OPR_TGTE)
+			return c.item.inum >> 16;
+		if (c.op >= OPT_JIEQ && c.op <= OPT_JIGTE)
+			return c.item.inum;
+		// update ticks the following operator itself
+		if (c.op == OPP_UPDATE)
+			return ip+2;
+		return -1;
+	}
+
+	template <bool counted>
+	bool tick_loop(int64_t& ticks) {
+		int64_t n = ticks;
 		for (;;) {
+			if (counted) {
+				if (nest.spent) {
+					int64_t charge = std::min(nest.spent, n);
+					nest.spent -= charge;
+					n -= charge;
+				}
+				if (!n--) {
+					ticks = 0;
+					return false;
+				}
+			}
 			int ip = routine->ip++;
 			assert(ip >= 0 && ip < (int)code.size());
 			auto opcode = code[ip].op;
 			switch (opcode) {
-				case OP_STOP: { return; }
-				case OP_JMP: { op_jmp(); continue; }
+				case OP_STOP: { ticks = n; return true; }
+				case OP_JMP: { op_jmp(); if (routine->ip < ip) native_loop<counted>(ip, n); continue; }
 				case OP_FOR: { op_for(); continue; }
-				case OP_ENTER: { op_enter(); continue; }
+				case OP_ENTER: { if (!native_function<counted>(ip, n)) op_enter(); continue; }
 				case OP_LIT: { op_lit(); continue; }
 				case OP_MARK: { op_mark(); continue; }
 				case OP_LIMIT: { op_limit(); continue; }
 				case OPP_MARK2: { op_mark2(); continue; }
 				case OPP_LIMIT2: { op_limit2(); continue; }
 				case OP_CLEAN: { op_clean(); continue; }
-				case OP_RETURN: { op_return(); continue; }
+				case OP_RETURN: { op_return(); if (native_ready(routine->ip)) native_run<counted>(n); continue; }
+				case OP_TAIL: { op_tail(); continue; }
+				case OP_INLINE: { op_inline(); continue; }
+				case OPR_MOVE: { opr_move(); continue; }
+				case OPR_POP: { opr_pop(); continue; }
+				case OPR_ADD: { opr_add(); continue; }
+				case OPR_SUB: { opr_sub(); continue; }
+				case OPR_MUL: { opr_mul(); continue; }
+				case OPR_DIV: { opr_div(); continue; }
+				case OPR_MOD: { opr_mod(); continue; }
+				case OPR_EQ: { opr_eq(); continue; }
+				case OPR_NE: { opr_ne(); continue; }
+				case OPR_LT: { opr_lt(); continue; }
+				case OPR_LTE: { opr_lte(); continue; }
+				case OPR_GT: { opr_gt(); continue; }
+				case OPR_GTE: { opr_gte(); continue; }
+				case OPR_TEQ: { opr_teq(); continue; }
+				case OPR_TNE: { opr_tne(); continue; }
+				case OPR_TLT: { opr_tlt(); continue; }
+				case OPR_TLTE: { opr_tlte(); continue; }
+				case OPR_TGT: { opr_tgt(); continue; }
+				case OPR_TGTE: { opr_tgte(); continue; }
 				case OP_LGET: { op_lget(); continue; }
 				case OPP_LCALL: { op_lcall(); continue; }
 				case OPP_CFUNC: { op_cfunc(); continue; }
@@ -3593,11 +8000,583 @@ class Rela {
 				case OPP_ASSIGNP: { op_assignp(); continue; }
 				case OPP_MUL_LIT: { op_mul_lit(); continue; }
 				case OPP_ADD_LIT: { op_add_lit(); continue; }
+				case OPT_IADD: { op_iadd(); continue; }
+				case OPT_ISUB: { op_isub(); continue; }
+				case OPT_IADD_LIT: { op_iadd_lit(); continue; }
+				case OPT_ILT: { op_ilt(); continue; }
+				case OPT_JIEQ: { op_jieq(); continue; }
+				case OPT_JINE: { op_jine(); continue; }
+				case OPT_JILT: { op_jilt(); continue; }
+				case OPT_JILTE: { op_jilte(); continue; }
+				case OPT_JIGT: { op_jigt(); continue; }
+				case OPT_JIGTE: { op_jigte(); continue; }
+				case OPT_FADD: { op_fadd(); continue; }
+				case OPT_FMUL: { op_fmul(); continue; }
 				default: { operation_call(opcode); continue; }
 			}
 		}
 	}
 
+#ifdef JIT
+	// Baseline JIT. A function body, or a loop outside any compiled
+	// function, that gets hot is translated to native code running the
+	// same instructions without dispatch: each one calls its op_* handler
+	// directly, or is inlined for literals, locals and integer fast paths.
+	// All state stays in the coroutine and routine->ip is kept exact, so
+	// anything unexpected (a call leaving the range, a coroutine switch,
+	// an error, the tick budget) returns to the interpreter, which can
+	// re-enter native code at any compiled instruction.
+
+	static const int JIT_HOT = 1000; // function entries or loop backedges
+
+	typedef bool (*jit_op)(Rela* rela);
+
+	struct jit_block_t {
+		void* mem = nullptr;
+		size_t size = 0;
+	};
+
+	std::vector<jit_block_t> jit_blocks;
+	std::vector<int> jit_heat; // per ip
+	std::exception_ptr jit_fault;
+	FILE* jit_perf = nullptr;
+	bool jit_perf_map = false; // see enable_perf_map()
+
+	// minimal x86-64 encoder: memory operands are always [base+disp32]
+	struct jit_asm_t {
+		enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+		enum { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+		std::vector<uint8_t> bytes;
+		std::vector<int> labels;
+		std::vector<std::pair<int,int>> fixups; // rel32 offset, label
+
+		void b(uint8_t x) {
+			bytes.push_back(x);
+		}
+
+		void d(int32_t x) {
+			for (int i = 0; i < 4; i++) b(x >> (i*8));
+		}
+
+		int label() {
+			labels.push_back(-1);
+			return labels.size()-1;
+		}
+
+		void bind(int l) {
+			labels[l] = bytes.size();
+		}
+
+		void rel(int l) {
+			fixups.push_back({(int)bytes.size(), l});
+			d(0);
+		}
+
+		void rex(bool w, int reg, int rm) {
+			uint8_t x = 0x40 | (w ? 8: 0) | (reg & 8 ? 4: 0) | (rm & 8 ? 1: 0);
+			if (x != 0x40) b(x);
+		}
+
+		// op reg, [base+disp32]
+		void mem(bool w, uint8_t op, int reg, int base, int32_t disp) {
+			rex(w, reg, base);
+			b(op);
+			b(0x80 | (reg & 7) << 3 | (base & 7));
+			if ((base & 7) == RSP) b(0x24);
+			d(disp);
+		}
+
+		// op rm, reg
+		void reg(bool w, uint8_t op, int reg, int rm) {
+			rex(w, reg, rm);
+			b(op);
+			b(0xC0 | (reg & 7) << 3 | (rm & 7));
+		}
+
+		void mov_imm(int r, int64_t x) {
+			rex(true, 0, r);
+			b(0xB8 | (r & 7));
+			for (int i = 0; i < 8; i++) b(x >> (i*8));
+		}
+
+		void jmp(int l) {
+			b(0xE9);
+			rel(l);
+		}
+
+		void jcc(int cc, int l) {
+			b(0x0F);
+			b(0x80 | cc);
+			rel(l);
+		}
+
+		void call(void* fn) {
+			mov_imm(RAX, (int64_t)fn);
+			b(0xFF);
+			b(0xD0);
+		}
+
+		void link() {
+			for (auto& fix: fixups) {
+				int32_t x = labels[fix.second] - (fix.first + 4);
+				memcpy(&bytes[fix.first], &x, 4);
+			}
+		}
+	};
+
+	template <void (Rela::*handler)()>
+	static bool jit_call(Rela* rela) {
+		try {
+			(rela->*handler)();
+			return false;
+		}
+		catch (...) {
+			rela->jit_fault = std::current_exception();
+			return true;
+		}
+	}
+
+	static bool jit_call_operation(Rela* rela) {
+		try {
+			rela->operation_call(rela->code[rela->routine->ip-1].op);
+			return false;
+		}
+		catch (...) {
+			rela->jit_fault = std::current_exception();
+			return true;
+		}
+	}
+
+	jit_op jit_handler(enum opcode_t op) {
+		switch (op) {
+			case OP_FOR:      return jit_call<&Rela::op_for>;
+			case OP_ENTER:    return jit_call<&Rela::op_enter>;
+			case OP_LIT:      return jit_call<&Rela::op_lit>;
+			case OP_MARK:     return jit_call<&Rela::op_mark>;
+			case OP_LIMIT:    return jit_call<&Rela::op_limit>;
+			case OPP_MARK2:   return jit_call<&Rela::op_mark2>;
+			case OPP_LIMIT2:  return jit_call<&Rela::op_limit2>;
+			case OP_CLEAN:    return jit_call<&Rela::op_clean>;
+			case OP_RETURN:   return jit_call<&Rela::op_return>;
+			case OP_TAIL:     return jit_call<&Rela::op_tail>;
+			case OP_INLINE:   return jit_call<&Rela::op_inline>;
+			case OPR_MOVE:    return jit_call<&Rela::opr_move>;
+			case OPR_POP:     return jit_call<&Rela::opr_pop>;
+			case OPR_ADD:     return jit_call<&Rela::opr_add>;
+			case OPR_SUB:     return jit_call<&Rela::opr_sub>;
+			case OPR_MUL:     return jit_call<&Rela::opr_mul>;
+			case OPR_TEQ:     return jit_call<&Rela::opr_teq>;
+			case OPR_TNE:     return jit_call<&Rela::opr_tne>;
+			case OPR_TLT:     return jit_call<&Rela::opr_tlt>;
+			case OPR_TLTE:    return jit_call<&Rela::opr_tlte>;
+			case OPR_TGT:     return jit_call<&Rela::opr_tgt>;
+			case OPR_TGTE:    return jit_call<&Rela::opr_tgte>;
+			case OP_LGET:     return jit_call<&Rela::op_lget>;
+			case OPP_LCALL:   return jit_call<&Rela::op_lcall>;
+			case OPP_FNAME:   return jit_call<&Rela::op_fname>;
+			case OPP_CFUNC:   return jit_call<&Rela::op_cfunc>;
+			case OPP_ASSIGNL: return jit_call<&Rela::op_assignl>;
+			case OPP_ASSIGNP: return jit_call<&Rela::op_assignp>;
+			case OPP_MUL_LIT: return jit_call<&Rela::op_mul_lit>;
+			case OPP_ADD_LIT: return jit_call<&Rela::op_add_lit>;
+			case OPT_IADD:     return jit_call<&Rela::op_iadd>;
+			case OPT_ISUB:     return jit_call<&Rela::op_isub>;
+			case OPT_IMUL:     return jit_call<&Rela::op_imul>;
+			case OPT_IADD_LIT: return jit_call<&Rela::op_iadd_lit>;
+			case OPT_IEQ:      return jit_call<&Rela::op_ieq>;
+			case OPT_INE:      return jit_call<&Rela::op_ine>;
+			case OPT_ILT:      return jit_call<&Rela::op_ilt>;
+			case OPT_ILTE:     return jit_call<&Rela::op_ilte>;
+			case OPT_IGT:      return jit_call<&Rela::op_igt>;
+			case OPT_IGTE:     return jit_call<&Rela::op_igte>;
+			case OPT_JIEQ:     return jit_call<&Rela::op_jieq>;
+			case OPT_JINE:     return jit_call<&Rela::op_jine>;
+			case OPT_JILT:     return jit_call<&Rela::op_jilt>;
+			case OPT_JILTE:    return jit_call<&Rela::op_jilte>;
+			case OPT_JIGT:     return jit_call<&Rela::op_jigt>;
+			case OPT_JIGTE:    return jit_call<&Rela::op_jigte>;
+			case OPT_FADD:     return jit_call<&Rela::op_fadd>;
+			case OPT_FSUB:     return jit_call<&Rela::op_fsub>;
+			case OPT_FMUL:     return jit_call<&Rela::op_fmul>;
+			case OPT_FDIV:     return jit_call<&Rela::op_fdiv>;
+			case OPP_GNAME:   return jit_call<&Rela::op_gname>;
+			case OPP_UPDATE:  return jit_call<&Rela::op_update>;
+			case OP_CALL:     return jit_call<&Rela::op_call>;
+			case OP_JFALSE:   return jit_call<&Rela::op_jfalse>;
+			case OP_JTRUE:    return jit_call<&Rela::op_jtrue>;
+			case OP_DROP:     return jit_call<&Rela::op_drop>;
+			case OP_ASSIGN:   return jit_call<&Rela::op_assign>;
+			case OP_FIND:     return jit_call<&Rela::op_find>;
+			case OP_GET:      return jit_call<&Rela::op_get>;
+			case OP_SET:      return jit_call<&Rela::op_set>;
+			case OP_ADD:      return jit_call<&Rela::op_add>;
+			case OP_SUB:      return jit_call<&Rela::op_sub>;
+			case OP_MUL:      return jit_call<&Rela::op_mul>;
+			case OP_EQ:       return jit_call<&Rela::op_eq>;
+			case OP_NE:       return jit_call<&Rela::op_ne>;
+			case OP_LT:       return jit_call<&Rela::op_lt>;
+			case OP_GT:       return jit_call<&Rela::op_gt>;
+			case OP_LTE:      return jit_call<&Rela::op_lte>;
+			case OP_GTE:      return jit_call<&Rela::op_gte>;
+			default:          return jit_call_operation;
+		}
+	}
+
+	bool jit_hot(int ip) {
+		if (jit_heat.size() < code.size()) {
+			jit_heat.resize(code.size());
+			natives.resize(code.size());
+		}
+		return ++jit_heat[ip] == JIT_HOT;
+	}
+
+	// push cells rcx,rdx or a literal onto the routine stack
+	void jit_push(jit_asm_t& a, const item_t* lit) {
+		typedef jit_asm_t J;
+		int depth = offsetof(cor_t, stack.depth);
+		int cells = offsetof(cor_t, stack.cells);
+		if (lit) {
+			int64_t half[2];
+			memcpy(half, lit, sizeof(half));
+			a.mov_imm(J::RCX, half[0]);
+			a.mov_imm(J::RDX, half[1]);
+		}
+		a.mem(true, 0x63, J::RAX, J::R14, depth); // movsxd rax, depth
+		a.reg(true, 0xC1, 4, J::RAX); a.b(4);     // shl rax, 4
+		a.reg(true, 0x01, J::R14, J::RAX);        // add rax, r14
+		a.mem(true, 0x89, J::RCX, J::RAX, cells);
+		a.mem(true, 0x89, J::RDX, J::RAX, cells+8);
+		a.mem(false, 0xFF, 0, J::R14, depth);     // inc depth
+	}
+
+	// rax = cor + depth*16, so the top item is at [rax+cells-16]
+	void jit_stack(jit_asm_t& a) {
+		typedef jit_asm_t J;
+		a.mem(true, 0x63, J::RAX, J::R14, offsetof(cor_t, stack.depth));
+		a.reg(true, 0xC1, 4, J::RAX); a.b(4);
+		a.reg(true, 0x01, J::R14, J::RAX);
+	}
+
+	// native code for code[lo,hi)
+	void jit_compile(int lo, int hi, const char* kind) {
+		typedef jit_asm_t J;
+		static_assert(sizeof(item_t) == 16, "jit assumes 16 byte items");
+
+		jit_asm_t a;
+		int ip = offsetof(cor_t, ip);
+		int cells = offsetof(cor_t, stack.cells);
+		int top = cells-16;
+
+		std::vector<int> at(hi-lo);
+		for (auto& l: at) l = a.label();
+		int done = a.label();
+		int spent = a.label();
+		int jump = a.label();
+		int past = a.label();
+		int table = a.label();
+
+		// int64_t fn(rela, budget): rbx = rela, r12 = &routine, r13 = budget, r14 = routine
+		a.b(0x53);
+		a.b(0x41); a.b(0x54);
+		a.b(0x41); a.b(0x55);
+		a.b(0x41); a.b(0x56);
+		a.b(0x41); a.b(0x57);
+		a.reg(true, 0x89, J::RDI, J::RBX);
+		a.reg(true, 0x89, J::RSI, J::R13);
+		a.mem(true, 0x8D, J::R12, J::RBX, (int32_t)((char*)&routine - (char*)this));
+		a.mem(true, 0x8B, J::R14, J::R12, 0);
+		a.jmp(jump);
+
+		for (int i = lo; i < hi; i++) {
+			code_t& c = code[i];
+			int next = i+1 < hi ? at[i+1-lo]: past;
+
+			int target = -1;
+			bool jumps = c.op == OP_JMP || c.op == OP_JFALSE || c.op == OP_JTRUE || (c.op >= OPT_JIEQ && c.op <= OPT_JIGTE);
+			if (jumps && c.item.type == INTEGER && c.item.inum >= lo && c.item.inum < hi)
+				target = at[c.item.inum-lo];
+
+			a.bind(at[i-lo]);
+
+			// left to the interpreter
+			if (c.op == OP_STOP) {
+				a.mem(false, 0xC7, 0, J::R14, ip); a.d(i);
+				a.jmp(done);
+				continue;
+			}
+
+			a.b(0xB9); a.d(i);                    // mov ecx, i
+			a.reg(true, 0xFF, 1, J::R13);         // dec r13
+			a.jcc(J::CC_S, spent);
+
+			if (c.op == OP_JMP) {
+				if (target < 0) {
+					a.mem(false, 0xC7, 0, J::R14, ip); a.d(c.item.inum);
+					a.jmp(done);
+				}
+				else {
+					a.jmp(target);
+				}
+				continue;
+			}
+
+			if (c.op == OP_LIT) {
+				jit_push(a, &c.item);
+				continue;
+			}
+
+			if (c.op == OP_LGET && c.item.type == INTEGER && c.item.inum >= 0 && c.item.inum < LOCALS) {
+				int local = offsetof(cor_t, frames.cells) - sizeof(frame_t) + offsetof(frame_t, locals.cells) + c.item.inum*16;
+				a.mem(true, 0x63, J::RAX, J::R14, offsetof(cor_t, frames.depth));
+				a.reg(true, 0x69, J::RAX, J::RAX); a.d(sizeof(frame_t)); // imul rax, rax, frame
+				a.reg(true, 0x01, J::R14, J::RAX);
+				a.mem(true, 0x8B, J::RCX, J::RAX, local);
+				a.mem(true, 0x8B, J::RDX, J::RAX, local+8);
+				jit_push(a, nullptr);
+				continue;
+			}
+
+			// typed by infer(), so no guards
+			if (c.op == OPT_IADD_LIT) {
+				jit_stack(a);
+				a.mov_imm(J::RCX, c.item.inum);
+				a.mem(true, 0x01, J::RCX, J::RAX, top+8);
+				a.jmp(next);
+				continue;
+			}
+
+			if (c.op == OPT_IADD || c.op == OPT_ISUB) {
+				jit_stack(a);
+				a.mem(true, 0x8B, J::RCX, J::RAX, top+8);
+				a.mem(true, c.op == OPT_IADD ? 0x01: 0x29, J::RCX, J::RAX, top-8); // add/sub a, rcx
+				a.mem(false, 0xFF, 1, J::R14, offsetof(cor_t, stack.depth));
+				a.jmp(next);
+				continue;
+			}
+
+			int slow = a.label();
+
+			if (c.op == OPP_ADD_LIT && c.item.type == INTEGER) {
+				jit_stack(a);
+				a.mem(false, 0x81, 7, J::RAX, top); a.d(INTEGER);
+				a.jcc(J::CC_NE, slow);
+				a.mov_imm(J::RCX, c.item.inum);
+				a.mem(true, 0x01, J::RCX, J::RAX, top+8);
+				a.jmp(next);
+			}
+
+			int cc = -1;
+			if (c.op == OP_EQ || c.op == OPT_IEQ || c.op == OPT_JIEQ) cc = J::CC_E;
+			if (c.op == OP_NE || c.op == OPT_INE || c.op == OPT_JINE) cc = J::CC_NE;
+			if (c.op == OP_LT || c.op == OPT_ILT || c.op == OPT_JILT) cc = J::CC_L;
+			if (c.op == OP_LTE || c.op == OPT_ILTE || c.op == OPT_JILTE) cc = J::CC_LE;
+			if (c.op == OP_GT || c.op == OPT_IGT || c.op == OPT_JIGT) cc = J::CC_G;
+			if (c.op == OP_GTE || c.op == OPT_IGTE || c.op == OPT_JIGTE) cc = J::CC_GE;
+
+			bool typed = c.op >= OPT_IEQ && c.op <= OPT_IGTE;
+			bool fused = c.op >= OPT_JIEQ && c.op <= OPT_JIGTE;
+
+			// both operands gone on success; a false result and the jump on failure
+			if (cc >= 0 && fused && target >= 0) {
+				int fail = a.label();
+				jit_stack(a);
+				a.mem(true, 0x8B, J::RCX, J::RAX, top-8);
+				a.mem(true, 0x3B, J::RCX, J::RAX, top+8);       // cmp rcx, b
+				a.jcc(cc ^ 1, fail);
+				a.mem(false, 0xFF, 1, J::R14, offsetof(cor_t, stack.depth));
+				a.mem(false, 0xFF, 1, J::R14, offsetof(cor_t, stack.depth));
+				a.jmp(next);
+				a.bind(fail);
+				a.mem(true, 0xC7, 0, J::RAX, top-16); a.d(BOOLEAN);
+				a.mem(true, 0xC7, 0, J::RAX, top-8); a.d(0);
+				a.mem(false, 0xFF, 1, J::R14, offsetof(cor_t, stack.depth));
+				a.jmp(target);
+				continue;
+			}
+
+			if (cc >= 0 && !fused) {
+				jit_stack(a);
+				if (!typed) {
+					a.mem(false, 0x81, 7, J::RAX, top-16); a.d(INTEGER);
+					a.jcc(J::CC_NE, slow);
+					a.mem(false, 0x81, 7, J::RAX, top); a.d(INTEGER);
+					a.jcc(J::CC_NE, slow);
+				}
+				a.mem(true, 0x8B, J::RCX, J::RAX, top-8);
+				a.mem(true, 0x3B, J::RCX, J::RAX, top+8);       // cmp rcx, b
+				a.b(0x0F); a.b(0x90 | cc); a.b(0xD2);            // setcc dl
+				a.b(0x0F); a.b(0xB6); a.b(0xD2);                 // movzx edx, dl
+				a.mem(true, 0xC7, 0, J::RAX, top-16); a.d(BOOLEAN);
+				a.mem(true, 0x89, J::RDX, J::RAX, top-8);
+				a.mem(false, 0xFF, 1, J::R14, offsetof(cor_t, stack.depth));
+				a.jmp(next);
+			}
+
+			if ((c.op == OP_JFALSE || c.op == OP_JTRUE) && target >= 0) {
+				jit_stack(a);
+				a.mem(false, 0x81, 7, J::RAX, top); a.d(BOOLEAN);
+				a.jcc(J::CC_NE, slow);
+				a.mem(false, 0x80, 7, J::RAX, top+8); a.b(0); // cmp byte flag, 0
+				a.jcc(c.op == OP_JFALSE ? J::CC_E: J::CC_NE, target);
+				a.jmp(next);
+			}
+
+			// routine->ip = i+1, handler, then carry on unless the
+			// handler failed, switched routine or moved ip
+			a.bind(slow);
+			a.mem(false, 0xC7, 0, J::R14, ip); a.d(i+1);
+			a.reg(true, 0x89, J::RBX, J::RDI);
+			a.call((void*)jit_handler(c.op));
+			a.b(0x84); a.b(0xC0);                       // test al, al
+			a.jcc(J::CC_NE, done);
+			a.mem(true, 0x39, J::R14, J::R12, 0);       // cmp [r12], r14
+			a.jcc(J::CC_NE, done);
+			a.mem(false, 0x81, 7, J::R14, ip); a.d(i+1);
+			a.jcc(J::CC_NE, target >= 0 ? target: jump);
+		}
+
+		// fell off the end of the range
+		a.bind(past);
+		a.mem(false, 0xC7, 0, J::R14, ip); a.d(hi);
+		a.jmp(done);
+
+		// entry, or ip moved by a handler: continue natively if in range
+		a.bind(jump);
+		a.mem(false, 0x8B, J::RCX, J::R14, ip);
+		a.reg(false, 0x81, 5, J::RCX); a.d(lo);              // sub ecx, lo
+		a.reg(false, 0x81, 7, J::RCX); a.d(hi-lo);           // cmp ecx, n
+		a.jcc(J::CC_AE, done);
+		a.b(0x48); a.b(0x8D); a.b(0x15); a.rel(table);      // lea rdx, [rip+table]
+		a.b(0x48); a.b(0x63); a.b(0x0C); a.b(0x8A);         // movsxd rcx, [rdx+rcx*4]
+		a.reg(true, 0x01, J::RDX, J::RCX);                   // add rcx, rdx
+		a.b(0xFF); a.b(0xE1);                                // jmp rcx
+
+		// out of budget before instruction ecx
+		a.bind(spent);
+		a.mem(false, 0x89, J::RCX, J::R14, ip);
+		a.reg(false, 0x31, J::R13, J::R13);
+		a.jmp(done);
+
+		a.bind(done);
+		a.reg(true, 0x89, J::R13, J::RAX);
+		a.b(0x41); a.b(0x5F);
+		a.b(0x41); a.b(0x5E);
+		a.b(0x41); a.b(0x5D);
+		a.b(0x41); a.b(0x5C);
+		a.b(0x5B);
+		a.b(0xC3);
+
+		while (a.bytes.size() % 4) a.b(0xCC);
+		a.bind(table);
+		a.link();
+		for (int i = lo; i < hi; i++)
+			a.d(a.labels[at[i-lo]] - a.labels[table]);
+
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t size = (a.bytes.size() + page-1) / page * page;
+		void* mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) return;
+		memcpy(mem, a.bytes.data(), a.bytes.size());
+		if (mprotect(mem, size, PROT_READ|PROT_EXEC) != 0) {
+			munmap(mem, size);
+			return;
+		}
+		jit_blocks.push_back({mem, size});
+
+		for (int i = lo; i < hi; i++) {
+			if (natives[i] || code[i].op == OP_STOP) continue;
+			natives[i] = (native_fn)mem;
+		}
+
+		// perf(1) symbols, if the host asked for them
+		if (!jit_perf_map) return;
+		if (!jit_perf) {
+			char path[64];
+			snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+			jit_perf = fopen(path, "a");
+		}
+		if (jit_perf) {
+			fprintf(jit_perf, "%lx %zx rela_%s_%d\n", (unsigned long)mem, a.bytes.size(), kind, lo);
+			fflush(jit_perf);
+		}
+	}
+
+	void jit_function(int ip) {
+		if (!jit_hot(ip)) return;
+		code_t& jmp = code[ip-1];
+		if (jmp.op != OP_JMP || jmp.item.type != INTEGER || jmp.item.inum <= ip) return;
+		jit_compile(ip, jmp.item.inum, "fn");
+	}
+
+	// backward OP_JMP at ip, already taken
+	void jit_loop(int ip) {
+		if (jit_hot(ip)) jit_compile(code[ip].item.inum, ip+1, "loop");
+	}
+
+	void jit_release() {
+		for (auto& block: jit_blocks) munmap(block.mem, block.size);
+		jit_blocks.clear();
+		jit_heat.clear();
+		if (jit_perf) fclose(jit_perf);
+		jit_perf = nullptr;
+	}
+#endif
+
+	int64_t nanos() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	// Run for up to ticks and until deadline. Nested execution, which
+	// cannot pause, may run past ticks, and *over receives the number it
+	// used beyond it. It fails once it uses NEST_SPARE more than allow, the
+	// host's whole budget (-1 unlimited), or runs past the deadline.
+	bool tick_until(int64_t& ticks, int64_t deadline, int64_t allow, int64_t* over = nullptr) {
+		int64_t past = 0;
+		nest.spent = 0;
+		nest.total = 0;
+		nest.limit = allow < 0 ? -1: allow + NEST_SPARE;
+		nest.deadline = deadline;
+		bool done = tick_chunks(ticks, deadline, past);
+		nest_clear();
+		if (over) *over = past;
+		return done;
+	}
+
+	void nest_clear() {
+		nest.spent = 0;
+		nest.total = 0;
+		nest.limit = -1;
+		nest.deadline = 0;
+	}
+
+	// tick_all() in SLICE sized chunks checking the clock in between
+	bool tick_chunks(int64_t& ticks, int64_t deadline, int64_t& over) {
+		if (!deadline) {
+			bool done = tick_all(ticks);
+			over = nest.spent;
+			return done;
+		}
+
+		for (;;) {
+			int64_t chunk = ticks < 0 || ticks > SLICE ? SLICE: ticks;
+			int64_t left = chunk;
+			bool done = tick_all(left);
+			if (ticks > 0) {
+				ticks -= chunk - left;
+				// nested ticks past the end of the chunk
+				int64_t rest = std::min(ticks, nest.spent);
+				ticks -= rest;
+				over += nest.spent - rest;
+			}
+			nest.spent = 0;
+			if (done) return true;
+			if (!ticks || nanos() >= deadline) return false;
+		}
+	}
+
 	void method(item_t func, int argc, item_t* argv, int retc, item_t* retv) {
 		must(func.type == SUBROUTINE || func.type == EXECUTE, "invalid method");
 
@@ -3608,21 +8587,103 @@ class Rela {
 
 		for (int i = 0; i < argc; i++) push(argv[i]);
 
-		call(func);
+		nesting++;
+		call(func);
+
+		if (func.type == SUBROUTINE) {
+			while (tick_nested()) {
+				if (routine != cor) continue;
+				if (frame < cor->frames.depth) continue;
+				break;
+			}
+		}
+		nesting--;
+
+		for (int i = 0; i < retc; i++) {
+			retv[i] = i < depth() ? *item(i): nil();
+		}
+
+		limit(0);
+	}
+
+	void task_ready(int id) {
+		task_t* task = &tasks[id];
+		task->state = TASK_READY;
+		ready[task->priority].push_back(id);
+	}
+
+	void task_park(int id, item_t event) {
+		task_t* task = &tasks[id];
+		task->state = TASK_PARKED;
+		task->event = event;
+		if (event.type == NIL) return;
+
+		item_t* list = map_ref(&waiting, event);
+		if (!list) {
+			map_set(&waiting, event, (item_t){.type = VECTOR, .vec = vec_allot()});
+			list = map_ref(&waiting, event);
+		}
+		vec_push(list->vec, integer(id));
+	}
+
+	void task_unpark(int id) {
+		task_t* task = &tasks[id];
+		item_t* list = task->event.type != NIL ? map_ref(&waiting, task->event): nullptr;
+		if (list) {
+			auto& ids = list->vec->items;
+			for (int i = 0, l = ids.size(); i < l; i++) {
+				if (ids[i].inum == id) { ids.erase(ids.begin()+i); break; }
+			}
+			if (!ids.size()) map_clr(&waiting, task->event);
+		}
+		task->event = nil();
+	}
+
+	void task_free(int id) {
+		tasks[id] = task_t();
+		tasks_free.push_back(id);
+	}
+
+	// base routine ip points at the code[0] halt sentinel, so a task that
+	// yields, waits or dies stops tick_all()
+	void task_enter(task_t* task, cor_t* base) {
+		base->ip = 0;
+
+		if (task->chain.size()) {
+			for (auto& item: task->chain) vec_push(&routines, item);
+			task->chain.clear();
+			routine = vec_top(&routines).cor;
+		}
+		else {
+			vec_push(&routines, (item_t){.type = COROUTINE, .cor = task->cor});
+			routine = task->cor;
+			routine->state = COR_RUNNING;
+		}
+
+		for (auto& item: task->inbox) push(item);
+		task->inbox.clear();
+	}
+
+	// preempted mid-turn: keep the task's resume/yield chain for later
+	void task_leave(task_t* task, cor_t* base) {
+		task->chain.assign(routines.items.begin()+1, routines.items.end());
+		routines.items.resize(1);
+		routine = base;
+	}
 
-		if (func.type == SUBROUTINE) {
-			while (tick()) {
-				if (routine != cor) continue;
-				if (frame < cor->frames.depth) continue;
-				break;
-			}
-		}
+	std::vector<int> all_modules() {
+		std::vector<int> mods;
+		for (int i = 0, l = modules.size(); i < l; i++) mods.push_back(i);
+		return mods;
+	}
 
-		for (int i = 0; i < retc; i++) {
-			retv[i] = i < depth() ? *item(i): nil();
-		}
+	void span_type(const char* what, item_t item) {
+		char tmp[STRTMP];
+		must(false, "%s: %s", what, tmptext(item, tmp, sizeof(tmp)));
+	}
 
-		limit(0);
+	void span_range(int i, int count) {
+		must(false, "span index %d out of range (%d)", i, count);
 	}
 
 public:
@@ -3641,6 +8702,47 @@ public:
 			map_set(lib.map, string("coroutine"), operation(OP_COROUTINE));
 			map_set(lib.map, string("resume"), operation(OP_RESUME));
 			map_set(lib.map, string("yield"), operation(OP_YIELD));
+			map_set(lib.map, string("wait"), operation(OP_WAIT));
+			map_set(lib.map, string("array"), operation(OP_ARRAY));
+			map_set(lib.map, string("sum"), operation(OP_SUM));
+			map_set(lib.map, string("dot"), operation(OP_DOT));
+			map_set(lib.map, string("argmin"), operation(OP_ARGMIN));
+			map_set(lib.map, string("argmax"), operation(OP_ARGMAX));
+			map_set(lib.map, string("scale"), operation(OP_SCALE));
+			map_set(lib.map, string("add"), operation(OP_VADD));
+			map_set(lib.map, string("axpy"), operation(OP_AXPY));
+			map_set(lib.map, string("clamp"), operation(OP_CLAMP));
+			map_set(lib.map, string("prefix"), operation(OP_PREFIX));
+			map_set(lib.map, string("bytes"), operation(OP_BYTES));
+			map_set(lib.map, string("slice"), operation(OP_SLICE));
+			map_set(lib.map, string("peek"), operation(OP_PEEK));
+			map_set(lib.map, string("poke"), operation(OP_POKE));
+
+			item_t str = (item_t){.type = MAP, .map = map_allot()};
+			map_set(str.map, string("split"), operation(OP_STR_SPLIT));
+			map_set(str.map, string("join"), operation(OP_STR_JOIN));
+			map_set(str.map, string("find"), operation(OP_STR_FIND));
+			map_set(str.map, string("rfind"), operation(OP_STR_RFIND));
+			map_set(str.map, string("replace"), operation(OP_STR_REPLACE));
+			map_set(str.map, string("starts"), operation(OP_STR_STARTS));
+			map_set(str.map, string("ends"), operation(OP_STR_ENDS));
+			map_set(str.map, string("trim"), operation(OP_STR_TRIM));
+			map_set(str.map, string("upper"), operation(OP_STR_UPPER));
+			map_set(str.map, string("lower"), operation(OP_STR_LOWER));
+			map_set(str.map, string("format"), operation(OP_STR_FORMAT));
+			map_set(lib.map, string("str"), str);
+
+			item_t json = (item_t){.type = MAP, .map = map_allot()};
+			map_set(json.map, string("decode"), operation(OP_JSON_DECODE));
+			map_set(json.map, string("encode"), operation(OP_JSON_ENCODE));
+			map_set(json.map, string("lines"), operation(OP_JSON_LINES));
+			map_set(lib.map, string("json"), json);
+
+			item_t csv = (item_t){.type = MAP, .map = map_allot()};
+			map_set(csv.map, string("rows"), operation(OP_CSV_ROWS));
+			map_set(csv.map, string("columns"), operation(OP_CSV_COLUMNS));
+			map_set(lib.map, string("csv"), csv);
+
 			map_set(lib.map, string("setmeta"), operation(OP_META_SET));
 			map_set(lib.map, string("getmeta"), operation(OP_META_GET));
 			map_set(lib.map, string("sort"), operation(OP_SORT));
@@ -3669,6 +8771,10 @@ public:
 
 			map_set(scope_core, string("print"), operation(OP_PRINT));
 
+			// halt sentinel for scheduled tasks
+			compile(OP_STOP, nil());
+			compile_barrier();
+
 			stringsB.merge(stringsA);
 			gc();
 		}
@@ -3691,6 +8797,7 @@ public:
 
 		int mod = modules.size();
 		modules.push_back(code.size());
+		compile_barrier();
 		source(src);
 		assert(!routine->stack.depth);
 		compile(OP_STOP, nil());
@@ -3699,10 +8806,17 @@ public:
 		vec_pop(&routines);
 		routine = nullptr;
 		nodes.clear();
+		inlines.clear();
 
 		stringsB.merge(stringsA);
 		gc();
 
+		// native code from a linked transpile() unit, if one matches
+		if (transpiled_units().size()) {
+			uint64_t hash = code_hash();
+			for (auto link: transpiled_units()) if (link(*this, hash)) break;
+		}
+
 		return mod;
 	}
 
@@ -3710,6 +8824,14 @@ public:
 		for (auto& c: code) {
 			char tmp[STRTMP];
 			const char *str = tmptext(c.item, tmp, sizeof(tmp));
+			int64_t x = c.item.inum;
+			if (c.op == OPR_MOVE)
+				snprintf(tmp, sizeof(tmp), "r%d r%d", (int)(x&255), (int)(x>>8&255));
+			if (c.op > OPR_POP && c.op <= OPR_GTE)
+				snprintf(tmp, sizeof(tmp), "r%d r%d r%d", (int)(x&255), (int)(x>>8&255), (int)(x>>16&255));
+			if (c.op >= OPR_TEQ && c.op <= OPR_TGTE)
+				snprintf(tmp, sizeof(tmp), "r%d r%d else %d", (int)(x&255), (int)(x>>8&255), (int)(x>>16));
+			if (c.op >= OPR_MOVE && c.op <= OPR_TGTE && c.op != OPR_POP) str = tmp;
 			fprintf(stderr, "%04ld  %-10s  %s", &c - code.data(), operation_name(c.op), str);
 			if (c.op == OP_ENTER) for (auto& local: scopes[c.item.inum].locals) fprintf(stderr, " l:%s", local);
 			if (c.op == OP_ENTER) for (auto& id: scopes[c.item.inum].up) fprintf(stderr, " u:%d", id);
@@ -3718,29 +8840,196 @@ public:
 		}
 	}
 
+	// Specialized by transpile() output; members may use Rela internals
+	template <class T> struct transpiled;
+
+	static bool transpiled_unit(transpiled_fn link) {
+		transpiled_units().push_back(link);
+		return true;
+	}
+
+	// Write C++ for all code compiled so far: one function per outermost
+	// subroutine and per module's top level, with static jumps as gotos and
+	// handlers called directly. Linked into a host, it is used whenever the
+	// host compiles exactly the same code; otherwise the host interprets.
+	void transpile(FILE* out, const char* name) {
+		std::vector<int> owner(code.size(), -1);
+		int blocks = 0;
+
+		for (int m = 0, l = modules.size(); m < l; m++) {
+			int lo = modules[m];
+			int hi = m+1 < l ? modules[m+1]: code.size();
+			int top = blocks++;
+			for (int i = lo; i < hi; i++) {
+				code_t& jmp = code[i-1];
+				if (i > lo && code[i].op == OP_ENTER && jmp.op == OP_JMP && jmp.item.type == INTEGER && jmp.item.inum > i && jmp.item.inum <= hi) {
+					int fn = blocks++;
+					while (i < jmp.item.inum) owner[i++] = fn;
+					i--;
+					continue;
+				}
+				owner[i] = top;
+			}
+		}
+
+		fprintf(out, "// generated by Rela::transpile()\n");
+		fprintf(out, "#include \"rela.hpp\"\n\n");
+		fprintf(out, "struct %s;\n\n", name);
+		fprintf(out, "template <> struct Rela::transpiled<%s> {\n", name);
+
+		for (int b = 0; b < blocks; b++) {
+			auto local = [&](int ip) {
+				return ip >= 0 && ip < (int)code.size() && owner[ip] == b && code[ip].op != OP_STOP;
+			};
+
+			bool dispatch = false;
+			std::string body;
+			char line[256];
+
+			for (int i = 0, l = code.size(); i < l; i++) {
+				if (owner[i] != b) continue;
+				code_t& c = code[i];
+
+				if (c.op == OP_STOP) {
+					snprintf(line, sizeof(line), "\t\tcor->ip = %d;\n\t\treturn budget;\n", i);
+					body += line;
+					continue;
+				}
+
+				snprintf(line, sizeof(line), "\tL%d:\n\t\tif (--budget < 0) { cor->ip = %d; return 0; }\n", i, i);
+				body += line;
+
+				int target = transpile_target(i);
+
+				if (c.op == OP_JMP) {
+					if (local(target))
+						snprintf(line, sizeof(line), "\t\tgoto L%d;\n", target);
+					else
+						snprintf(line, sizeof(line), "\t\tcor->ip = %d;\n\t\treturn budget;\n", target);
+					body += line;
+					continue;
+				}
+
+				snprintf(line, sizeof(line), "\t\tcor->ip = %d;\n", i+1);
+				body += line;
+
+				const char* handler = transpile_handler(c.op);
+				if (handler)
+					snprintf(line, sizeof(line), "\t\trela->%s();\n", handler);
+				else
+					snprintf(line, sizeof(line), "\t\trela->operation_call((opcode_t)%d); // %s\n", c.op, operation_name(c.op));
+				body += line;
+
+				if (!transpile_plain(c.op)) {
+					body += "\t\tif (rela->routine != cor) return budget;\n";
+					if (local(target)) {
+						snprintf(line, sizeof(line), "\t\tif (cor->ip != %d) goto L%d;\n", i+1, target);
+					}
+					else {
+						snprintf(line, sizeof(line), "\t\tif (cor->ip != %d) goto jump;\n", i+1);
+						dispatch = true;
+					}
+					body += line;
+				}
+
+				if (!local(i+1) && (i+1 >= l || owner[i+1] != b || code[i+1].op != OP_STOP))
+					body += "\t\treturn budget;\n";
+			}
+
+			fprintf(out, "\tstatic int64_t block_%d(Rela* rela, int64_t budget) {\n", b);
+			fprintf(out, "\t\tcor_t* cor = rela->routine;\n");
+			if (dispatch) fprintf(out, "\tjump:\n");
+			fprintf(out, "\t\tswitch (cor->ip) {\n");
+			for (int i = 0, l = code.size(); i < l; i++) {
+				if (local(i)) fprintf(out, "\t\t\tcase %d: goto L%d;\n", i, i);
+			}
+			fprintf(out, "\t\t\tdefault: return budget;\n");
+			fprintf(out, "\t\t}\n");
+			fputs(body.c_str(), out);
+			fprintf(out, "\t}\n\n");
+		}
+
+		fprintf(out, "\tstatic bool link(Rela& rela, uint64_t hash) {\n");
+		fprintf(out, "\t\tif (rela.code.size() != %zu || hash != 0x%llxull) return false;\n", code.size(), (unsigned long long)code_hash());
+		fprintf(out, "\t\tstatic const native_fn blocks[] = {");
+		for (int b = 0; b < blocks; b++) fprintf(out, "%sblock_%d", b ? ", ": "", b);
+		fprintf(out, "};\n");
+		fprintf(out, "\t\tstatic const int owners[] = {");
+		for (int i = 0, l = code.size(); i < l; i++) {
+			fprintf(out, "%s%s%d", i ? ",": "", i % 32 ? "": "\n\t\t\t", code[i].op == OP_STOP ? -1: owner[i]);
+		}
+		fprintf(out, "\n\t\t};\n");
+		fprintf(out, "\t\trela.natives.resize(rela.code.size());\n");
+		fprintf(out, "\t\tfor (size_t i = 0; i < rela.code.size(); i++) {\n");
+		fprintf(out, "\t\t\tif (owners[i] >= 0) rela.natives[i] = blocks[owners[i]];\n");
+		fprintf(out, "\t\t}\n");
+		fprintf(out, "\t\treturn true;\n");
+		fprintf(out, "\t}\n");
+		fprintf(out, "};\n\n");
+		fprintf(out, "static bool %s_linked = Rela::transpiled_unit(Rela::transpiled<%s>::link);\n", name, name);
+	}
+
 	virtual ~Rela() {
 		destroy();
 	}
 
+	static const int RUN_DONE = 0;
+	static const int RUN_ERROR = 1;
+	static const int RUN_PAUSED = 2;
+
 	int run() {
-		return run(modules);
+		return run(all_modules());
 	}
 
 	int run(const std::vector<int>& mods) {
+		start(mods);
+		int rc = resume(0);
+		if (rc == RUN_DONE) rc = schedule(0);
+		stop();
+		return rc == RUN_DONE ? 0: 1;
+	}
+
+	void start() {
+		start(all_modules());
+	}
+
+	// Prepare a fresh run-time state for resume(). Nothing executes yet.
+	void start(const std::vector<int>& mods) {
+		stop();
+		vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor_allot()});
+		routine = vec_top(&routines).cor;
+		scope_global = map_allot();
+
+		session.mods = mods;
+		session.next = 0;
+		session.ticking = false;
+		session.active = true;
+	}
+
+	// Execute until the modules complete (RUN_DONE), an error occurs
+	// (RUN_ERROR, run-time state released) or the budget of VM instructions
+	// and/or nanoseconds runs out (RUN_PAUSED). A budget <= 0 is unlimited.
+	// After RUN_PAUSED the host may resume() again later, or stop().
+	int resume(int64_t ticks, int64_t nsecs = 0) {
 		std::string msg;
 		try {
-			vec_push(&routines, (item_t){.type = COROUTINE, .cor = cor_allot()});
-			routine = vec_top(&routines).cor;
-			scope_global = map_allot();
-
-			for (auto mod: mods) {
-				must(!routine->frames.depth, "frame exists mod %d\n", mod);
-				must(mod < (int)modules.size(), "invalid module %d", mod);
-				routine->ip = modules[mod];
-				tick_all();
+			must(session.active, "resume without start");
+
+			if (ticks <= 0) ticks = -1;
+			int64_t deadline = nsecs > 0 ? nanos() + nsecs: 0;
+
+			for (;;) {
+				if (!session.ticking) {
+					if (session.next == (int)session.mods.size()) return RUN_DONE;
+					int mod = session.mods[session.next++];
+					must(!routine->frames.depth, "frame exists mod %d\n", mod);
+					must(mod < (int)modules.size(), "invalid module %d", mod);
+					routine->ip = modules[mod];
+					session.ticking = true;
+				}
+				if (!tick_until(ticks, deadline, ticks)) return RUN_PAUSED;
+				session.ticking = false;
 			}
-			reset();
-			return 0;
 		}
 		catch (const std::exception& e) {
 			msg = e.what();
@@ -3751,15 +9040,338 @@ public:
 		fprintf(stderr, "%s (", msg.c_str());
 		fprintf(stderr, "ip %d", vec_size(&routines) ? routine->ip: -1);
 		fprintf(stderr, ")\n");
-		reset();
-		return 1;
+		stop();
+		return RUN_ERROR;
 	}
 
+	// Release run-time state, abandoning any paused run
+	void stop() {
+		if (session.active) reset();
+		nesting = 0;
+		nest_clear();
+		session.mods.clear();
+		session.next = 0;
+		session.ticking = false;
+		session.active = false;
+	}
+
+
 	// Opaque type, use functions to access
 	typedef struct {
 		unsigned char raw[32];
 	} oitem;
 
+	// Zero-copy view of a callback's arguments in place on the VM stack.
+	// Valid until the callback returns or calls back into the VM. Call
+	// ret(n) to size the frame to n results, then write them with set_*().
+	class span {
+		friend class Rela;
+		Rela* rela = nullptr;
+		item_t* cells = nullptr;
+		int count = 0;
+
+		item_t get(int i) const {
+			return i >= 0 && i < count ? cells[i]: item_t();
+		}
+
+		item_t* cell(int i) {
+			if (i < 0 || i >= count) rela->span_range(i, count);
+			return &cells[i];
+		}
+
+	public:
+		int size() const {
+			return count;
+		}
+
+		oitem operator[](int i) const {
+			return rela->smudge(get(i));
+		}
+
+		bool is_nil(int i) const { return get(i).type == NIL; }
+		bool is_bool(int i) const { return get(i).type == BOOLEAN; }
+		bool is_integer(int i) const { return get(i).type == INTEGER; }
+		bool is_number(int i) const { return get(i).type == INTEGER || get(i).type == FLOAT; }
+		bool is_string(int i) const { return rela->is_text(get(i)); }
+		bool is_data(int i) const { return get(i).type == USERDATA; }
+
+		bool to_bool(int i) const {
+			item_t item = get(i);
+			if (item.type != BOOLEAN) rela->span_type("not a boolean", item);
+			return item.flag;
+		}
+
+		int64_t to_integer(int i) const {
+			item_t item = get(i);
+			if (item.type != INTEGER) rela->span_type("not an integer", item);
+			return item.inum;
+		}
+
+		double to_number(int i) const {
+			item_t item = get(i);
+			if (item.type == FLOAT) return item.fnum;
+			if (item.type != INTEGER) rela->span_type("not a number", item);
+			return item.inum;
+		}
+
+		const char* to_string(int i) const {
+			item_t item = get(i);
+			if (!rela->is_text(item)) rela->span_type("not a string", item);
+			return rela->text_intern(item).str;
+		}
+
+		void* to_data(int i) const {
+			item_t item = get(i);
+			if (item.type != USERDATA) rela->span_type("not user data", item);
+			return item.data->ptr;
+		}
+
+		void ret(int n) {
+			cor_t* cor = rela->routine;
+			int base = cells - cor->stack.cells;
+			if (n < 0 || base + n > (int)STACK) rela->span_range(n, STACK - base);
+			for (int i = count; i < n; i++) cells[i] = item_t();
+			cor->stack.depth = base + n;
+			count = n;
+		}
+
+		void set(int i, oitem val) { *cell(i) = rela->polish(val); }
+		void set_nil(int i) { *cell(i) = item_t(); }
+		void set_bool(int i, bool flag) { *cell(i) = (item_t){.type = BOOLEAN, .flag = flag}; }
+		void set_integer(int i, int64_t val) { *cell(i) = (item_t){.type = INTEGER, .inum = val}; }
+		void set_number(int i, double val) { *cell(i) = (item_t){.type = FLOAT, .fnum = val}; }
+		void set_string(int i, const char* str) { *cell(i) = rela->string(str); }
+	};
+
+	// Arguments of the current callback
+	span args() {
+		must(routine, "no routine");
+		span view;
+		view.rela = this;
+		view.count = depth();
+		view.cells = &routine->stack.cells[routine->stack.depth - view.count];
+		return view;
+	}
+
+	static const int TASK_FREE = 0;
+	static const int TASK_READY = 1;
+	static const int TASK_PARKED = 2;
+	static const int TASK_PENDING = 3;
+
+	// default ticks per task turn
+	static const int64_t QUANTUM = 10000;
+
+	// Create a task running func(argv...) as a coroutine. Tasks execute
+	// only via schedule() and are released by stop(). Returns a handle.
+	int spawn(oitem func, int priority = 0, int argc = 0, oitem* argv = nullptr) {
+		must(session.active, "spawn without start");
+		item_t sub = polish(func);
+		must(sub.type == SUBROUTINE, "spawn missing subroutine");
+
+		int id = tasks.size();
+		if (tasks_free.size()) {
+			id = tasks_free.back();
+			tasks_free.pop_back();
+		}
+		else {
+			tasks.emplace_back();
+		}
+
+		task_t* task = &tasks[id];
+		task->cor = cor_allot();
+		task->priority = priority;
+
+		cor_t* caller = routine;
+		routine = task->cor;
+		arrive(sub.sub);
+		op_mark();
+		for (int i = 0; i < argc; i++) push(polish(argv[i]));
+		routine = caller;
+
+		task_ready(id);
+		return id;
+	}
+
+	// Run ready tasks after the modules complete: higher priority first,
+	// round-robin within a priority. A turn ends when the task yields,
+	// waits, finishes or uses quantum ticks (<= 0 for no limit). Returns
+	// RUN_DONE when no task is ready, RUN_PAUSED when the budget runs out
+	// or RUN_ERROR when a task fails, in which case only that task is
+	// released. Parked tasks remain until wake() or signal().
+	int schedule(int64_t ticks, int64_t nsecs = 0, int64_t quantum = QUANTUM) {
+		std::string msg;
+		cor_t* base = nullptr;
+		int floor = 0;
+		int id = -1;
+		try {
+			must(session.active && !session.ticking && vec_size(&routines) == 1, "schedule outside a completed run");
+
+			base = routine;
+			floor = base->stack.depth;
+
+			if (ticks <= 0) ticks = -1;
+			int64_t deadline = nsecs > 0 ? nanos() + nsecs: 0;
+
+			for (;;) {
+				if (ready.empty()) return RUN_DONE;
+				if (!ticks || (deadline && nanos() >= deadline)) return RUN_PAUSED;
+
+				auto& queue = std::prev(ready.end())->second;
+				id = queue.front();
+				task_t* task = &tasks[id];
+
+				int64_t allow = quantum > 0 ? quantum - task->spent: -1;
+				int64_t slice = ticks < 0 || (allow >= 0 && allow < ticks) ? allow: ticks;
+				int64_t left = slice;
+
+				task_enter(task, base);
+				running = id;
+				// nested execution that cannot pause may run past the slice,
+				// capped by the host's budget, and the overrun is charged to
+				// the task and that budget
+				int64_t over = 0;
+				bool stopped = tick_until(left, deadline, ticks, &over);
+				running = -1;
+
+				int64_t used = slice < 0 ? 0: slice - left + over;
+				if (ticks > 0) ticks = std::max<int64_t>(0, ticks - used);
+				task->spent += used;
+
+				// out of budget just before reaching the halt sentinel counts
+				// as the end of the turn
+				if (!stopped && vec_size(&routines) > 1) {
+					task_leave(task, base);
+					// budget exhaustion leaves the task at the head of the queue
+					if (quantum > 0 && task->spent >= quantum) {
+						queue.pop_front();
+						queue.push_back(id);
+						task->spent = 0;
+					}
+					continue;
+				}
+
+				queue.pop_front();
+				if (!queue.size()) ready.erase(task->priority);
+				task->spent = 0;
+
+				int count = base->stack.depth - floor;
+				item_t* yielded = &base->stack.cells[floor];
+
+				if (task->state == TASK_PENDING) {
+					// suspended in a callback by pending()
+				}
+				else
+				if (task->cor->state == COR_DEAD) {
+					task_free(id);
+				}
+				else
+				if (count && yielded[0].type == OPERATION && yielded[0].opcode == OP_WAIT) {
+					task_park(id, count > 1 ? yielded[1]: nil());
+				}
+				else {
+					task_ready(id);
+				}
+
+				base->stack.depth = floor;
+				id = -1;
+			}
+		}
+		catch (const std::exception& e) {
+			msg = e.what();
+		}
+		catch (...) {
+			msg = "unknown error";
+		}
+		fprintf(stderr, "%s (", msg.c_str());
+		fprintf(stderr, "ip %d", vec_size(&routines) ? routine->ip: -1);
+		fprintf(stderr, ")\n");
+
+		running = -1;
+		nesting = 0;
+		nest_clear();
+
+		if (base) {
+			routines.items.resize(1);
+			routine = base;
+			base->stack.depth = floor;
+		}
+
+		if (id >= 0) {
+			auto& queue = ready[tasks[id].priority];
+			queue.erase(std::remove(queue.begin(), queue.end(), id), queue.end());
+			if (!queue.size()) ready.erase(tasks[id].priority);
+			task_free(id);
+		}
+		return RUN_ERROR;
+	}
+
+	// Make a parked task ready; values become the results of lib.wait()
+	void wake(int id, int count = 0, oitem* values = nullptr) {
+		must(id >= 0 && id < (int)tasks.size() && tasks[id].state == TASK_PARKED, "wake invalid task %d", id);
+		task_unpark(id);
+		for (int i = 0; i < count; i++) tasks[id].inbox.push_back(polish(values[i]));
+		task_ready(id);
+	}
+
+	// Called from execute() by a scheduled task to defer its results. The
+	// callback returns normally having produced nothing and the task is
+	// suspended until complete(token, ...) supplies the results. The token
+	// combines a per-call sequence number with the task id, so a token
+	// for a call already completed, or for a task since freed and its id
+	// reused, is rejected. Not allowed under a meta-method, sort comparator
+	// or iterator function, which run to completion on the C++ stack via
+	// method().
+	int64_t pending() {
+		must(running >= 0, "pending outside a scheduled task");
+		must(!nesting, "pending inside a meta-method, comparator or iterator");
+		task_t* task = &tasks[running];
+		must(task->state == TASK_READY, "task already pending");
+
+		op_clean();
+		task->state = TASK_PENDING;
+		task->chain.assign(routines.items.begin()+1, routines.items.end());
+		routines.items.resize(1);
+		routine = vec_top(&routines).cor;
+		task->token = (++calls << 32) | running;
+		return task->token;
+	}
+
+	// Whether a callback may call pending() now; if not it must produce
+	// its results before returning
+	bool deferrable() {
+		return running >= 0 && !nesting && tasks[running].state == TASK_READY;
+	}
+
+	// Deliver the results of a pending() callback and make the task ready
+	void complete(int64_t token, int count = 0, oitem* values = nullptr) {
+		int id = token & 0xffffffff;
+		must(token > 0 && id < (int)tasks.size() && tasks[id].state == TASK_PENDING && tasks[id].token == token,
+			"complete invalid or stale token %lld", (long long)token);
+		tasks[id].token = 0;
+		for (int i = 0; i < count; i++) tasks[id].inbox.push_back(polish(values[i]));
+		task_ready(id);
+	}
+
+	// Wake all tasks parked on event. Returns the number woken.
+	int signal(oitem event, int count = 0, oitem* values = nullptr) {
+		item_t key = polish(event);
+		item_t* list = map_ref(&waiting, key);
+		if (!list) return 0;
+
+		std::vector<item_t> ids = list->vec->items;
+		map_clr(&waiting, key);
+
+		for (auto& id: ids) {
+			tasks[id.inum].event = nil();
+			wake(id.inum, count, values);
+		}
+		return ids.size();
+	}
+
+	int task_state(int id) {
+		return id >= 0 && id < (int)tasks.size() ? tasks[id].state: TASK_FREE;
+	}
+
 	virtual void execute(int fid) {
 		must(false, "invalid execute");
 	}
@@ -3869,6 +9481,26 @@ public:
 		return smudge((item_t){.type = USERDATA, .data = data});
 	}
 
+	static const int ARRAY_F64 = 0;
+	static const int ARRAY_I64 = 1;
+	static const int ARRAY_I32 = 2;
+	static const int ARRAY_F32 = 3;
+
+	// Typed array of count zeroed elements
+	oitem make_array(int kind, size_t count) {
+		must(kind >= ARRAY_F64 && kind <= ARRAY_F32, "invalid array kind %d", kind);
+		arr_t* arr = arr_allot(kind);
+		arr_resize(arr, count);
+		return smudge((item_t){.type = ARRAY, .arr = arr});
+	}
+
+	// Byte buffer holding a copy of len bytes from src, or zeroed if null
+	oitem make_bytes(const void* src, size_t len) {
+		buf_t* buf = buf_allot(len);
+		if (src) memcpy(buf_data(buf), src, len);
+		return smudge((item_t){.type = BYTES, .buf = buf});
+	}
+
 	oitem make_function(int id) {
 		return smudge((item_t){.type = EXECUTE, .function = id});
 	}
@@ -3895,7 +9527,7 @@ public:
 
 	bool is_string(oitem opaque) {
 		item_t item = polish(opaque);
-		return item.type == STRING;
+		return is_text(item);
 	}
 
 	bool is_data(oitem opaque) {
@@ -3908,6 +9540,16 @@ public:
 		return item.type == VECTOR;
 	}
 
+	bool is_array(oitem opaque) {
+		item_t item = polish(opaque);
+		return item.type == ARRAY;
+	}
+
+	bool is_bytes(oitem opaque) {
+		item_t item = polish(opaque);
+		return item.type == BYTES;
+	}
+
 	bool is_map(oitem opaque) {
 		item_t item = polish(opaque);
 		return item.type == MAP;
@@ -3974,6 +9616,40 @@ public:
 		return smudge((item_t){.type = MAP, .map = map_ref(scope_core, string("lib"))->map});
 	}
 
+	// Parse JSON text into maps, vectors and scalars
+	// decoded strings may be views of the text, so the host's buffer is
+	// copied into storage Rela owns first
+	oitem decode_json(const char* str, size_t len) {
+		char* copy = texts.alloc(len);
+		memcpy(copy, str, len);
+		return smudge(json_decode(copy, len));
+	}
+
+	std::string encode_json(oitem opaque) {
+		std::string out;
+		json_encode(out, polish(opaque), 0);
+		return out;
+	}
+
+	// Compile later modules with register instructions where possible
+	void enable_registers() {
+		registers = true;
+	}
+
+	// List JIT compiled code in /tmp/perf-<pid>.map for perf(1)
+	void enable_perf_map() {
+#ifdef JIT
+		jit_perf_map = true;
+#endif
+	}
+
+	// Scripts only get file access via lib.io if the host opts in
+	void enable_io() {
+		item_t io = (item_t){.type = MAP, .map = map_allot()};
+		map_set(io.map, string("lines"), operation(OP_IO_LINES));
+		map_set(map_ref(scope_core, string("lib"))->map, string("io"), io);
+	}
+
 	const char* to_text(oitem opaque, char* tmp, size_t size) {
 		item_t item = polish(opaque);
 		return tmptext(item, tmp, size);
@@ -4003,8 +9679,29 @@ public:
 	const char* to_string(oitem opaque) {
 		item_t item = polish(opaque);
 		char tmp[STRTMP];
-		must(item.type == STRING, "not a string: %s", tmptext(item, tmp, sizeof(tmp)));
-		return item.str;
+		must(is_text(item), "not a string: %s", tmptext(item, tmp, sizeof(tmp)));
+		return text_intern(item).str;
+	}
+
+	// Raw element storage of a typed array, valid until it is resized by
+	// the script or collected
+	void* array_data(oitem opaque, size_t* count = nullptr, int* kind = nullptr) {
+		item_t item = polish(opaque);
+		char tmp[STRTMP];
+		must(item.type == ARRAY, "not an array: %s", tmptext(item, tmp, sizeof(tmp)));
+		if (count) *count = arr_size(item.arr);
+		if (kind) *kind = item.arr->kind;
+		return item.arr->bytes.data();
+	}
+
+	// Raw bytes of a buffer or slice, shared with any other slices of the
+	// same storage and valid until appended to or collected
+	unsigned char* bytes_data(oitem opaque, size_t* len = nullptr) {
+		item_t item = polish(opaque);
+		char tmp[STRTMP];
+		must(item.type == BYTES, "not bytes: %s", tmptext(item, tmp, sizeof(tmp)));
+		if (len) *len = item.buf->len;
+		return buf_data(item.buf);
 	}
 
 	void* to_data(oitem opaque) {
@@ -4020,5 +9717,192 @@ public:
 		meta_set(ditem, mitem);
 	}
 
+	// Register a host callable as a script function: a function pointer,
+	// lambda or std::function. A void() callable manages the stack itself,
+	// like execute(). Any other signature has its arguments unpacked from
+	// the callback frame and its result returned automatically.
+	template <typename F>
+	oitem make_callback(F fn) {
+		return callable(std::function(fn));
+	}
+
+	// Register a member function of obj
+	template <class C, typename R, typename... A>
+	oitem make_callback(C* obj, R (C::*fn)(A...)) {
+		return callable(std::function<R(A...)>([obj,fn](A... args) { return (obj->*fn)(args...); }));
+	}
+
+	template <class C, typename R, typename... A>
+	oitem make_callback(C* obj, R (C::*fn)(A...) const) {
+		return callable(std::function<R(A...)>([obj,fn](A... args) { return (obj->*fn)(args...); }));
+	}
+
+	// Bind a function known at compile time as a core name, with typed
+	// argument extraction generated from its signature. Pointer arguments
+	// are userdata (nil => nullptr) and a std::tuple result returns
+	// multiple values.
+	template <auto F>
+	oitem bind(const char* name) {
+		oitem fn = bound<F>(F);
+		map_set(map_core(), make_string(name), fn);
+		return fn;
+	}
+
+	// Bind a member function known at compile time for object obj
+	template <auto F, class C>
+	oitem bind(const char* name, C* obj) {
+		oitem fn = bound<F>(obj, F);
+		map_set(map_core(), make_string(name), fn);
+		return fn;
+	}
+
+private:
+	template <typename T>
+	T unpack(span& in, int i) {
+		typedef std::decay_t<T> V;
+		if constexpr (std::is_same<V,bool>::value) return in.to_bool(i);
+		else if constexpr (std::is_integral<V>::value) return (V)in.to_integer(i);
+		else if constexpr (std::is_floating_point<V>::value) return (V)in.to_number(i);
+		else if constexpr (std::is_same<V,const char*>::value) return in.to_string(i);
+		else if constexpr (std::is_same<V,std::string>::value) return in.to_string(i);
+		else if constexpr (std::is_same<V,oitem>::value) return in[i];
+		else if constexpr (std::is_pointer<V>::value) return in.is_nil(i) ? nullptr: (V)in.to_data(i);
+		else static_assert(!sizeof(V), "unsupported callback argument type");
+	}
+
+	template <typename T>
+	void pack(span& in, int i, const T& val) {
+		typedef std::decay_t<T> V;
+		if constexpr (std::is_same<V,bool>::value) in.set_bool(i, val);
+		else if constexpr (std::is_integral<V>::value) in.set_integer(i, val);
+		else if constexpr (std::is_floating_point<V>::value) in.set_number(i, val);
+		else if constexpr (std::is_same<V,const char*>::value || std::is_same<V,char*>::value) in.set_string(i, val);
+		else if constexpr (std::is_same<V,std::string>::value) in.set_string(i, val.c_str());
+		else if constexpr (std::is_same<V,oitem>::value) in.set(i, val);
+		else if constexpr (std::is_pointer<V>::value) in.set(i, val ? make_data((void*)val): make_nil());
+		else static_assert(!sizeof(V), "unsupported callback result type");
+	}
+
+	template <typename T>
+	struct is_tuple: std::false_type {};
+
+	template <typename... T>
+	struct is_tuple<std::tuple<T...>>: std::true_type {};
+
+	template <typename R, size_t... I>
+	void pack_tuple(span& in, const R& res, std::index_sequence<I...>) {
+		(pack(in, I, std::get<I>(res)), ...);
+	}
+
+	template <typename R>
+	void returns(span& in, const R& res) {
+		if constexpr (is_tuple<R>::value) {
+			in.ret(std::tuple_size<R>::value);
+			pack_tuple(in, res, std::make_index_sequence<std::tuple_size<R>::value>());
+		}
+		else {
+			in.ret(1);
+			pack(in, 0, res);
+		}
+	}
+
+	template <typename R, typename... A, size_t... I>
+	void invoke(const std::function<R(A...)>& fn, std::index_sequence<I...>) {
+		span in = args();
+		if constexpr (std::is_void<R>::value) {
+			fn(unpack<A>(in, I)...);
+			in.ret(0);
+		}
+		else {
+			returns(in, fn(unpack<A>(in, I)...));
+		}
+	}
+
+	template <auto F, typename R, typename... A, size_t... I>
+	void invoke_bound(std::index_sequence<I...>) {
+		span in = args();
+		if constexpr (std::is_void<R>::value) {
+			F(unpack<A>(in, I)...);
+			in.ret(0);
+		}
+		else {
+			returns(in, F(unpack<A>(in, I)...));
+		}
+	}
+
+	template <auto F, class C, typename R, typename... A, size_t... I>
+	void invoke_bound(C* obj, std::index_sequence<I...>) {
+		span in = args();
+		if constexpr (std::is_void<R>::value) {
+			(obj->*F)(unpack<A>(in, I)...);
+			in.ret(0);
+		}
+		else {
+			returns(in, (obj->*F)(unpack<A>(in, I)...));
+		}
+	}
+
+	// at run time, in a collected slot if there is one
+	oitem registered(callable_t c) {
+		c.temp = session.active;
+		if (c.temp && callables_free.size()) {
+			int i = callables_free.back();
+			callables_free.pop_back();
+			callables[i] = c;
+			return smudge((item_t){.type = EXECUTE, .function = -(i+1)});
+		}
+		callables.push_back(c);
+		return smudge((item_t){.type = EXECUTE, .function = -(int)callables.size()});
+	}
+
+	oitem registered(std::function<void()> fn) {
+		callable_t c;
+		c.fn = fn;
+		return registered(c);
+	}
+
+	oitem registered(void (*direct)(Rela*, void*), void* obj) {
+		callable_t c;
+		c.direct = direct;
+		c.obj = obj;
+		return registered(c);
+	}
+
+	// one trampoline instantiated per bound function, called by call()
+	// without a std::function in between. Unlike a void() make_callback(),
+	// a bound void() still drops its arguments and returns nothing.
+	template <auto F, typename R, typename... A>
+	static void bound_direct(Rela* rela, void*) {
+		rela->invoke_bound<F,R,A...>(std::index_sequence_for<A...>());
+	}
+
+	template <auto F, class C, typename R, typename... A>
+	static void bound_method(Rela* rela, void* obj) {
+		rela->invoke_bound<F,C,R,A...>((C*)obj, std::index_sequence_for<A...>());
+	}
+
+	template <auto F, typename R, typename... A>
+	oitem bound(R (*)(A...)) {
+		return registered(&Rela::bound_direct<F,R,A...>, nullptr);
+	}
+
+	template <auto F, class C, typename R, typename... A>
+	oitem bound(C* obj, R (C::*)(A...)) {
+		return registered(&Rela::bound_method<F,C,R,A...>, obj);
+	}
+
+	template <auto F, class C, typename R, typename... A>
+	oitem bound(C* obj, R (C::*)(A...) const) {
+		return registered(&Rela::bound_method<F,C,R,A...>, obj);
+	}
+
+	template <typename R, typename... A>
+	oitem callable(std::function<R(A...)> fn) {
+		if constexpr (std::is_void<R>::value && sizeof...(A) == 0) return registered(fn);
+		else return registered([this,fn]() { invoke(fn, std::index_sequence_for<A...>()); });
+	}
+
+public:
+
 	#undef must
 };